@@ -0,0 +1,454 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "batch.h"
+
+/**
+ * One image on its way through the pipeline.
+ */
+typedef struct {
+  char *inPath;
+  char *outPath;
+  Image *image;
+} BatchItem;
+
+/**
+ * A fixed capacity FIFO of items shared between threads.  push() blocks
+ * while the queue is full and pop() while it is empty; once the queue is
+ * closed, pop() drains what is left and then returns NULL.
+ */
+typedef struct {
+  BatchItem **items;
+  int capacity;
+  int head;
+  int count;
+  int closed;
+  pthread_mutex_t lock;
+  pthread_cond_t notEmpty;
+  pthread_cond_t notFull;
+} BoundedQueue;
+
+static int queueInit(BoundedQueue *queue, int capacity) {
+  queue->items = (BatchItem **) malloc(sizeof(BatchItem *) * capacity);
+  if (queue->items == NULL) {
+    return 0;
+  }
+  queue->capacity = capacity;
+  queue->head = 0;
+  queue->count = 0;
+  queue->closed = 0;
+  pthread_mutex_init(&queue->lock, NULL);
+  pthread_cond_init(&queue->notEmpty, NULL);
+  pthread_cond_init(&queue->notFull, NULL);
+  return 1;
+}
+
+static void queueDestroy(BoundedQueue *queue) {
+  pthread_mutex_destroy(&queue->lock);
+  pthread_cond_destroy(&queue->notEmpty);
+  pthread_cond_destroy(&queue->notFull);
+  free(queue->items);
+}
+
+static void queuePush(BoundedQueue *queue, BatchItem *item) {
+  pthread_mutex_lock(&queue->lock);
+  while (queue->count == queue->capacity) {
+    pthread_cond_wait(&queue->notFull, &queue->lock);
+  }
+  queue->items[(queue->head + queue->count) % queue->capacity] = item;
+  queue->count++;
+  pthread_cond_signal(&queue->notEmpty);
+  pthread_mutex_unlock(&queue->lock);
+}
+
+static BatchItem *queuePop(BoundedQueue *queue) {
+  pthread_mutex_lock(&queue->lock);
+  while (queue->count == 0 && !queue->closed) {
+    pthread_cond_wait(&queue->notEmpty, &queue->lock);
+  }
+  BatchItem *item = NULL;
+  if (queue->count > 0) {
+    item = queue->items[queue->head];
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->count--;
+    pthread_cond_signal(&queue->notFull);
+  }
+  pthread_mutex_unlock(&queue->lock);
+  return item;
+}
+
+static void queueClose(BoundedQueue *queue) {
+  pthread_mutex_lock(&queue->lock);
+  queue->closed = 1;
+  pthread_cond_broadcast(&queue->notEmpty);
+  pthread_mutex_unlock(&queue->lock);
+}
+
+/**
+ * The output paths handed out so far, so that two inputs with the same
+ * name (in different directories of a manifest, or differing only in an
+ * extension that gets replaced) are never written to one file at once.
+ * An open addressing hash set, kept at most half full.
+ */
+typedef struct {
+  char **paths;
+  size_t capacity;
+  size_t count;
+} PathSet;
+
+static size_t hashPath(const char *path) {
+  // FNV-1a
+  size_t hash = 2166136261u;
+  for (; *path; path++) {
+    hash = (hash ^ (unsigned char) *path) * 16777619u;
+  }
+  return hash;
+}
+
+/**
+ * Finds the slot that holds path, or the empty slot it would go in.
+ */
+static char **pathSlot(char **paths, size_t capacity, const char *path) {
+  size_t i = hashPath(path) & (capacity - 1);
+  while (paths[i] != NULL && strcmp(paths[i], path) != 0) {
+    i = (i + 1) & (capacity - 1);
+  }
+  return &paths[i];
+}
+
+/**
+ * Adds a copy of path to the set.
+ *
+ * @return 1 if it was added, 0 if it was already there, -1 if memory ran out.
+ */
+static int pathSetAdd(PathSet *set, const char *path) {
+  if (2 * (set->count + 1) > set->capacity) {
+    size_t capacity = set->capacity ? 2 * set->capacity : 64;
+    char **paths = (char **) calloc(capacity, sizeof(char *));
+    if (paths == NULL) {
+      return -1;
+    }
+    for (size_t i = 0; i<set->capacity; i++) {
+      if (set->paths[i] != NULL) {
+        *pathSlot(paths, capacity, set->paths[i]) = set->paths[i];
+      }
+    }
+    free(set->paths);
+    set->paths = paths;
+    set->capacity = capacity;
+  }
+  char **slot = pathSlot(set->paths, set->capacity, path);
+  if (*slot != NULL) {
+    return 0;
+  }
+  if ((*slot = strdup(path)) == NULL) {
+    return -1;
+  }
+  set->count++;
+  return 1;
+}
+
+static void pathSetFree(PathSet *set) {
+  for (size_t i = 0; i<set->capacity; i++) {
+    free(set->paths[i]);
+  }
+  free(set->paths);
+}
+
+typedef struct Pipeline Pipeline;
+
+/**
+ * A pool of workers that pop items from in, process them and push the
+ * ones that should continue to out.  The last worker to finish closes
+ * out so the next stage knows no more items are coming.
+ */
+typedef struct {
+  Pipeline *pipeline;
+  BoundedQueue *in;
+  BoundedQueue *out;
+  int (*process)(Pipeline *pipeline, BatchItem *item);
+  int workers;
+  int running;
+  pthread_t *threads;
+} Stage;
+
+struct Pipeline {
+  const BatchOptions *options;
+  BoundedQueue paths;
+  BoundedQueue decoded;
+  BoundedQueue transformed;
+  PathSet outputs;
+  int processed;
+  int failed;
+};
+
+static void freeItem(BatchItem *item) {
+  imageFree(item->image);
+  free(item->inPath);
+  free(item->outPath);
+  free(item);
+}
+
+/**
+ * Finishes an item that is leaving the pipeline, successfully or not.
+ */
+static void retireItem(Pipeline *pipeline, BatchItem *item, int ok) {
+  __sync_fetch_and_add(ok ? &pipeline->processed : &pipeline->failed, 1);
+  freeItem(item);
+}
+
+/*
+ * The stage functions return 1 to pass the item on to the next stage,
+ * or 0 when they have retired it themselves.
+ */
+
+static int decodeItem(Pipeline *pipeline, BatchItem *item) {
+  const BatchOptions *options = pipeline->options;
+  if (options->lossless && imageSaveFormat(item->outPath) == IMAGE_FORMAT_JPEG) {
+    if (jpegTransformFile(item->inPath, item->outPath, options->transform, options->edges)) {
+      retireItem(pipeline, item, 1);
+      return 0;
+    }
+  }
+  item->image = imageLoad(item->inPath, 3);
+  if (item->image == NULL) {
+    retireItem(pipeline, item, 0);
+    return 0;
+  }
+  return 1;
+}
+
+static int transformItem(Pipeline *pipeline, BatchItem *item) {
+  Image *result = imageTransform(item->image, pipeline->options->transform);
+  if (result == NULL) {
+    retireItem(pipeline, item, 0);
+    return 0;
+  }
+  if (result != item->image) {
+    imageFree(item->image);
+    item->image = result;
+  }
+  return 1;
+}
+
+static int encodeItem(Pipeline *pipeline, BatchItem *item) {
+  int ok = imageSave(item->outPath, item->image);
+  if (!ok) {
+    fprintf(stderr, "Unable to save %s\n", item->outPath);
+  }
+  retireItem(pipeline, item, ok);
+  return 0;
+}
+
+static void *stageWorker(void *arg) {
+  Stage *stage = (Stage *) arg;
+  BatchItem *item;
+  while ((item = queuePop(stage->in)) != NULL) {
+    if (stage->process(stage->pipeline, item)) {
+      queuePush(stage->out, item);
+    }
+  }
+  if (__sync_sub_and_fetch(&stage->running, 1) == 0 && stage->out != NULL) {
+    queueClose(stage->out);
+  }
+  return NULL;
+}
+
+static int stageStart(Stage *stage, Pipeline *pipeline, BoundedQueue *in, BoundedQueue *out,
+                      int (*process)(Pipeline *, BatchItem *), int workers) {
+  stage->pipeline = pipeline;
+  stage->in = in;
+  stage->out = out;
+  stage->process = process;
+  stage->workers = 0;
+  stage->running = workers;
+  stage->threads = (pthread_t *) malloc(sizeof(pthread_t) * workers);
+  if (stage->threads == NULL) {
+    // nothing will feed the next stage
+    if (out != NULL) queueClose(out);
+    return 0;
+  }
+  for (int i = 0; i<workers; i++) {
+    if (pthread_create(&stage->threads[i], NULL, stageWorker, stage) != 0) {
+      // let the workers that did start account for the rest
+      __sync_sub_and_fetch(&stage->running, workers - i - 1);
+      if (__sync_sub_and_fetch(&stage->running, 1) == 0 && out != NULL) {
+        queueClose(out);
+      }
+      return i > 0;
+    }
+    stage->workers++;
+  }
+  return 1;
+}
+
+static void stageJoin(Stage *stage) {
+  for (int i = 0; i<stage->workers; i++) {
+    pthread_join(stage->threads[i], NULL);
+  }
+  free(stage->threads);
+}
+
+/**
+ * Queues one input file, naming its output after it.  If the output is
+ * saved in a different format than the name's extension says (see
+ * imageSetSaveOptions()), the extension is replaced with the format's.
+ * An input whose output name is already taken is counted as a failure.
+ */
+static void submitPath(Pipeline *pipeline, const char *inPath) {
+  const char *name = strrchr(inPath, '/');
+  name = name ? name + 1 : inPath;
+  ImageFormat format = imageSaveFormat(name);
+  const char *extension = NULL;
+  int nameLength = (int) strlen(name);
+  if (imageFormatFromPath(name) != IMAGE_FORMAT_AUTO && imageFormatFromPath(name) != format) {
+    extension = imageFormatExtension(format);
+    nameLength = (int) (strrchr(name, '.') - name);
+  }
+  BatchItem *item = (BatchItem *) calloc(1, sizeof(BatchItem));
+  size_t outLength = strlen(pipeline->options->outputDir) + nameLength + 2 + (extension ? strlen(extension) + 1 : 0);
+  if (item == NULL || (item->inPath = strdup(inPath)) == NULL ||
+      (item->outPath = (char *) malloc(outLength)) == NULL) {
+    if (item) freeItem(item);
+    __sync_fetch_and_add(&pipeline->failed, 1);
+    return;
+  }
+  snprintf(item->outPath, outLength, "%s/%.*s%s%s", pipeline->options->outputDir, nameLength, name,
+           extension ? "." : "", extension ? extension : "");
+  int added = pathSetAdd(&pipeline->outputs, item->outPath);
+  if (added <= 0) {
+    if (added == 0) {
+      fprintf(stderr, "Skipping %s: another input is already being written to %s\n", inPath, item->outPath);
+    }
+    freeItem(item);
+    __sync_fetch_and_add(&pipeline->failed, 1);
+    return;
+  }
+  queuePush(&pipeline->paths, item);
+}
+
+/**
+ * Feeds the pipeline with every regular file in a directory.
+ */
+static int submitDirectory(Pipeline *pipeline, const char *dirPath) {
+  DIR *dir = opendir(dirPath);
+  if (dir == NULL) {
+    return 0;
+  }
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (entry->d_name[0] == '.') {
+      continue;
+    }
+    size_t length = strlen(dirPath) + strlen(entry->d_name) + 2;
+    char *path = (char *) malloc(length);
+    if (path == NULL) {
+      __sync_fetch_and_add(&pipeline->failed, 1);
+      continue;
+    }
+    snprintf(path, length, "%s/%s", dirPath, entry->d_name);
+    struct stat info;
+    if (stat(path, &info) == 0 && S_ISREG(info.st_mode)) {
+      submitPath(pipeline, path);
+    }
+    free(path);
+  }
+  closedir(dir);
+  return 1;
+}
+
+/**
+ * Feeds the pipeline with every path listed in a manifest file, one per
+ * line.  Blank lines are skipped.
+ */
+static int submitManifest(Pipeline *pipeline, const char *manifestPath) {
+  FILE *manifest = fopen(manifestPath, "r");
+  if (manifest == NULL) {
+    return 0;
+  }
+  char *line = NULL;
+  size_t capacity = 0;
+  ssize_t length;
+  while ((length = getline(&line, &capacity, manifest)) != -1) {
+    while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r')) {
+      line[--length] = '\0';
+    }
+    if (length > 0) {
+      submitPath(pipeline, line);
+    }
+  }
+  free(line);
+  fclose(manifest);
+  return 1;
+}
+
+int runBatch(const BatchOptions *options, BatchResult *result) {
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  int threads = options->threads;
+  if (threads < 1) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = cpus > 0 ? (int) cpus : 1;
+  }
+  int depth = options->queueDepth > 0 ? options->queueDepth : 2 * threads;
+
+  Pipeline pipeline;
+  pipeline.options = options;
+  pipeline.processed = 0;
+  pipeline.failed = 0;
+  memset(&pipeline.outputs, 0, sizeof(PathSet));
+  if (!queueInit(&pipeline.paths, depth)) {
+    return 0;
+  }
+  if (!queueInit(&pipeline.decoded, depth)) {
+    queueDestroy(&pipeline.paths);
+    return 0;
+  }
+  if (!queueInit(&pipeline.transformed, depth)) {
+    queueDestroy(&pipeline.paths);
+    queueDestroy(&pipeline.decoded);
+    return 0;
+  }
+
+  // decoding and encoding dominate, so they get the threads; the transform is one pass
+  // over memory and a single worker keeps up with them
+  Stage decode, transform, encode;
+  int started = stageStart(&encode, &pipeline, &pipeline.transformed, NULL, encodeItem, threads);
+  started = stageStart(&transform, &pipeline, &pipeline.decoded, &pipeline.transformed, transformItem, 1) && started;
+  started = stageStart(&decode, &pipeline, &pipeline.paths, &pipeline.decoded, decodeItem, threads) && started;
+
+  struct stat info;
+  int listed = 0;
+  if (started) {
+    if (stat(options->input, &info) == 0 && S_ISDIR(info.st_mode)) {
+      listed = submitDirectory(&pipeline, options->input);
+    } else {
+      listed = submitManifest(&pipeline, options->input);
+    }
+    if (!listed) {
+      fprintf(stderr, "Unable to read %s\n", options->input);
+    }
+  }
+  queueClose(&pipeline.paths);
+
+  stageJoin(&decode);
+  stageJoin(&transform);
+  stageJoin(&encode);
+  queueDestroy(&pipeline.paths);
+  queueDestroy(&pipeline.decoded);
+  queueDestroy(&pipeline.transformed);
+  pathSetFree(&pipeline.outputs);
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  result->processed = pipeline.processed;
+  result->failed = pipeline.failed;
+  result->seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+  return started && listed;
+}
@@ -0,0 +1,43 @@
+/**
+ * Batch processing of many images with a multi-threaded pipeline.
+ *
+ * Each image goes through three stages: decode, transform and encode.
+ * Every stage runs on its own worker threads and hands images to the next
+ * through a bounded queue, so decoding and encoding of different images
+ * overlap while the number of images held in memory stays capped.
+ */
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "image_utils.h"
+#include "jpeg_transform.h"
+
+typedef struct {
+  const char *input;      // a directory of images, or a manifest file listing one path per line
+  const char *outputDir;  // results are written here under the input file's name
+  Transform transform;
+  int threads;            // decode and encode workers each; 0 = one per online CPU
+  int queueDepth;         // images each queue can hold; 0 = twice the thread count
+  int lossless;           // try the lossless JPEG path before decoding
+  JpegEdgeMode edges;
+} BatchOptions;
+
+typedef struct {
+  int processed;
+  int failed;
+  double seconds;
+} BatchResult;
+
+/**
+ * Transforms every image listed by options->input and writes the results
+ * to options->outputDir.  Failures on individual images are reported on
+ * stderr and counted, but don't stop the batch.  Two inputs that would be
+ * written to the same output file (same name in different directories)
+ * can't both be kept, so the second is skipped and counted as a failure.
+ *
+ * @return 1 if the batch ran (even if some images failed), 0 if the input
+ *         couldn't be listed or the workers couldn't be started.
+ */
+int runBatch(const BatchOptions *options, BatchResult *result);
+
+#endif
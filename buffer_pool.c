@@ -0,0 +1,188 @@
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include <pthread.h>
+
+#include "buffer_pool.h"
+
+// classes run from POOL_MIN_BLOCK (2^14) to just under 2^48 bytes, four per power of two
+#define MIN_SHIFT 14
+#define CLASS_COUNT ((48 - MIN_SHIFT) * 4)
+
+// bytes of blocks each thread keeps to itself, one block per class at most
+#define THREAD_CACHE_LIMIT ((size_t) 64 << 20)
+
+typedef struct FreeBlock {
+  struct FreeBlock *next;
+} FreeBlock;
+
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+static FreeBlock *shared[CLASS_COUNT];
+static size_t sharedBytes;
+static size_t sharedLimit = POOL_DEFAULT_LIMIT;
+
+static __thread void *cache[CLASS_COUNT];
+static __thread size_t cacheBytes;
+static __thread int cacheRegistered;
+static pthread_key_t cacheKey;
+static pthread_once_t cacheKeyOnce = PTHREAD_ONCE_INIT;
+
+static size_t classSize(int c) {
+  return (size_t) (4 + c % 4) << (MIN_SHIFT + c / 4 - 2);
+}
+
+static int log2Floor(size_t size) {
+  return 63 - __builtin_clzll((unsigned long long) size);
+}
+
+/**
+ * Returns the smallest class holding size bytes (at least POOL_MIN_BLOCK),
+ * or -1 if it is larger than any class.
+ */
+static int classAbove(size_t size) {
+  int k = log2Floor(size);
+  size_t step = (size_t) 1 << (k - 2);
+  int c = (k - MIN_SHIFT) * 4 + (int) ((size - ((size_t) 1 << k) + step - 1) / step);
+  return c < CLASS_COUNT ? c : -1;
+}
+
+/**
+ * Returns the largest class a block of size usable bytes can stand in
+ * for, or -1 if it is larger than any class.
+ */
+static int classBelow(size_t size) {
+  int k = log2Floor(size);
+  size_t step = (size_t) 1 << (k - 2);
+  int c = (k - MIN_SHIFT) * 4 + (int) ((size - ((size_t) 1 << k)) / step);
+  return c < CLASS_COUNT ? c : -1;
+}
+
+/**
+ * Puts a block in the shared pool, or frees it if the pool is full.
+ */
+static void releaseShared(void *block, int c) {
+  size_t size = classSize(c);
+  pthread_mutex_lock(&poolLock);
+  if (sharedBytes + size <= sharedLimit) {
+    ((FreeBlock *) block)->next = shared[c];
+    shared[c] = (FreeBlock *) block;
+    sharedBytes += size;
+    block = NULL;
+  }
+  pthread_mutex_unlock(&poolLock);
+  free(block);
+}
+
+/**
+ * Hands a thread's cached blocks to the shared pool when it exits.
+ */
+static void flushCache(void *value) {
+  void **blocks = (void **) value;
+  for (int c = 0; c<CLASS_COUNT; c++) {
+    if (blocks[c] != NULL) {
+      releaseShared(blocks[c], c);
+      blocks[c] = NULL;
+    }
+  }
+}
+
+/**
+ * Hands the calling thread's cached blocks to the shared pool now.
+ */
+static void flushOwnCache(void) {
+  if (cacheBytes > 0) {
+    flushCache(cache);
+    cacheBytes = 0;
+  }
+}
+
+static void makeCacheKey(void) {
+  pthread_key_create(&cacheKey, flushCache);
+}
+
+void *poolAlloc(size_t size) {
+  int c = size >= POOL_MIN_BLOCK ? classAbove(size) : -1;
+  if (c < 0) {
+    return malloc(size);
+  }
+  if (sharedLimit == 0) {
+    // pooling is off: let go of anything cached before it was turned off
+    flushOwnCache();
+    return malloc(classSize(c));
+  }
+  void *block = cache[c];
+  if (block != NULL) {
+    cache[c] = NULL;
+    cacheBytes -= classSize(c);
+    return block;
+  }
+  pthread_mutex_lock(&poolLock);
+  block = shared[c];
+  if (block != NULL) {
+    shared[c] = ((FreeBlock *) block)->next;
+    sharedBytes -= classSize(c);
+  }
+  pthread_mutex_unlock(&poolLock);
+  return block != NULL ? block : malloc(classSize(c));
+}
+
+void *poolRealloc(void *block, size_t size) {
+  if (block == NULL) {
+    return poolAlloc(size);
+  }
+  size_t usable = malloc_usable_size(block);
+  if (size <= usable) {
+    return block;
+  }
+  if (size < POOL_MIN_BLOCK) {
+    return realloc(block, size);
+  }
+  void *grown = poolAlloc(size);
+  if (grown != NULL) {
+    memcpy(grown, block, usable);
+    poolFree(block);
+  }
+  return grown;
+}
+
+void poolFree(void *block) {
+  if (block == NULL) return;
+  size_t usable = malloc_usable_size(block);
+  int c = usable >= POOL_MIN_BLOCK && sharedLimit > 0 ? classBelow(usable) : -1;
+  if (c < 0) {
+    free(block);
+    return;
+  }
+  if (cache[c] == NULL && cacheBytes + classSize(c) <= THREAD_CACHE_LIMIT) {
+    if (!cacheRegistered) {
+      pthread_once(&cacheKeyOnce, makeCacheKey);
+      pthread_setspecific(cacheKey, cache);
+      cacheRegistered = 1;
+    }
+    cache[c] = block;
+    cacheBytes += classSize(c);
+    return;
+  }
+  releaseShared(block, c);
+}
+
+void poolSetLimit(size_t bytes) {
+  pthread_mutex_lock(&poolLock);
+  sharedLimit = bytes;
+  pthread_mutex_unlock(&poolLock);
+  poolTrim();
+}
+
+void poolTrim(void) {
+  flushOwnCache();
+  pthread_mutex_lock(&poolLock);
+  for (int c = 0; c<CLASS_COUNT; c++) {
+    while (shared[c] != NULL) {
+      FreeBlock *block = shared[c];
+      shared[c] = block->next;
+      free(block);
+    }
+  }
+  sharedBytes = 0;
+  pthread_mutex_unlock(&poolLock);
+}
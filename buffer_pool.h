@@ -0,0 +1,70 @@
+/**
+ * A size-classed pool for the large buffers image work churns through:
+ * pixel blocks, decoder output and scratch, stb's own allocations.
+ *
+ * Released blocks are kept for reuse instead of going back to the
+ * system, first in a small cache for the releasing thread and then in a
+ * pool shared by all threads, so a batch of similar images stops mapping
+ * and faulting in fresh memory for every one.  Requests are rounded up
+ * to one of four size classes per power of two; small requests go
+ * straight to malloc().
+ *
+ * Each thread's cache holds at most 64 MB, and is only given back when
+ * the thread exits or calls poolTrim() or poolSetLimit() itself, so up to
+ * 64 MB per thread that has released blocks stays held on top of the
+ * shared pool's limit.
+ *
+ * Pooled blocks are ordinary malloc() blocks, so one released with
+ * free() instead of poolFree() is still released correctly; it just
+ * isn't kept for reuse.
+ */
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <stddef.h>
+
+/**
+ * Requests below this size aren't pooled.
+ */
+#define POOL_MIN_BLOCK (1 << 14)
+
+/**
+ * Bytes the shared pool holds on to by default.
+ */
+#define POOL_DEFAULT_LIMIT ((size_t) 256 << 20)
+
+/**
+ * Allocates a block of at least size bytes, reusing a released one of
+ * the same size class if there is one.
+ *
+ * @return The block, or NULL if allocation fails.
+ */
+void *poolAlloc(size_t size);
+
+/**
+ * Resizes a block as realloc() does.  Blocks that already have room are
+ * returned as they are.
+ */
+void *poolRealloc(void *block, size_t size);
+
+/**
+ * Releases a block from poolAlloc() (or any malloc() block) into the
+ * pool.  Passing NULL is a no-op.
+ */
+void poolFree(void *block);
+
+/**
+ * Sets how many bytes of released blocks the shared pool keeps; blocks
+ * released beyond that go back to the system.  0 disables pooling: the
+ * calling thread's cache is released at once, and other threads release
+ * theirs at their next poolAlloc().
+ */
+void poolSetLimit(size_t bytes);
+
+/**
+ * Returns every block held by the shared pool, and by the calling
+ * thread's cache, to the system.  Other threads' caches are left alone.
+ */
+void poolTrim(void);
+
+#endif
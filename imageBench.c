@@ -0,0 +1,233 @@
+/**
+ * This is a benchmark driver program that times the image
+ * transforms on a synthetic image and reports their throughput
+ * in megapixels per second (MP/s).
+ *
+ * The "naive" rows time the straightforward row-major loops the
+ * library used to have, as a baseline for the optimized kernels.
+ * Packed (RGB/RGBA) rows time the kernels writing into a preallocated
+ * result; Pixel rows go through the public API and so include the
+ * allocation of the result.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "image_utils.h"
+#include "image_kernels.h"
+#include "thread_pool.h"
+
+typedef struct {
+  Image *packed;
+  Image *packedOut;
+  Pixel **pixels;
+  int height;
+  int width;
+} BenchImage;
+
+// written by every operation so the compiler can't drop the work as dead stores
+volatile int benchSink;
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * Runs the given operation repeats times and returns the best rate in MP/s.
+ */
+static double bench(void (*op)(BenchImage *), BenchImage *image, int repeats) {
+  double best = 0;
+  for (int r = 0; r<repeats; r++) {
+    double start = now();
+    op(image);
+    double elapsed = now() - start;
+    if (best == 0 || elapsed < best) {
+      best = elapsed;
+    }
+  }
+  return ((double) image->height * image->width / 1e6) / best;
+}
+
+static void naiveTransposePacked(BenchImage *b) {
+  const Image *image = b->packed;
+  Image *t = b->packedOut;
+  for (int i = 0; i<image->height; i++) {
+    for (int j = 0; j<image->width; j++) {
+      memcpy(t->data + t->stride * j + image->channels * i,
+             image->data + image->stride * i + image->channels * j, image->channels);
+    }
+  }
+  benchSink = t->data[0];
+}
+
+static void tiledTransposePacked(BenchImage *b) {
+  transposePacked(b->packedOut->data, b->packedOut->stride, b->packed->data, b->packed->stride,
+                  b->height, b->width, b->packed->channels);
+}
+
+static void naiveTransposePixels(BenchImage *b) {
+  Pixel **t = (Pixel **) malloc(sizeof(Pixel *) * b->width);
+  t[0] = (Pixel *) malloc(sizeof(Pixel) * (size_t) b->width * b->height);
+  for (int i = 1; i<b->width; i++) {
+    t[i] = t[0] + (size_t) b->height * i;
+  }
+  for (int i = 0; i<b->height; i++) {
+    for (int j = 0; j<b->width; j++) {
+      t[j][i] = b->pixels[i][j];
+    }
+  }
+  benchSink = t[0][0].red;
+  free(t[0]);
+  free(t);
+}
+
+static void tiledTransposePixels(BenchImage *b) {
+  int tHeight, tWidth;
+  Pixel **t = transpose(b->pixels, b->height, b->width, &tHeight, &tWidth);
+  freeImage(t);
+}
+
+static void naiveRotatePacked(BenchImage *b) {
+  // the old two pass rotation: row-major transpose, then reverse every row
+  naiveTransposePacked(b);
+  Image *t = b->packedOut;
+  for (int i = 0; i<t->height; i++) {
+    unsigned char *left = t->data + t->stride * i;
+    unsigned char *right = left + t->channels * (t->width - 1);
+    unsigned char temp[4];
+    for (; left < right; left += t->channels, right -= t->channels) {
+      memcpy(temp, left, t->channels);
+      memcpy(left, right, t->channels);
+      memcpy(right, temp, t->channels);
+    }
+  }
+}
+
+static void rotatePacked(BenchImage *b) {
+  rotatePackedClockwise(b->packedOut->data, b->packedOut->stride, b->packed->data, b->packed->stride,
+                        b->height, b->width, b->packed->channels);
+}
+
+static void rotateCounterPacked(BenchImage *b) {
+  rotatePackedCounterClockwise(b->packedOut->data, b->packedOut->stride, b->packed->data, b->packed->stride,
+                               b->height, b->width, b->packed->channels);
+}
+
+static void rotate180Packed(BenchImage *b) {
+  // packedOut is (width x height) but holds the same number of bytes as a (height x width) image
+  rotatePacked180(b->packedOut->data, b->packed->stride, b->packed->data, b->packed->stride,
+                  b->height, b->width, b->packed->channels);
+}
+
+static void copyPacked(BenchImage *b) {
+  memcpy(b->packedOut->data, b->packed->data, b->packed->stride * b->height);
+}
+
+static void flipHorizontalPacked(BenchImage *b) {
+  imageFlipHorizontal(b->packed);
+}
+
+static void flipHorizontalPixels(BenchImage *b) {
+  flipHorizontal(b->pixels, b->height, b->width);
+}
+
+static void flipVerticalPacked(BenchImage *b) {
+  imageFlipVertical(b->packed);
+}
+
+static void flipVerticalPixels(BenchImage *b) {
+  flipVertical(b->pixels, b->height, b->width);
+}
+
+static void rotatePixels(BenchImage *b) {
+  Pixel **t = rotateClockwise(b->pixels, b->height, b->width);
+  freeImage(t);
+}
+
+// rotate clockwise, flip horizontally, rotate clockwise again
+static const Transform chainOps[] = { TRANSFORM_ROTATE_90, TRANSFORM_FLIP_HORIZONTAL, TRANSFORM_ROTATE_90 };
+
+static void chainStepsPixels(BenchImage *b) {
+  Pixel **r1 = rotateClockwise(b->pixels, b->height, b->width);
+  flipHorizontal(r1, b->width, b->height);
+  Pixel **r2 = rotateClockwise(r1, b->width, b->height);
+  freeImage(r1);
+  freeImage(r2);
+}
+
+static void chainFusedPixels(BenchImage *b) {
+  int height, width;
+  Transform transform = composeTransformList(chainOps, sizeof(chainOps) / sizeof(chainOps[0]));
+  Pixel **t = transformImage(b->pixels, b->height, b->width, transform, &height, &width);
+  if (t != b->pixels) {
+    freeImage(t);
+  }
+}
+
+int main(int argc, char **argv) {
+
+  int height = 4000;
+  int width = 6000;
+  int repeats = 5;
+  if (argc >= 3) {
+    height = atoi(argv[1]);
+    width = atoi(argv[2]);
+  }
+  if (argc >= 4) {
+    repeats = atoi(argv[3]);
+  }
+  int threads = argc >= 5 ? atoi(argv[4]) : 0;
+  if (height < 1 || width < 1 || repeats < 1 || threads < 0) {
+    fprintf(stderr, "Usage: imageBench [height width [repeats [threads]]]\n");
+    exit(1);
+  }
+  parallelSetThreads(threads);
+
+  printf("%d x %d image, best of %d runs (MP/s), %s threads\n", height, width, repeats,
+         threads ? argv[4] : "all");
+
+  BenchImage b = { NULL, NULL, NULL, height, width };
+  b.pixels = (Pixel **) malloc(sizeof(Pixel *) * height);
+  b.pixels[0] = (Pixel *) malloc(sizeof(Pixel) * (size_t) height * width);
+  for (int i = 0; i<height; i++) {
+    b.pixels[i] = b.pixels[0] + (size_t) width * i;
+    for (int j = 0; j<width; j++) {
+      Pixel p = { i & 255, j & 255, (i + j) & 255 };
+      b.pixels[i][j] = p;
+    }
+  }
+  printf("Pixel  transpose naive  %8.1f\n", bench(naiveTransposePixels, &b, repeats));
+  printf("Pixel  transpose tiled  %8.1f\n", bench(tiledTransposePixels, &b, repeats));
+  printf("Pixel  rotateClockwise  %8.1f\n", bench(rotatePixels, &b, repeats));
+  printf("Pixel  flipHorizontal   %8.1f\n", bench(flipHorizontalPixels, &b, repeats));
+  printf("Pixel  flipVertical     %8.1f\n", bench(flipVerticalPixels, &b, repeats));
+  printf("Pixel  3 ops, stepwise  %8.1f\n", bench(chainStepsPixels, &b, repeats));
+  printf("Pixel  3 ops, composed  %8.1f\n", bench(chainFusedPixels, &b, repeats));
+
+  for (int channels = 3; channels <= 4; channels++) {
+    b.packed = imageCreate(height, width, channels);
+    for (size_t k = 0; k < b.packed->stride * height; k++) {
+      b.packed->data[k] = (unsigned char) k;
+    }
+    b.packedOut = imageCreate(width, height, channels);
+    memset(b.packedOut->data, 0, b.packedOut->stride * width);
+    printf("%s   transpose naive  %8.1f\n", channels == 3 ? "RGB " : "RGBA", bench(naiveTransposePacked, &b, repeats));
+    printf("%s   transpose tiled  %8.1f\n", channels == 3 ? "RGB " : "RGBA", bench(tiledTransposePacked, &b, repeats));
+    printf("%s   rotate naive     %8.1f\n", channels == 3 ? "RGB " : "RGBA", bench(naiveRotatePacked, &b, repeats));
+    printf("%s   rotateClockwise  %8.1f\n", channels == 3 ? "RGB " : "RGBA", bench(rotatePacked, &b, repeats));
+    printf("%s   rotateCounter    %8.1f\n", channels == 3 ? "RGB " : "RGBA", bench(rotateCounterPacked, &b, repeats));
+    printf("%s   rotate180        %8.1f\n", channels == 3 ? "RGB " : "RGBA", bench(rotate180Packed, &b, repeats));
+    printf("%s   memcpy           %8.1f\n", channels == 3 ? "RGB " : "RGBA", bench(copyPacked, &b, repeats));
+    printf("%s   flipHorizontal   %8.1f\n", channels == 3 ? "RGB " : "RGBA", bench(flipHorizontalPacked, &b, repeats));
+    printf("%s   flipVertical     %8.1f\n", channels == 3 ? "RGB " : "RGBA", bench(flipVerticalPacked, &b, repeats));
+    imageFree(b.packed);
+    imageFree(b.packedOut);
+  }
+
+  free(b.pixels[0]);
+  free(b.pixels);
+  return 0;
+}
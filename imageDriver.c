@@ -5,40 +5,215 @@
  */
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "image_utils.h"
+#include "tiled_image.h"
+#include "jpeg_transform.h"
+#include "batch.h"
+#include "thread_pool.h"
+
+/**
+ * The transform each mode performs.  Mode 2 is a 180 degree rotation
+ * because flipVertical mirrors every row as well as reversing them.
+ */
+static const Transform modeTransforms[] = {
+  TRANSFORM_IDENTITY,
+  TRANSFORM_FLIP_HORIZONTAL,
+  TRANSFORM_ROTATE_180,
+  TRANSFORM_ROTATE_90,
+  TRANSFORM_ROTATE_270,
+  TRANSFORM_ROTATE_180
+};
+
+static void usage(void) {
+  fprintf(stderr, "Usage: [-j threads] [-l] [-e trim|strict] [-f format] [-q quality] [-s] [-t]\n");
+  fprintf(stderr, "           [-P megapixels] [-M megabytes] inputFileName outputFileName mode[,mode...]\n");
+  fprintf(stderr, "       -b [-j threads] [-l] [-e trim|strict] [-f format] [-q quality] [-s]\n");
+  fprintf(stderr, "           [-P megapixels] [-M megabytes] inputDirOrManifest outputDir mode[,mode...]\n");
+  fprintf(stderr, "  mode: 1  = Flip Horizontal\n");
+  fprintf(stderr, "        2  = Flip Vertical\n");
+  fprintf(stderr, "        3  = Rotate Clockwise\n");
+  fprintf(stderr, "        4  = Rotate Counter Clockwise\n");
+  fprintf(stderr, "        5  = Rotate 180\n");
+  fprintf(stderr, "  Several modes (e.g. 1,3,3) are applied in order in a single pass.\n");
+  fprintf(stderr, "  An inputFileName or outputFileName of - reads standard input or writes\n");
+  fprintf(stderr, "  standard output; without -f, output to - is a JPEG.\n");
+  fprintf(stderr, "  -l: transform JPEGs losslessly in the DCT domain, falling back to\n");
+  fprintf(stderr, "      decoding to pixels if the input can't be transformed that way\n");
+  fprintf(stderr, "  -e: with -l, how to handle partial MCUs at the right/bottom edge:\n");
+  fprintf(stderr, "      trim them off (default) or fall back to the pixel path\n");
+  fprintf(stderr, "  -b: batch mode; transforms every file in a directory, or every path\n");
+  fprintf(stderr, "      listed in a manifest file, into outputDir\n");
+  fprintf(stderr, "  -j: threads to split each transform across, or with -b, decode/encode\n");
+  fprintf(stderr, "      threads (default: one per CPU)\n");
+  fprintf(stderr, "  -f: output format: jpg, png, bmp, tga or hdr (default: from the output\n");
+  fprintf(stderr, "      file's extension, else jpg)\n");
+  fprintf(stderr, "  -q: JPEG quality, 1 to 100 (default: 100)\n");
+  fprintf(stderr, "  -s: store JPEG chroma at half resolution (4:2:0) for smaller files\n");
+  fprintf(stderr, "  -P, -M: refuse inputs larger than this many megapixels, or that would\n");
+  fprintf(stderr, "      need more than this much memory to decode and load, before decoding\n");
+  fprintf(stderr, "      them (a rotated copy of the image needs memory on top of that)\n");
+  fprintf(stderr, "  -t: hold the decoded image in tiles in a scratch file ($TMPDIR, else\n");
+  fprintf(stderr, "      /var/tmp) rather than in memory, for images too large to transform\n");
+  fprintf(stderr, "      in memory.  Baseline JPEGs are decoded into the tiles a band at a\n");
+  fprintf(stderr, "      time; other inputs are still decoded whole in memory first\n");
+  exit(1);
+}
+
+/**
+ * Parses a comma separated list of modes (e.g. "1,3,3") into the single
+ * transform that applies them all in order.
+ *
+ * @return 1 on success, 0 if any entry is not a valid mode.
+ */
+static int parseModes(const char *list, Transform *transform) {
+  *transform = TRANSFORM_IDENTITY;
+  const char *p = list;
+  while(1) {
+    char *end;
+    long mode = strtol(p, &end, 10);
+    if(end == p || mode < 1 || mode > 5 || (*end != ',' && *end != '\0')) {
+      return 0;
+    }
+    *transform = composeTransforms(*transform, modeTransforms[mode]);
+    if(*end == '\0') {
+      return 1;
+    }
+    p = end + 1;
+  }
+}
+
+/**
+ * Parses an output format name, which is the format's file extension.
+ *
+ * @return 1 on success, 0 if the name is not a known format.
+ */
+static int parseFormat(const char *name, ImageFormat *format) {
+  char path[16];
+  snprintf(path, sizeof(path), "x.%s", name);
+  *format = imageFormatFromPath(path);
+  return *format != IMAGE_FORMAT_AUTO;
+}
 
 int main(int argc, char **argv) {
 
   int height, width;
   char *inputFileName = NULL;
   char *outputFileName = NULL;
-  int mode = 0;
-  if(argc != 4) {
-    fprintf(stderr, "Usage: inputFileName outputFileName mode\n");
-    fprintf(stderr, "  mode: 1  = Flip Horizontal\n");
-    fprintf(stderr, "        2  = Flip Vertical\n");
-    fprintf(stderr, "        3  = Rotate Clockwise\n");
+  Transform transform;
+  int lossless = 0;
+  int batch = 0;
+  int threads = 0;
+  int tiled = 0;
+  JpegEdgeMode edges = JPEG_EDGE_TRIM;
+  SaveOptions save = { IMAGE_FORMAT_AUTO, 100, 0 };
+  ImageBudget budget = { 0, 0 };
+  int opt;
+  while((opt = getopt(argc, argv, "le:bj:f:q:sP:M:t")) != -1) {
+    if(opt == 'l') {
+      lossless = 1;
+    } else if(opt == 'b') {
+      batch = 1;
+    } else if(opt == 'j' && atoi(optarg) > 0) {
+      threads = atoi(optarg);
+    } else if(opt == 'e' && strcmp(optarg, "trim") == 0) {
+      edges = JPEG_EDGE_TRIM;
+    } else if(opt == 'e' && strcmp(optarg, "strict") == 0) {
+      edges = JPEG_EDGE_STRICT;
+    } else if(opt == 'f' && parseFormat(optarg, &save.format)) {
+    } else if(opt == 'q' && atoi(optarg) >= 1 && atoi(optarg) <= 100) {
+      save.quality = atoi(optarg);
+    } else if(opt == 's') {
+      save.subsample = 1;
+    } else if(opt == 't') {
+      tiled = 1;
+    } else if(opt == 'P' && atof(optarg) > 0) {
+      budget.maxPixels = (size_t) (atof(optarg) * 1000000);
+    } else if(opt == 'M' && atof(optarg) > 0) {
+      budget.maxBytes = (size_t) (atof(optarg) * 1024 * 1024);
+    } else {
+      usage();
+    }
+  }
+  if(argc - optind != 3) {
+    usage();
+  }
+  inputFileName = argv[optind];
+  outputFileName = argv[optind + 1];
+  if(!parseModes(argv[optind + 2], &transform)) {
+    fprintf(stderr, "ERROR: invalid mode list %s\n", argv[optind + 2]);
     exit(1);
-  } else {
-    inputFileName = argv[1];
-    outputFileName = argv[2];
-    mode = atoi(argv[3]);
-  }
-  Pixel **image = loadImage(inputFileName, &height, &width);
-  if(mode == 1) {
-    flipHorizontal(image, height, width);
-    saveImage(outputFileName, image, height, width);
-  } else if(mode == 2) {
-    flipVertical(image, height, width);
-    saveImage(outputFileName, image, height, width);
-  } else if(mode == 3) {
-    Pixel ** rotated = rotateClockwise(image, height, width);
-    saveImage(outputFileName, rotated, width, height);
-  } else {
-    fprintf(stderr, "ERROR: invalid mode %d\n", mode);
+  }
+  imageSetSaveOptions(&save);
+  imageSetBudget(&budget);
+
+  if(batch && tiled) {
+    fprintf(stderr, "ERROR: -t can't be combined with -b\n");
+    exit(1);
+  }
+  if(batch) {
+    // the pipeline already keeps the cores busy with whole images
+    BatchOptions options = { inputFileName, outputFileName, transform, threads, 0, lossless, edges };
+    BatchResult result;
+    int ran = runBatch(&options, &result);
+    printf("%d images in %.2f s (%.1f images/sec), %d failed\n", result.processed, result.seconds,
+           result.seconds > 0 ? result.processed / result.seconds : 0.0, result.failed);
+    return ran && result.failed == 0 ? 0 : 1;
+  }
+
+  parallelSetThreads(threads);
+  // the input is read once, since standard input can't be read again if the lossless path gives up
+  JpegFileData input;
+  if(!jpegMapFile(inputFileName, &input)) {
+    fprintf(stderr, "Unable to load %s: %s\n", inputFileName, jpegFailureReason());
+    exit(1);
+  }
+  // the lossless path rearranges the input's JPEG data, so it can only write JPEGs
+  if(lossless && imageSaveFormat(outputFileName) == IMAGE_FORMAT_JPEG) {
+    if(jpegTransformMemory(input.data, input.length, outputFileName, transform, edges)) {
+      jpegUnmapFile(&input);
+      return 0;
+    }
+    fprintf(stderr, "lossless transform not possible (%s), decoding instead\n", jpegFailureReason());
+  }
+
+  if(tiled) {
+    // the transform only reorients the tiles; the pixels move as the encoder reads the rows
+    TiledImage *image = tiledLoadFromMemory(input.data, input.length, 3);
+    jpegUnmapFile(&input);
+    if(image == NULL) {
+      exit(1);
+    }
+    tiledTransform(image, transform);
+    int saved = tiledSave(outputFileName, image);
+    if(!saved) {
+      fprintf(stderr, "Unable to save %s: %s\n", outputFileName, jpegFailureReason());
+    }
+    tiledFree(image);
+    return saved ? 0 : 1;
+  }
+
+  // however many modes were given, the image is decoded, transformed and encoded once
+  Pixel **image = loadImageFromMemory(input.data, input.length, &height, &width);
+  jpegUnmapFile(&input);
+  if(image == NULL) {
     exit(1);
   }
+  int newHeight, newWidth;
+  Pixel **result = transformImage(image, height, width, transform, &newHeight, &newWidth);
+  if(result == NULL) {
+    freeImage(image);
+    exit(1);
+  }
+  int saved = saveImage(outputFileName, result, newHeight, newWidth);
+
+  // transforms that keep the shape work in place and hand back the same image
+  if(result != image) {
+    freeImage(result);
+  }
+  freeImage(image);
 
-  return 0;
+  return saved ? 0 : 1;
 }
@@ -35,6 +35,7 @@ int main(int argc, char **argv) {
   Pixel p6 = {255,0,255};
   image[1][2] = p6;
   saveImage(outputFileName, image, y, x);
+  freeImage(image);
 
   y = 256;
   x = 256;
@@ -54,6 +55,7 @@ int main(int argc, char **argv) {
   }
 
   saveImage("pallet.jpg", image, y, x);
+  freeImage(image);
 
   return 0;
 }
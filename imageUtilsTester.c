@@ -0,0 +1,2139 @@
+/**
+ * This is a test driver program that checks the image utilities
+ * against simple reference implementations.  Every check that fails
+ * prints what it was doing, and the program exits nonzero if any did.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "stb_image.h"
+#include "stb_image_write.h"
+
+#include "image_utils.h"
+#include "image_kernels.h"
+#include "jpeg_coefficients.h"
+#include "jpeg_transform.h"
+#include "batch.h"
+#include "thread_pool.h"
+#include "jpeg_encoder.h"
+#include "jpeg_decoder.h"
+#include "buffer_pool.h"
+#include "tiled_image.h"
+
+/**
+ * Image sizes to check, as (height, width): single pixels and lines,
+ * and sizes just off the tile boundaries.
+ */
+static const int sizes[][2] = { {1, 1}, {1, 700}, {700, 1}, {37, 53}, {255, 257}, {333, 250} };
+#define SIZE_COUNT ((int) (sizeof(sizes) / sizeof(sizes[0])))
+
+static const char *simdNames[] = { "scalar", "SSE2", "SSSE3", "AVX2" };
+
+// what the kernels are currently limited to, for the failure messages
+static char setting[64];
+
+/**
+ * Maps pixel [i][j] of a (height x width) image to its place in the
+ * result of a transform.
+ */
+typedef void (*PointMap)(int height, int width, int i, int j, int *newI, int *newJ);
+
+static void transposePoint(int height, int width, int i, int j, int *newI, int *newJ) {
+  *newI = j;
+  *newJ = i;
+}
+
+static void clockwisePoint(int height, int width, int i, int j, int *newI, int *newJ) {
+  *newI = j;
+  *newJ = height - 1 - i;
+}
+
+static void counterClockwisePoint(int height, int width, int i, int j, int *newI, int *newJ) {
+  *newI = width - 1 - j;
+  *newJ = i;
+}
+
+static void identityPoint(int height, int width, int i, int j, int *newI, int *newJ) {
+  *newI = i;
+  *newJ = j;
+}
+
+static void flipPoint(int height, int width, int i, int j, int *newI, int *newJ) {
+  *newI = height - 1 - i;
+  *newJ = j;
+}
+
+static void transversePoint(int height, int width, int i, int j, int *newI, int *newJ) {
+  *newI = width - 1 - j;
+  *newJ = height - 1 - i;
+}
+
+static void mirrorPoint(int height, int width, int i, int j, int *newI, int *newJ) {
+  *newI = i;
+  *newJ = width - 1 - j;
+}
+
+static void rotate180Point(int height, int width, int i, int j, int *newI, int *newJ) {
+  *newI = height - 1 - i;
+  *newJ = width - 1 - j;
+}
+
+/**
+ * Creates an image of random pixels.
+ */
+static Image *makeImage(int height, int width, int channels) {
+  Image *image = imageCreate(height, width, channels);
+  if (image == NULL) {
+    printf("imageCreate failed!\n");
+    exit(1);
+  }
+  for (int i = 0; i<height; i++) {
+    for (int k = 0; k<width * channels; k++) {
+      image->data[image->stride * i + k] = (unsigned char) rand();
+    }
+  }
+  return image;
+}
+
+/**
+ * Where each transform moves a pixel, whether the result is (width x
+ * height), and whether it reverses the source's rows or its columns.
+ */
+static const struct {
+  PointMap map;
+  int swapsAxes;
+  int reversesRows;
+  int reversesColumns;
+} transforms[] = {
+  [TRANSFORM_IDENTITY] = { identityPoint, 0, 0, 0 },
+  [TRANSFORM_FLIP_HORIZONTAL] = { mirrorPoint, 0, 1, 0 },
+  [TRANSFORM_FLIP_VERTICAL] = { flipPoint, 0, 0, 1 },
+  [TRANSFORM_ROTATE_90] = { clockwisePoint, 1, 0, 1 },
+  [TRANSFORM_ROTATE_180] = { rotate180Point, 0, 1, 1 },
+  [TRANSFORM_ROTATE_270] = { counterClockwisePoint, 1, 1, 0 },
+  [TRANSFORM_TRANSPOSE] = { transposePoint, 1, 0, 0 },
+  [TRANSFORM_TRANSVERSE] = { transversePoint, 1, 1, 1 }
+};
+
+/**
+ * Returns the transform that undoes the given one.
+ */
+static Transform inverseOf(Transform transform) {
+  Transform inverse = TRANSFORM_IDENTITY;
+  while (composeTransforms(transform, inverse) != TRANSFORM_IDENTITY) {
+    inverse = (Transform) (inverse + 1);
+  }
+  return inverse;
+}
+
+/**
+ * Copies an image into one whose rows are padded, so that kernels with a
+ * fast path for tightly packed images take their general path.  Release
+ * it with freePadded().
+ */
+static Image *makePadded(const Image *image) {
+  Image *padded = (Image *) malloc(sizeof(Image));
+  *padded = *image;
+  padded->stride = (size_t) image->width * image->channels + 5;
+  padded->data = (unsigned char *) malloc(padded->stride * image->height);
+  for (int i = 0; i<image->height; i++) {
+    memcpy(padded->data + padded->stride * i, image->data + image->stride * i, (size_t) image->width * image->channels);
+  }
+  return padded;
+}
+
+static void freePadded(Image *padded) {
+  free(padded->data);
+  free(padded);
+}
+
+/**
+ * Moves every pixel of an image to where the map sends it, one at a
+ * time.  swapsAxes says whether the result is (width x height).
+ */
+static Image *referenceRemap(const Image *image, PointMap map, int swapsAxes) {
+  int height = swapsAxes ? image->width : image->height;
+  int width = swapsAxes ? image->height : image->width;
+  Image *result = makeImage(height, width, image->channels);
+  for (int i = 0; i<image->height; i++) {
+    for (int j = 0; j<image->width; j++) {
+      int ni, nj;
+      map(image->height, image->width, i, j, &ni, &nj);
+      memcpy(result->data + result->stride * ni + (size_t) nj * image->channels,
+             image->data + image->stride * i + (size_t) j * image->channels, image->channels);
+    }
+  }
+  return result;
+}
+
+/**
+ * Compares an image with the one expected, printing a failure.
+ *
+ * @return 0 if they match, 1 if not.
+ */
+static int checkImage(const char *name, const Image *result, const Image *expected) {
+  int same = result != NULL && result->height == expected->height && result->width == expected->width &&
+             result->channels == expected->channels;
+  for (int i = 0; same && i<expected->height; i++) {
+    same = memcmp(result->data + result->stride * i, expected->data + expected->stride * i,
+                  (size_t) expected->width * expected->channels) == 0;
+  }
+  if (!same) {
+    printf("%s failed! (%dx%d result, %d channels, %s)\n", name, expected->height, expected->width,
+           expected->channels, setting);
+  }
+  return !same;
+}
+
+/**
+ * Compares an image with the one expected, allowing each sample to be
+ * off by up to tolerance, and prints a failure.
+ *
+ * @return 0 if they match, 1 if not.
+ */
+static int checkImageNear(const char *name, const Image *result, const Image *expected, int tolerance) {
+  int same = result != NULL && result->height == expected->height && result->width == expected->width &&
+             result->channels == expected->channels;
+  for (int i = 0; same && i<expected->height; i++) {
+    const unsigned char *a = result->data + result->stride * i;
+    const unsigned char *b = expected->data + expected->stride * i;
+    for (int k = 0; same && k<expected->width * expected->channels; k++) {
+      same = abs(a[k] - b[k]) <= tolerance;
+    }
+  }
+  if (!same) {
+    printf("%s failed! (%dx%d result, %d channels, %s)\n", name, expected->height, expected->width,
+           expected->channels, setting);
+  }
+  return !same;
+}
+
+/**
+ * Copies a 3-channel image into a Pixel array in the loadImage() layout.
+ */
+static Pixel **makePixels(const Image *image) {
+  Pixel **pixels = (Pixel **) malloc(sizeof(Pixel *) * image->height);
+  pixels[0] = (Pixel *) malloc(sizeof(Pixel) * image->height * image->width);
+  for (int i = 0; i<image->height; i++) {
+    pixels[i] = pixels[0] + (size_t) image->width * i;
+    const unsigned char *row = image->data + image->stride * i;
+    for (int j = 0; j<image->width; j++) {
+      pixels[i][j].red = row[3 * j];
+      pixels[i][j].green = row[3 * j + 1];
+      pixels[i][j].blue = row[3 * j + 2];
+    }
+  }
+  return pixels;
+}
+
+/**
+ * Compares a Pixel array with the 3-channel image expected, printing a
+ * failure.
+ *
+ * @return 0 if they match, 1 if not.
+ */
+static int checkPixels(const char *name, Pixel **result, int height, int width, const Image *expected) {
+  int same = result != NULL && height == expected->height && width == expected->width;
+  for (int i = 0; same && i<height; i++) {
+    const unsigned char *row = expected->data + expected->stride * i;
+    for (int j = 0; same && j<width; j++) {
+      same = result[i][j].red == row[3 * j] && result[i][j].green == row[3 * j + 1] &&
+             result[i][j].blue == row[3 * j + 2];
+    }
+  }
+  if (!same) {
+    printf("%s failed! (%dx%d result, %s)\n", name, expected->height, expected->width, setting);
+  }
+  return !same;
+}
+
+/**
+ * Checks a transform that returns a new image against the reference.
+ *
+ * @return 0 if it matches, 1 if not.
+ */
+static int checkTransform(const char *name, Image *(*transform)(const Image *), const Image *image,
+                          PointMap map, int swapsAxes) {
+  Image *expected = referenceRemap(image, map, swapsAxes);
+  Image *result = transform(image);
+  int failed = checkImage(name, result, expected);
+  imageFree(result);
+  imageFree(expected);
+  return failed;
+}
+
+/**
+ * Checks a Pixel transform that returns a new array against the
+ * reference, on a 3-channel image.
+ *
+ * @return 0 if it matches, 1 if not.
+ */
+static int checkPixelTransform(const char *name, Pixel **(*transform)(Pixel **, int, int), const Image *image,
+                               PointMap map, int swapsAxes) {
+  Image *expected = referenceRemap(image, map, swapsAxes);
+  Pixel **pixels = makePixels(image);
+  Pixel **result = transform(pixels, image->height, image->width);
+  int failed = checkPixels(name, result, expected->height, expected->width, expected);
+  freeImage(result);
+  freeImage(pixels);
+  imageFree(expected);
+  return failed;
+}
+
+/**
+ * Checks a transform that works in place against the reference, on a
+ * tightly packed copy of the image and on one with padded rows.
+ *
+ * @return The number of mismatches.
+ */
+static int checkInPlace(const char *name, void (*transform)(Image *), const Image *image, PointMap map) {
+  Image *expected = referenceRemap(image, map, 0);
+  Image *copy = imageCopy(image);
+  Image *padded = makePadded(image);
+  transform(copy);
+  transform(padded);
+  int failures = checkImage(name, copy, expected);
+  failures += checkImage(name, padded, expected);
+  freePadded(padded);
+  imageFree(copy);
+  imageFree(expected);
+  return failures;
+}
+
+/**
+ * Checks a Pixel transform that works in place against the reference,
+ * on a 3-channel image.
+ *
+ * @return 0 if it matches, 1 if not.
+ */
+static int checkPixelInPlace(const char *name, void (*transform)(Pixel **, int, int), const Image *image,
+                             PointMap map) {
+  Image *expected = referenceRemap(image, map, 0);
+  Pixel **pixels = makePixels(image);
+  transform(pixels, image->height, image->width);
+  int failed = checkPixels(name, pixels, image->height, image->width, expected);
+  freeImage(pixels);
+  imageFree(expected);
+  return failed;
+}
+
+static Pixel **transposePixels(Pixel **image, int height, int width) {
+  int tHeight, tWidth;
+  return transpose(image, height, width, &tHeight, &tWidth);
+}
+
+/**
+ * Checks the transposing and rotating kernels, which have their own
+ * paths for 3- and 4-byte pixels, through the Image and Pixel transforms.
+ */
+static int testRotations(void) {
+  int failures = 0;
+  for (int s = 0; s<SIZE_COUNT; s++) {
+    for (int n = 1; n<=4; n++) {
+      Image *image = makeImage(sizes[s][0], sizes[s][1], n);
+      Image *padded = makePadded(image);
+      failures += checkTransform("imageTranspose", imageTranspose, image, transposePoint, 1);
+      failures += checkTransform("imageRotateClockwise", imageRotateClockwise, image, clockwisePoint, 1);
+      failures += checkTransform("imageRotateCounterClockwise", imageRotateCounterClockwise, image,
+                                 counterClockwisePoint, 1);
+      failures += checkTransform("imageRotate180", imageRotate180, image, rotate180Point, 0);
+      failures += checkTransform("imageRotate180 (padded rows)", imageRotate180, padded, rotate180Point, 0);
+      if (n == 3) {
+        failures += checkPixelTransform("transpose", transposePixels, image, transposePoint, 1);
+        failures += checkPixelTransform("rotateClockwise", rotateClockwise, image, clockwisePoint, 1);
+        failures += checkPixelTransform("rotateCounterClockwise", rotateCounterClockwise, image,
+                                        counterClockwisePoint, 1);
+        failures += checkPixelTransform("rotate180", rotate180, image, rotate180Point, 0);
+      }
+      freePadded(padded);
+      imageFree(image);
+    }
+  }
+  return failures;
+}
+
+/**
+ * Checks the flips, which reverse the image in place, with the row
+ * reversal's SSE2, SSSE3 and AVX2 paths.  flipVertical() mirrors every
+ * row as well as swapping them, so it is a 180 degree rotation.
+ */
+static int testFlips(void) {
+  int failures = 0;
+  for (int s = 0; s<SIZE_COUNT; s++) {
+    for (int n = 1; n<=4; n++) {
+      Image *image = makeImage(sizes[s][0], sizes[s][1], n);
+      failures += checkInPlace("imageFlipHorizontal", imageFlipHorizontal, image, mirrorPoint);
+      failures += checkInPlace("imageReverseRows", imageReverseRows, image, mirrorPoint);
+      failures += checkInPlace("imageFlipVertical", imageFlipVertical, image, rotate180Point);
+      if (n == 3) {
+        failures += checkPixelInPlace("flipHorizontal", flipHorizontal, image, mirrorPoint);
+        failures += checkPixelInPlace("reverseRows", reverseRows, image, mirrorPoint);
+        failures += checkPixelInPlace("flipVertical", flipVertical, image, rotate180Point);
+      }
+      imageFree(image);
+    }
+  }
+  return failures;
+}
+
+/**
+ * Checks copyImage() on contiguous images and on images whose rows were
+ * allocated one by one, and imageCopy() on packed and padded rows.
+ */
+static int testCopy(void) {
+  int failures = 0;
+  for (int s = 0; s<SIZE_COUNT; s++) {
+    Image *image = makeImage(sizes[s][0], sizes[s][1], 3);
+    Pixel **pixels = makePixels(image);
+    Pixel **rows = (Pixel **) malloc(sizeof(Pixel *) * image->height);
+    for (int i = 0; i<image->height; i++) {
+      rows[i] = (Pixel *) malloc(sizeof(Pixel) * image->width);
+      memcpy(rows[i], pixels[i], sizeof(Pixel) * image->width);
+    }
+    for (int layout = 0; layout<2; layout++) {
+      Pixel **copy = copyImage(layout ? rows : pixels, image->height, image->width);
+      failures += checkPixels(layout ? "copyImage (separate rows)" : "copyImage", copy, image->height,
+                              image->width, image);
+      freeImage(copy);
+    }
+    for (int i = 0; i<image->height; i++) {
+      free(rows[i]);
+    }
+    free(rows);
+    freeImage(pixels);
+
+    Image *padded = makePadded(image);
+    for (int pad = 0; pad<=1; pad++) {
+      Image *copy = imageCopy(pad ? padded : image);
+      failures += checkImage(pad ? "imageCopy (padded rows)" : "imageCopy", copy, image);
+      if (copy != NULL && copy->stride != (size_t) image->width * 3) {
+        printf("imageCopy failed! (stride %zu for %d pixels)\n", copy->stride, image->width);
+        failures++;
+      }
+      imageFree(copy);
+    }
+    freePadded(padded);
+    imageFree(image);
+  }
+  return failures;
+}
+
+/**
+ * Marks each item of a range it is given, counting repeats.
+ */
+static void markRange(void *context, int begin, int end) {
+  int *marks = (int *) context;
+  for (int i = begin; i<end; i++) {
+    __atomic_fetch_add(&marks[i], 1, __ATOMIC_RELAXED);
+  }
+}
+
+/**
+ * Checks that a pool runs every item of a loop exactly once, for ranges
+ * smaller than, equal to and not a multiple of its thread count.
+ */
+static int testThreadPool(void) {
+  static const int ranges[][2] = { {0, 0}, {0, 1}, {5, 8}, {0, 4}, {3, 1000}, {0, 10007} };
+  int failures = 0;
+  for (int threads = 1; threads<=5; threads += 2) {
+    ThreadPool *pool = threadPoolCreate(threads);
+    if (pool == NULL || threadPoolThreads(pool) != threads) {
+      printf("threadPoolCreate failed! (%d threads)\n", threads);
+      failures++;
+      threadPoolDestroy(pool);
+      continue;
+    }
+    for (int r = 0; r<(int) (sizeof(ranges) / sizeof(ranges[0])); r++) {
+      int begin = ranges[r][0], end = ranges[r][1];
+      int *marks = (int *) calloc(end + 1, sizeof(int));
+      threadPoolFor(pool, begin, end, markRange, marks);
+      for (int i = 0; i<=end; i++) {
+        if (marks[i] != (i >= begin && i < end)) {
+          printf("threadPoolFor failed! (%d threads, [%d, %d), item %d ran %d times)\n",
+                 threads, begin, end, i, marks[i]);
+          failures++;
+          break;
+        }
+      }
+      free(marks);
+    }
+    threadPoolDestroy(pool);
+  }
+  return failures;
+}
+
+/**
+ * Checks imageTransform() and transformImage() for every transform.
+ */
+static int testTransforms(void) {
+  int failures = 0;
+  for (int s = 0; s<SIZE_COUNT; s++) {
+    for (int n = 1; n<=4; n++) {
+      Image *image = makeImage(sizes[s][0], sizes[s][1], n);
+      for (int t = 0; t<8; t++) {
+        Image *expected = referenceRemap(image, transforms[t].map, transforms[t].swapsAxes);
+        Image *copy = imageCopy(image);
+        Image *result = imageTransform(copy, (Transform) t);
+        failures += checkImage("imageTransform", result, expected);
+        if (result != copy) {
+          imageFree(result);
+        }
+        imageFree(copy);
+
+        if (n == 3) {
+          Pixel **pixels = makePixels(image);
+          int height, width;
+          Pixel **transformed = transformImage(pixels, image->height, image->width, (Transform) t, &height, &width);
+          failures += checkPixels("transformImage", transformed, height, width, expected);
+          if (transformed != pixels) {
+            freeImage(transformed);
+          }
+          freeImage(pixels);
+        }
+        imageFree(expected);
+      }
+      imageFree(image);
+    }
+  }
+  return failures;
+}
+
+/**
+ * Checks that composing two transforms gives the one that moves each
+ * pixel where applying them in turn does, and that a list collapses the
+ * same way.
+ */
+static int testComposition(void) {
+  int failures = 0;
+  Image *image = makeImage(5, 7, 1);
+  for (int a = 0; a<8; a++) {
+    Image *first = referenceRemap(image, transforms[a].map, transforms[a].swapsAxes);
+    for (int b = 0; b<8; b++) {
+      Image *both = referenceRemap(first, transforms[b].map, transforms[b].swapsAxes);
+      Transform composed = composeTransforms((Transform) a, (Transform) b);
+      Image *direct = referenceRemap(image, transforms[composed].map, transforms[composed].swapsAxes);
+      snprintf(setting, sizeof(setting), "%d then %d", a, b);
+      failures += checkImage("composeTransforms", direct, both);
+      imageFree(direct);
+
+      for (int c = 0; c<8; c++) {
+        Transform list[] = { (Transform) a, (Transform) b, (Transform) c };
+        if (composeTransformList(list, 3) != composeTransforms(composed, (Transform) c)) {
+          printf("composeTransformList failed! (%d, %d, %d)\n", a, b, c);
+          failures++;
+        }
+      }
+      imageFree(both);
+    }
+    imageFree(first);
+  }
+  if (composeTransformList(NULL, 0) != TRANSFORM_IDENTITY) {
+    printf("composeTransformList failed! (empty list)\n");
+    failures++;
+  }
+  imageFree(image);
+  return failures;
+}
+
+/**
+ * An encoded file collected in memory.
+ */
+typedef struct {
+  unsigned char *data;
+  size_t length;
+  size_t capacity;
+} MemoryFile;
+
+static int appendFile(void *context, const void *data, size_t size) {
+  MemoryFile *file = (MemoryFile *) context;
+  if (file->length + size > file->capacity) {
+    size_t capacity = (file->length + size) * 2;
+    unsigned char *grown = (unsigned char *) realloc(file->data, capacity);
+    if (grown == NULL) {
+      return 0;
+    }
+    file->data = grown;
+    file->capacity = capacity;
+  }
+  memcpy(file->data + file->length, data, size);
+  file->length += size;
+  return 1;
+}
+
+static void appendStb(void *context, void *data, int size) {
+  appendFile(context, data, (size_t) size);
+}
+
+static const unsigned char *imageRows(void *context, int row, unsigned char *buffer) {
+  const Image *image = (const Image *) context;
+  return image->data + image->stride * row;
+}
+
+static const unsigned char *tiledRows(void *context, int row, unsigned char *buffer) {
+  tiledReadRow((TiledImage *) context, row, buffer);
+  return buffer;
+}
+
+/**
+ * Creates a test image for the JPEG checks: smooth gradients, so the
+ * files look like photos, with some noise so every coefficient gets
+ * exercised.
+ */
+static Image *makePhoto(int height, int width, int channels) {
+  Image *image = makeImage(height, width, channels);
+  for (int i = 0; i<height; i++) {
+    unsigned char *row = image->data + image->stride * i;
+    for (int j = 0; j<width; j++) {
+      for (int c = 0; c<channels; c++) {
+        row[j * channels + c] = (unsigned char) ((i * (c + 1) + j * (3 - c) + rand() % 24) & 0xFF);
+      }
+    }
+  }
+  return image;
+}
+
+/**
+ * Creates a test image of gradients that stay within range across the
+ * whole image, so they have no sharp edges, with a little noise.
+ */
+static Image *makeGradient(int height, int width, int channels) {
+  Image *image = makeImage(height, width, channels);
+  for (int i = 0; i<height; i++) {
+    unsigned char *row = image->data + image->stride * i;
+    for (int j = 0; j<width; j++) {
+      for (int c = 0; c<channels; c++) {
+        row[j * channels + c] = (unsigned char) ((i * (c + 1) * 200 / height + j * (3 - c) * 200 / width) / 4 + rand() % 8);
+      }
+    }
+  }
+  return image;
+}
+
+/**
+ * Decodes a JPEG held in memory with stb into a new 3-channel image,
+ * keeping only its top left (height x width) pixels.
+ */
+static Image *decodeCropped(const unsigned char *data, size_t length, int height, int width) {
+  int w, h, c;
+  unsigned char *pixels = stbi_load_from_memory(data, (int) length, &w, &h, &c, 3);
+  if (pixels == NULL || w < width || h < height) {
+    stbi_image_free(pixels);
+    return NULL;
+  }
+  Image *image = makeImage(height, width, 3);
+  for (int i = 0; i<height; i++) {
+    memcpy(image->data + image->stride * i, pixels + (size_t) w * 3 * i, (size_t) width * 3);
+  }
+  stbi_image_free(pixels);
+  return image;
+}
+
+/**
+ * Encodes an image with the restart encoder into memory.
+ *
+ * @return The file, or one with NULL data on failure.
+ */
+static MemoryFile encodeRestart(const Image *image, int quality, int subsample) {
+  MemoryFile file = { NULL, 0, 0 };
+  if (!jpegEncode(appendFile, &file, image->width, image->height, image->channels, quality, subsample,
+                  imageRows, (void *) image)) {
+    free(file.data);
+    file.data = NULL;
+  }
+  return file;
+}
+
+/**
+ * A writer that takes the given number of bytes and then fails.
+ */
+static int limitedWrite(void *context, const void *data, size_t size) {
+  size_t *room = (size_t *) context;
+  if (size > *room) {
+    return 0;
+  }
+  *room -= size;
+  return 1;
+}
+
+/**
+ * The restart encoder must produce the same pixels as stbi_write_jpg()
+ * at the same quality; only the restart markers differ.
+ */
+static int testEncoder(void) {
+  static const int qualities[] = { 50, 90, 100 };
+  int failures = 0;
+  for (int s = 0; s<SIZE_COUNT; s++) {
+    for (int n = 1; n<=4; n++) {
+      Image *image = makePhoto(sizes[s][0], sizes[s][1], n);
+      for (int q = 0; q<3; q++) {
+        MemoryFile ours = encodeRestart(image, qualities[q], 0);
+        MemoryFile theirs = { NULL, 0, 0 };
+        stbi_write_jpg_to_func(appendStb, &theirs, image->width, image->height, n, image->data, qualities[q]);
+
+        int w1, h1, w2, h2, c;
+        unsigned char *a = ours.data == NULL ? NULL : stbi_load_from_memory(ours.data, (int) ours.length, &w1, &h1, &c, n);
+        unsigned char *b = stbi_load_from_memory(theirs.data, (int) theirs.length, &w2, &h2, &c, n);
+        if (a == NULL || b == NULL || w1 != w2 || h1 != h2 || memcmp(a, b, (size_t) w1 * h1 * n) != 0) {
+          printf("jpegEncode failed! (%dx%d, %d channels, quality %d)\n", image->height, image->width, n,
+                 qualities[q]);
+          failures++;
+        }
+        stbi_image_free(a);
+        stbi_image_free(b);
+        free(ours.data);
+        free(theirs.data);
+      }
+      imageFree(image);
+    }
+  }
+
+  // subsampled chroma has no stb counterpart, so it is held to staying close to the full-resolution file
+  for (int s = 0; s<SIZE_COUNT; s++) {
+    for (int n = 3; n<=4; n++) {
+      Image *image = makeGradient(sizes[s][0], sizes[s][1], n);
+      MemoryFile full = encodeRestart(image, 90, 0);
+      MemoryFile half = encodeRestart(image, 90, 1);
+      Image *a = full.data == NULL ? NULL : decodeCropped(full.data, full.length, image->height, image->width);
+      Image *b = half.data == NULL ? NULL : decodeCropped(half.data, half.length, image->height, image->width);
+      snprintf(setting, sizeof(setting), "4:2:0 against 4:4:4");
+      failures += checkImageNear("jpegEncode", b, a, 16);
+      imageFree(a);
+      imageFree(b);
+      free(full.data);
+      free(half.data);
+      imageFree(image);
+    }
+  }
+
+  // a write that fails in the headers, the first window of strips or a later one aborts the encode
+  Image *image = makePhoto(1200, 40, 3);
+  MemoryFile whole = encodeRestart(image, 90, 0);
+  size_t limits[] = { 100, whole.length / 4, whole.length - 1 };
+  for (int k = 0; k<3; k++) {
+    size_t room = limits[k];
+    if (jpegEncode(limitedWrite, &room, image->width, image->height, 3, 90, 0, imageRows, image)) {
+      printf("jpegEncode failed! (ignored a write error after %zu of %zu bytes)\n", limits[k], whole.length);
+      failures++;
+    }
+  }
+  free(whole.data);
+  imageFree(image);
+  return failures;
+}
+
+/**
+ * The parallel decoder must return exactly the pixels stbi_load() does,
+ * for gray and color files, with and without subsampled chroma, at every
+ * output channel count.
+ */
+static int testDecoder(void) {
+  int failures = 0;
+  for (int s = 0; s<SIZE_COUNT; s++) {
+    if (sizes[s][0] <= 16) {
+      // a single strip has no restart markers, so the decoder leaves it to stb
+      continue;
+    }
+    for (int n = 1; n<=3; n += 2) {
+      for (int subsample = 0; subsample<=1; subsample++) {
+        Image *image = makePhoto(sizes[s][0], sizes[s][1], n);
+        MemoryFile file = encodeRestart(image, 90, subsample);
+        for (int channels = 1; channels<=4; channels++) {
+          int w1, h1, w2, h2, c;
+          unsigned char *a = file.data == NULL ? NULL : jpegDecodePixels(file.data, file.length, &w1, &h1, channels);
+          unsigned char *b = stbi_load_from_memory(file.data, (int) file.length, &w2, &h2, &c, channels);
+          if (a == NULL || b == NULL || w1 != w2 || h1 != h2 || memcmp(a, b, (size_t) w1 * h1 * channels) != 0) {
+            printf("jpegDecodePixels failed! (%dx%d, %d components%s, %d channels: %s)\n", image->height,
+                   image->width, n, subsample ? " 4:2:0" : "", channels, a == NULL ? jpegFailureReason() : "mismatch");
+            failures++;
+          }
+          poolFree(a);
+          stbi_image_free(b);
+        }
+        free(file.data);
+        imageFree(image);
+      }
+    }
+  }
+  return failures;
+}
+
+/**
+ * Collects the rows jpegDecodeRows() passes on, checking they come in order.
+ */
+typedef struct {
+  unsigned char *pixels;
+  size_t rowBytes;
+  int next;
+  int outOfOrder;
+} RowCollector;
+
+static void collectRow(void *context, int row, const unsigned char *pixels) {
+  RowCollector *collector = (RowCollector *) context;
+  if (row != collector->next++) {
+    collector->outOfOrder = 1;
+    return;
+  }
+  memcpy(collector->pixels + collector->rowBytes * row, pixels, collector->rowBytes);
+}
+
+/**
+ * Checks jpegDecodeRows() against stb for files with and without restart
+ * markers, with and without subsampled chroma, in bands of several heights.
+ *
+ * @return The number of failures.
+ */
+static int testDecodeRows(void) {
+  static const int bandHeights[] = { 1, 16, 40, 1000 };
+  int failures = 0;
+  for (int s = 0; s<SIZE_COUNT; s++) {
+    for (int n = 1; n<=3; n += 2) {
+      for (int source = 0; source<3; source++) {
+        // ours with restart markers (4:4:4 and 4:2:0), and stb's without
+        Image *image = makePhoto(sizes[s][0], sizes[s][1], n);
+        MemoryFile file = { NULL, 0, 0 };
+        if (source < 2) {
+          file = encodeRestart(image, 90, source);
+        } else {
+          stbi_write_jpg_to_func(appendStb, &file, image->width, image->height, n, image->data, 90);
+        }
+        for (int channels = 1; channels<=4; channels++) {
+          int w, h, c;
+          unsigned char *expected = stbi_load_from_memory(file.data, (int) file.length, &w, &h, &c, channels);
+          RowCollector collector = { (unsigned char *) malloc((size_t) w * h * channels), (size_t) w * channels, 0, 0 };
+          for (int b = 0; b<4; b++) {
+            collector.next = 0;
+            collector.outOfOrder = 0;
+            memset(collector.pixels, 0, (size_t) w * h * channels);
+            int ok = jpegDecodeRows(file.data, file.length, channels, bandHeights[b], collectRow, &collector);
+            if (!ok || collector.outOfOrder || collector.next != h ||
+                memcmp(collector.pixels, expected, (size_t) w * h * channels) != 0) {
+              printf("jpegDecodeRows failed! (%dx%d, %d components, %s, %d channels, bands of %d rows: %s)\n",
+                     image->height, image->width, n, source == 0 ? "restart" : source == 1 ? "restart 4:2:0" : "stb",
+                     channels, bandHeights[b], !ok ? jpegFailureReason() : collector.outOfOrder ? "out of order" :
+                     collector.next != h ? "rows missing" : "mismatch");
+              failures++;
+            }
+          }
+          free(collector.pixels);
+          stbi_image_free(expected);
+        }
+        free(file.data);
+        imageFree(image);
+      }
+    }
+  }
+  return failures;
+}
+
+/**
+ * Compares the blocks two images have in common.
+ *
+ * @return 1 if every block inside both images is the same, else 0.
+ */
+static int sameCoefficients(const JpegCoefImage *a, const JpegCoefImage *b) {
+  if (a->numComponents != b->numComponents) {
+    return 0;
+  }
+  for (int c = 0; c<a->numComponents; c++) {
+    const JpegComponent *ca = &a->comp[c];
+    const JpegComponent *cb = &b->comp[c];
+    // the padding out to whole MCUs is arbitrary, so only blocks inside the image count
+    int wide = ((a->width < b->width ? a->width : b->width) * ca->h / a->maxH + 7) / 8;
+    int high = ((a->height < b->height ? a->height : b->height) * ca->v / a->maxV + 7) / 8;
+    for (int by = 0; by<high; by++) {
+      const short *ra = ca->coefs + (size_t) 64 * by * ca->blocksWide;
+      const short *rb = cb->coefs + (size_t) 64 * by * cb->blocksWide;
+      if (memcmp(ra, rb, sizeof(short) * 64 * wide) != 0) {
+        return 0;
+      }
+    }
+  }
+  return 1;
+}
+
+/**
+ * Checks one lossless transform of a JPEG with JPEG_EDGE_TRIM: it must
+ * drop exactly the partial MCUs that would land on the top or left
+ * edge, decode to (nearly) the pixel transform of what is left, and give
+ * back the source's coefficients when undone.
+ *
+ * @return The number of failures.
+ */
+static int checkLossless(const JpegCoefImage *source, int t) {
+  int width = source->width;
+  int height = source->height;
+  int mcuWidth = 8 * source->maxH;
+  int mcuHeight = 8 * source->maxV;
+  if (transforms[t].reversesRows) {
+    width -= width % mcuWidth;
+  }
+  if (transforms[t].reversesColumns) {
+    height -= height % mcuHeight;
+  }
+
+  JpegCoefImage moved, back;
+  if (width == 0 || height == 0) {
+    // nothing would be left, so the transform must refuse
+    if (jpegTransformCoefficients(source, &moved, (Transform) t, JPEG_EDGE_TRIM)) {
+      printf("jpegTransformCoefficients failed! (%dx%d, transform %d: trimmed to nothing)\n", source->height,
+             source->width, t);
+      jpegFreeCoefficients(&moved);
+      return 1;
+    }
+    return 0;
+  }
+  if (!jpegTransformCoefficients(source, &moved, (Transform) t, JPEG_EDGE_TRIM)) {
+    printf("jpegTransformCoefficients failed! (%dx%d, transform %d: %s)\n", source->height, source->width, t,
+           jpegFailureReason());
+    return 1;
+  }
+
+  int failures = 0;
+  int swaps = transforms[t].swapsAxes;
+  if (moved.width != (swaps ? height : width) || moved.height != (swaps ? width : height)) {
+    printf("jpegTransformCoefficients failed! (%dx%d, transform %d: trimmed to %dx%d)\n", source->height,
+           source->width, t, moved.height, moved.width);
+    failures++;
+  } else if (!jpegTransformCoefficients(&moved, &back, inverseOf((Transform) t), JPEG_EDGE_STRICT)) {
+    // what is left is whole MCUs along every reversed edge, so undoing the transform trims nothing
+    printf("jpegTransformCoefficients failed! (%dx%d, transform %d undone: %s)\n", source->height,
+           source->width, t, jpegFailureReason());
+    failures++;
+  } else {
+    if (back.width != width || back.height != height || !sameCoefficients(source, &back)) {
+      printf("lossless round trip failed! (%dx%d, transform %d)\n", source->height, source->width, t);
+      failures++;
+    }
+
+    // the trimmed source is decoded from the round trip, since chroma upsampling reaches past a cut edge
+    size_t backLength, movedLength;
+    unsigned char *backFile = jpegWriteCoefficients(&back, &backLength);
+    unsigned char *movedFile = jpegWriteCoefficients(&moved, &movedLength);
+    Image *original = backFile == NULL ? NULL : decodeCropped(backFile, backLength, height, width);
+    Image *expected = original == NULL ? NULL : referenceRemap(original, transforms[t].map, swaps);
+    Image *result = movedFile == NULL ? NULL : decodeCropped(movedFile, movedLength, moved.height, moved.width);
+    if (expected == NULL) {
+      printf("jpegWriteCoefficients failed! (%dx%d, transform %d undone)\n", source->height, source->width, t);
+      failures++;
+    } else {
+      snprintf(setting, sizeof(setting), "transform %d of %dx%d", t, source->height, source->width);
+      // stb's integer IDCT rounds a little differently once blocks are mirrored or transposed
+      failures += checkImageNear("jpegTransformCoefficients", result, expected, 4);
+    }
+    imageFree(result);
+    imageFree(expected);
+    imageFree(original);
+    poolFree(movedFile);
+    poolFree(backFile);
+    jpegFreeCoefficients(&back);
+  }
+  jpegFreeCoefficients(&moved);
+  return failures;
+}
+
+/**
+ * Checks the lossless JPEG transforms, and that coefficients survive
+ * being written out and read back, for stb's files and for restart
+ * marker files with subsampled chroma.
+ */
+static int testLossless(void) {
+  int failures = 0;
+  for (int s = 0; s<SIZE_COUNT; s++) {
+    for (int subsample = 0; subsample<=1; subsample++) {
+      Image *image = makePhoto(sizes[s][0], sizes[s][1], 3);
+      MemoryFile file = { NULL, 0, 0 };
+      if (subsample) {
+        file = encodeRestart(image, 90, 1);
+      } else {
+        stbi_write_jpg_to_func(appendStb, &file, image->width, image->height, 3, image->data, 90);
+      }
+      JpegCoefImage source;
+      if (!jpegReadCoefficients(file.data, file.length, &source)) {
+        printf("jpegReadCoefficients failed! (%dx%d: %s)\n", image->height, image->width, jpegFailureReason());
+        failures++;
+      } else {
+        size_t length;
+        unsigned char *written = jpegWriteCoefficients(&source, &length);
+        JpegCoefImage reread;
+        if (written == NULL || !jpegReadCoefficients(written, length, &reread)) {
+          printf("jpegWriteCoefficients failed! (%dx%d)\n", image->height, image->width);
+          failures++;
+        } else {
+          if (reread.width != source.width || reread.height != source.height || !sameCoefficients(&source, &reread)) {
+            printf("coefficient round trip failed! (%dx%d)\n", image->height, image->width);
+            failures++;
+          }
+          jpegFreeCoefficients(&reread);
+        }
+        poolFree(written);
+
+        for (int t = 0; t<8; t++) {
+          failures += checkLossless(&source, t);
+        }
+        jpegFreeCoefficients(&source);
+      }
+      free(file.data);
+      imageFree(image);
+    }
+  }
+
+  // a component naming a quantization table no DQT segment defined, or one past the last, is refused
+  Image *image = makePhoto(sizes[3][0], sizes[3][1], 3);
+  MemoryFile file = { NULL, 0, 0 };
+  stbi_write_jpg_to_func(appendStb, &file, image->width, image->height, 3, image->data, 90);
+  size_t sof = 2;
+  while (sof + 4 < file.length && !(file.data[sof] == 0xFF && file.data[sof + 1] == 0xC0)) {
+    sof += 4 + (file.data[sof + 2] << 8) + file.data[sof + 3] - 2;
+  }
+  for (int selector = 2; selector<=5; selector += 3) {
+    unsigned char saved = file.data[sof + 12];
+    file.data[sof + 12] = (unsigned char) selector;
+    JpegCoefImage source;
+    if (jpegReadCoefficients(file.data, file.length, &source)) {
+      printf("jpegReadCoefficients failed! (accepted quantization table %d)\n", selector);
+      failures++;
+      jpegFreeCoefficients(&source);
+    }
+    file.data[sof + 12] = saved;
+  }
+  free(file.data);
+  imageFree(image);
+
+  // an 8x8 gray image whose one AC code is a single bit for an 8-bit magnitude,
+  // so the value 200 is read through the lookahead table
+  static const unsigned char header[] = {
+    0xFF, 0xD8,
+    0xFF, 0xC0, 0x00, 0x0B, 0x08, 0x00, 0x08, 0x00, 0x08, 0x01, 0x01, 0x11, 0x00,
+    0xFF, 0xC4, 0x00, 0x14, 0x00, 0x01, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x00,
+    0xFF, 0xC4, 0x00, 0x15, 0x10, 0x01, 0x01, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x08, 0x00,
+    0xFF, 0xDA, 0x00, 0x08, 0x01, 0x01, 0x00, 0x00, 0x3F, 0x00,
+    0x32, 0x2F,
+    0xFF, 0xD9
+  };
+  unsigned char crafted[sizeof(header) + 69];
+  memcpy(crafted, header, 2);
+  static const unsigned char dqt[] = { 0xFF, 0xDB, 0x00, 0x43, 0x00 };
+  memcpy(crafted + 2, dqt, sizeof(dqt));
+  memset(crafted + 2 + sizeof(dqt), 1, 64);
+  memcpy(crafted + 71, header + 2, sizeof(header) - 2);
+  JpegCoefImage source;
+  if (!jpegReadCoefficients(crafted, sizeof(crafted), &source)) {
+    printf("jpegReadCoefficients failed! (one bit AC code: %s)\n", jpegFailureReason());
+    failures++;
+  } else {
+    if (source.comp[0].coefs[0] != 0 || source.comp[0].coefs[1] != 200) {
+      printf("jpegReadCoefficients failed! (one bit AC code read as %d, expected 200)\n", source.comp[0].coefs[1]);
+      failures++;
+    }
+    jpegFreeCoefficients(&source);
+  }
+  return failures;
+}
+
+/**
+ * Checks that the lossless path carries APPn segments through, and resets
+ * the EXIF orientation once the pixels have been rotated.
+ *
+ * @return The number of failures.
+ */
+static int testMarkers(void) {
+  int failures = 0;
+  // a big endian EXIF segment whose IFD0 holds orientation 6, then the start of an ICC profile
+  unsigned char segments[] = {
+    0xFF, 0xE1, 0x00, 0x22, 'E', 'x', 'i', 'f', 0, 0,
+    'M', 'M', 0x00, 0x2A, 0x00, 0x00, 0x00, 0x08,
+    0x00, 0x01,
+    0x01, 0x12, 0x00, 0x03, 0x00, 0x00, 0x00, 0x01, 0x00, 0x06, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00,
+    0xFF, 0xE2, 0x00, 0x10, 'I', 'C', 'C', '_', 'P', 'R', 'O', 'F', 'I', 'L', 'E', 0, 0x01, 0x01
+  };
+  size_t orientation = 4 + 6 + 8 + 2 + 8;
+
+  Image *image = makePhoto(sizes[3][0], sizes[3][1], 3);
+  MemoryFile file = { NULL, 0, 0 };
+  stbi_write_jpg_to_func(appendStb, &file, image->width, image->height, 3, image->data, 90);
+  imageFree(image);
+  MemoryFile tagged = { NULL, 0, 0 };
+  appendFile(&tagged, file.data, 2);
+  appendFile(&tagged, segments, sizeof(segments));
+  appendFile(&tagged, file.data + 2, file.length - 2);
+  free(file.data);
+
+  JpegCoefImage source;
+  if (!jpegReadCoefficients(tagged.data, tagged.length, &source)) {
+    printf("jpegReadCoefficients failed! (with EXIF: %s)\n", jpegFailureReason());
+    free(tagged.data);
+    return 1;
+  }
+  Transform kept[] = { TRANSFORM_IDENTITY, TRANSFORM_ROTATE_90 };
+  for (int k = 0; k<2; k++) {
+    segments[orientation + 1] = kept[k] == TRANSFORM_IDENTITY ? 6 : 1;
+    JpegCoefImage moved;
+    size_t length;
+    unsigned char *written = NULL;
+    if (jpegTransformCoefficients(&source, &moved, kept[k], JPEG_EDGE_TRIM)) {
+      written = jpegWriteCoefficients(&moved, &length);
+      jpegFreeCoefficients(&moved);
+    }
+    if (written == NULL || length < 2 + sizeof(segments) || memcmp(written + 2, segments, sizeof(segments)) != 0) {
+      printf("jpegTransformCoefficients failed! (transform %d: APP1/APP2 segments not carried over as expected)\n",
+             kept[k]);
+      failures++;
+    }
+    poolFree(written);
+  }
+  jpegFreeCoefficients(&source);
+  free(tagged.data);
+  return failures;
+}
+
+/**
+ * Deletes a directory and the files in it.
+ */
+static void removeDirectory(const char *dirPath) {
+  DIR *dir = opendir(dirPath);
+  if (dir == NULL) {
+    return;
+  }
+  struct dirent *entry;
+  char path[512];
+  while ((entry = readdir(dir)) != NULL) {
+    if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+      snprintf(path, sizeof(path), "%s/%s", dirPath, entry->d_name);
+      unlink(path);
+    }
+  }
+  closedir(dir);
+  rmdir(dirPath);
+}
+
+/**
+ * Checks that imageLoad() returns the pixels stbi_load() does, packed
+ * and in the decoder's own block, for a PNG, a plain JPEG and a
+ * restart-marker JPEG at every channel count.
+ */
+static int testLoad(void) {
+  int failures = 0;
+  char root[] = "/tmp/imageUtilsTesterXXXXXX";
+  if (mkdtemp(root) == NULL) {
+    printf("testLoad failed! (unable to create a scratch directory)\n");
+    return 1;
+  }
+  char paths[3][512];
+  snprintf(paths[0], sizeof(paths[0]), "%s/photo.png", root);
+  snprintf(paths[1], sizeof(paths[1]), "%s/photo.jpg", root);
+  snprintf(paths[2], sizeof(paths[2]), "%s/restart.jpg", root);
+  Image *image = makePhoto(sizes[4][0], sizes[4][1], 3);
+  stbi_write_png(paths[0], image->width, image->height, 3, image->data, (int) image->stride);
+  stbi_write_jpg(paths[1], image->width, image->height, 3, image->data, 90);
+  MemoryFile restart = encodeRestart(image, 90, 0);
+  FILE *file = fopen(paths[2], "wb");
+  fwrite(restart.data, 1, restart.length, file);
+  fclose(file);
+  free(restart.data);
+  imageFree(image);
+
+  for (int f = 0; f<3; f++) {
+    for (int channels = 1; channels<=4; channels++) {
+      int width, height, c;
+      unsigned char *expected = stbi_load(paths[f], &width, &height, &c, channels);
+      Image *loaded = imageLoad(paths[f], channels);
+      if (loaded == NULL || expected == NULL || loaded->width != width || loaded->height != height ||
+          loaded->channels != channels || loaded->stride != (size_t) width * channels ||
+          loaded->storage != IMAGE_STORAGE_STB || memcmp(loaded->data, expected, loaded->stride * height) != 0) {
+        printf("imageLoad failed! (%s, %d channels)\n", paths[f], channels);
+        failures++;
+      }
+      stbi_image_free(expected);
+      imageFree(loaded);
+    }
+    unlink(paths[f]);
+  }
+  if (imageLoad(paths[0], 3) != NULL || imageLoad(paths[1], 5) != NULL) {
+    printf("imageLoad failed! (accepted a missing file or 5 channels)\n");
+    failures++;
+  }
+  rmdir(root);
+  return failures;
+}
+
+/**
+ * Returns the size of a file, or 0 if it can't be read.
+ */
+static long fileSize(const char *path) {
+  struct stat info;
+  return stat(path, &info) == 0 ? (long) info.st_size : 0;
+}
+
+/**
+ * Checks that the save options choose the format and JPEG settings, and
+ * that the lossless formats read back exactly, from packed and padded
+ * rows and from Pixel images.
+ */
+static int testSave(void) {
+  int failures = 0;
+  static const struct {
+    const char *path;
+    ImageFormat format;
+  } names[] = {
+    { "a.jpg", IMAGE_FORMAT_JPEG }, { "a.JPEG", IMAGE_FORMAT_JPEG }, { "a.png", IMAGE_FORMAT_PNG },
+    { "a.bmp", IMAGE_FORMAT_BMP }, { "a.Tga", IMAGE_FORMAT_TGA }, { "a.hdr", IMAGE_FORMAT_HDR },
+    { "a", IMAGE_FORMAT_AUTO }, { "a.gif", IMAGE_FORMAT_AUTO }, { "dir.png/a", IMAGE_FORMAT_AUTO }
+  };
+  for (int k = 0; k<(int) (sizeof(names) / sizeof(names[0])); k++) {
+    if (imageFormatFromPath(names[k].path) != names[k].format) {
+      printf("imageFormatFromPath failed! (%s)\n", names[k].path);
+      failures++;
+    }
+  }
+  SaveOptions options = { IMAGE_FORMAT_AUTO, 100, 0 };
+  imageSetSaveOptions(&options);
+  if (imageSaveFormat("a.gif") != IMAGE_FORMAT_JPEG || imageSaveFormat("a.tga") != IMAGE_FORMAT_TGA) {
+    printf("imageSaveFormat failed! (automatic)\n");
+    failures++;
+  }
+  options.format = IMAGE_FORMAT_PNG;
+  imageSetSaveOptions(&options);
+  if (imageSaveFormat("a.jpg") != IMAGE_FORMAT_PNG) {
+    printf("imageSaveFormat failed! (PNG set)\n");
+    failures++;
+  }
+  options.format = IMAGE_FORMAT_AUTO;
+  imageSetSaveOptions(&options);
+
+  char root[] = "/tmp/imageUtilsTesterXXXXXX";
+  if (mkdtemp(root) == NULL) {
+    printf("testSave failed! (unable to create a scratch directory)\n");
+    return failures + 1;
+  }
+  char path[512];
+  static const char *lossless[] = { "png", "bmp", "tga" };
+  for (int f = 0; f<3; f++) {
+    snprintf(path, sizeof(path), "%s/image.%s", root, lossless[f]);
+    // stb's BMP writer drops alpha and expands gray
+    for (int n = f == 1 ? 3 : 1; n<=(f == 1 ? 3 : 4); n++) {
+      Image *image = makeImage(sizes[3][0], sizes[3][1], n);
+      Image *padded = makePadded(image);
+      for (int pad = 0; pad<=1; pad++) {
+        snprintf(setting, sizeof(setting), "%s%s", lossless[f], pad ? ", padded rows" : "");
+        Image *loaded = imageSave(path, pad ? padded : image) ? imageLoad(path, n) : NULL;
+        failures += checkImage("imageSave", loaded, image);
+        imageFree(loaded);
+      }
+      if (n == 3) {
+        Pixel **pixels = makePixels(image);
+        Image *loaded = saveImage(path, pixels, image->height, image->width) ? imageLoad(path, 3) : NULL;
+        failures += checkImage("saveImage", loaded, image);
+        imageFree(loaded);
+        // a file that can't be created is reported to the caller
+        snprintf(path, sizeof(path), "%s/missing/image.%s", root, lossless[f]);
+        if (saveImage(path, pixels, image->height, image->width)) {
+          printf("saveImage failed! (%s: succeeded without a directory)\n", lossless[f]);
+          failures++;
+        }
+        snprintf(path, sizeof(path), "%s/image.%s", root, lossless[f]);
+        freeImage(pixels);
+      }
+      freePadded(padded);
+      imageFree(image);
+    }
+    unlink(path);
+  }
+
+  // HDR goes through linear floats and back, so it only comes back within rounding; gray pixels keep
+  // the shared exponent from crushing a dark channel next to a bright one
+  snprintf(path, sizeof(path), "%s/image.hdr", root);
+  for (int s = 0; s<SIZE_COUNT; s++) {
+    Image *image = makeImage(sizes[s][0], sizes[s][1], 3);
+    for (int i = 0; i<image->height; i++) {
+      unsigned char *row = image->data + image->stride * i;
+      for (int j = 0; j<image->width; j++) {
+        row[3 * j + 1] = row[3 * j + 2] = row[3 * j];
+      }
+    }
+    Image *loaded = imageSave(path, image) ? imageLoad(path, 3) : NULL;
+    snprintf(setting, sizeof(setting), "hdr");
+    failures += checkImageNear("imageSave", loaded, image, 2);
+    imageFree(loaded);
+    imageFree(image);
+  }
+  unlink(path);
+
+  // the format set in the options wins over the extension
+  Image *photo = makePhoto(sizes[5][0], sizes[5][1], 3);
+  snprintf(path, sizeof(path), "%s/image.jpg", root);
+  options.format = IMAGE_FORMAT_PNG;
+  imageSetSaveOptions(&options);
+  Image *loaded = imageSave(path, photo) ? imageLoad(path, 3) : NULL;
+  snprintf(setting, sizeof(setting), "PNG named .jpg");
+  failures += checkImage("imageSave", loaded, photo);
+  imageFree(loaded);
+
+  // lower quality and subsampled chroma each make a smaller JPEG
+  long lengths[3];
+  for (int k = 0; k<3; k++) {
+    options.format = IMAGE_FORMAT_JPEG;
+    options.quality = k == 0 ? 100 : 50;
+    options.subsample = k == 2;
+    imageSetSaveOptions(&options);
+    lengths[k] = imageSave(path, photo) ? fileSize(path) : 0;
+  }
+  if (lengths[0] == 0 || lengths[1] >= lengths[0] || lengths[2] >= lengths[1]) {
+    printf("imageSave failed! (JPEG sizes %ld, %ld at quality 50, %ld subsampled)\n", lengths[0], lengths[1], lengths[2]);
+    failures++;
+  }
+  unlink(path);
+  imageFree(photo);
+  rmdir(root);
+
+  options.format = IMAGE_FORMAT_AUTO;
+  options.quality = 100;
+  options.subsample = 0;
+  imageSetSaveOptions(&options);
+  return failures;
+}
+
+/**
+ * Checks that probes read the size, channels and depth from the header,
+ * and that every loader and the lossless path refuse images over the
+ * budget while taking those within it.
+ */
+static int testBudget(void) {
+  int failures = 0;
+  char root[] = "/tmp/imageUtilsTesterXXXXXX";
+  if (mkdtemp(root) == NULL) {
+    printf("testBudget failed! (unable to create a scratch directory)\n");
+    return 1;
+  }
+  char path[512], outPath[512];
+  snprintf(outPath, sizeof(outPath), "%s/out.jpg", root);
+  int height = sizes[3][0], width = sizes[3][1];
+  size_t pixels = (size_t) height * width;
+
+  for (int n = 1; n<=4; n++) {
+    Image *image = makeImage(height, width, n);
+    snprintf(path, sizeof(path), "%s/image.png", root);
+    stbi_write_png(path, width, height, n, image->data, (int) image->stride);
+    ImageInfo info;
+    if (!imageProbe(path, &info) || info.width != width || info.height != height || info.channels != n ||
+        info.bitDepth != 8) {
+      printf("imageProbe failed! (PNG, %d channels)\n", n);
+      failures++;
+    }
+    imageFree(image);
+  }
+  snprintf(path, sizeof(path), "%s/image.hdr", root);
+  float *linear = (float *) calloc(pixels * 3, sizeof(float));
+  stbi_write_hdr(path, width, height, 3, linear);
+  free(linear);
+  ImageInfo info;
+  if (!imageProbe(path, &info) || info.width != width || info.height != height || info.bitDepth != 32) {
+    printf("imageProbe failed! (HDR)\n");
+    failures++;
+  }
+  unlink(path);
+  snprintf(path, sizeof(path), "%s/missing.png", root);
+  const unsigned char garbage[] = "not an image at all";
+  if (imageProbe(path, &info) || imageProbeMemory(garbage, sizeof(garbage), &info)) {
+    printf("imageProbe failed! (accepted a missing file or garbage)\n");
+    failures++;
+  }
+
+  // the limits are inclusive, and 0 means none
+  info.width = width;
+  info.height = height;
+  ImageBudget budgets[] = { { 0, 0 }, { pixels, 0 }, { pixels - 1, 0 }, { 0, pixels * 5 }, { 0, pixels * 5 - 1 } };
+  for (int k = 0; k<5; k++) {
+    imageSetBudget(&budgets[k]);
+    if (imageWithinBudget(&info, 5) != (k % 2 == 1 || k == 0)) {
+      printf("imageWithinBudget failed! (%zu pixels, %zu bytes)\n", budgets[k].maxPixels, budgets[k].maxBytes);
+      failures++;
+    }
+  }
+
+  // a JPEG that fits a generous budget loads, and one pixel too few turns every loader away
+  Image *photo = makePhoto(height, width, 3);
+  snprintf(path, sizeof(path), "%s/photo.jpg", root);
+  stbi_write_jpg(path, width, height, 3, photo->data, 90);
+  imageFree(photo);
+  for (int over = 0; over<=1; over++) {
+    ImageBudget budget = { over ? pixels - 1 : pixels, over ? 0 : pixels * 64 };
+    imageSetBudget(&budget);
+    int h, w;
+    Image *image = imageLoad(path, 3);
+    Pixel **loaded = loadImage(path, &h, &w);
+    PixelRGB **rgb = loadImageRGB(path, &h, &w);
+    PixelRGBA **rgba = loadImageRGBA(path, &h, &w);
+    int transformed = jpegTransformFile(path, outPath, TRANSFORM_ROTATE_90, JPEG_EDGE_TRIM);
+    int loads = (image != NULL) + (loaded != NULL) + (rgb != NULL) + (rgba != NULL) + transformed;
+    if (loads != (over ? 0 : 5)) {
+      printf("budget failed! (%d of 5 loads %s)\n", loads, over ? "got past a budget one pixel short" :
+             "refused within the budget");
+      failures++;
+    }
+    if (over && strcmp(jpegFailureReason(), "image over the budget") != 0) {
+      printf("jpegTransformFile failed! (refused over the budget as \"%s\")\n", jpegFailureReason());
+      failures++;
+    }
+    imageFree(image);
+    freeImage(loaded);
+    freeImageRGB(rgb);
+    freeImageRGBA(rgba);
+  }
+
+  // the decoder's planes and coefficients count too: a byte and a short per sample, on top of the pixels
+  for (int over = 0; over<=1; over++) {
+    ImageBudget budget = { 0, pixels * (3 + 3 * (1 + sizeof(short))) - over };
+    imageSetBudget(&budget);
+    Image *image = imageLoad(path, 3);
+    if ((image == NULL) != over) {
+      printf("budget failed! (%s the decoder's working memory)\n", over ? "didn't count" : "overcounted");
+      failures++;
+    }
+    imageFree(image);
+  }
+  // the lossless path counts the source's and the rotated coefficient grids: each 16x16 MCU of
+  // a 4:2:0 image holds six blocks of 64 shorts, and rotating keeps the MCU count
+  photo = makePhoto(height, width, 3);
+  MemoryFile subsampled = encodeRestart(photo, 90, 1);
+  imageFree(photo);
+  size_t mcus = (size_t) ((width + 15) / 16) * ((height + 15) / 16);
+  for (int over = 0; over<=1; over++) {
+    ImageBudget budget = { 0, 2 * mcus * 6 * 64 * sizeof(short) - over };
+    imageSetBudget(&budget);
+    if (jpegTransformMemory(subsampled.data, subsampled.length, outPath, TRANSFORM_ROTATE_90,
+                            JPEG_EDGE_TRIM) == over) {
+      printf("jpegTransformMemory failed! (%s the coefficients of a 4:2:0 image)\n", over ? "didn't count" :
+             "overcounted");
+      failures++;
+    }
+  }
+  free(subsampled.data);
+  ImageBudget none = { 0, 0 };
+  imageSetBudget(&none);
+
+  // input that isn't an image is refused for what it is, not as oversized
+  if (jpegTransformMemory(garbage, sizeof(garbage), outPath, TRANSFORM_ROTATE_90, JPEG_EDGE_TRIM) ||
+      strcmp(jpegFailureReason(), "image over the budget") == 0) {
+    printf("jpegTransformMemory failed! (garbage refused as \"%s\")\n", jpegFailureReason());
+    failures++;
+  }
+
+  unlink(path);
+  unlink(outPath);
+  snprintf(path, sizeof(path), "%s/image.png", root);
+  unlink(path);
+  rmdir(root);
+  return failures;
+}
+
+/**
+ * Bytes fed into a pipe by a thread of their own, so they can be more
+ * than the pipe holds.
+ */
+typedef struct {
+  int fd;
+  const unsigned char *data;
+  size_t length;
+} PipeFeed;
+
+static void *feedPipe(void *arg) {
+  PipeFeed *feed = (PipeFeed *) arg;
+  size_t done = 0;
+  while (done < feed->length) {
+    ssize_t n = write(feed->fd, feed->data + done, feed->length - done);
+    if (n <= 0) {
+      break;
+    }
+    done += n;
+  }
+  close(feed->fd);
+  return NULL;
+}
+
+/**
+ * Opens a pipe that a thread fills with the given bytes, and returns its
+ * /dev/fd path and read end.
+ */
+static int openFedPipe(PipeFeed *feed, pthread_t *thread, const unsigned char *data, size_t length,
+                       char *path, size_t pathSize) {
+  int ends[2];
+  if (pipe(ends) != 0) {
+    return -1;
+  }
+  feed->fd = ends[1];
+  feed->data = data;
+  feed->length = length;
+  pthread_create(thread, NULL, feedPipe, feed);
+  snprintf(path, pathSize, "/dev/fd/%d", ends[0]);
+  return ends[0];
+}
+
+/**
+ * Checks that jpegMapFile() maps regular files, reads pipes into memory,
+ * and refuses empty and missing files, and that images load from a pipe.
+ */
+static int testMapFile(void) {
+  int failures = 0;
+  char root[] = "/tmp/imageUtilsTesterXXXXXX";
+  if (mkdtemp(root) == NULL) {
+    printf("testMapFile failed! (unable to create a scratch directory)\n");
+    return 1;
+  }
+  char path[512], pipePath[64];
+  size_t length = 300007;
+  unsigned char *bytes = (unsigned char *) malloc(length);
+  for (size_t k = 0; k<length; k++) {
+    bytes[k] = (unsigned char) (k * 7 + (k >> 9));
+  }
+  snprintf(path, sizeof(path), "%s/bytes", root);
+  FILE *out = fopen(path, "wb");
+  fwrite(bytes, 1, length, out);
+  fclose(out);
+
+  JpegFileData file;
+  if (!jpegMapFile(path, &file) || !file.mapped || file.length != length || memcmp(file.data, bytes, length) != 0) {
+    printf("jpegMapFile failed! (regular file)\n");
+    failures++;
+  } else {
+    jpegUnmapFile(&file);
+  }
+
+  PipeFeed feed;
+  pthread_t thread;
+  int fd = openFedPipe(&feed, &thread, bytes, length, pipePath, sizeof(pipePath));
+  if (!jpegMapFile(pipePath, &file) || file.mapped || file.length != length || memcmp(file.data, bytes, length) != 0) {
+    printf("jpegMapFile failed! (pipe)\n");
+    failures++;
+  } else {
+    jpegUnmapFile(&file);
+  }
+  pthread_join(thread, NULL);
+  close(fd);
+
+  out = fopen(path, "wb");
+  fclose(out);
+  snprintf(pipePath, sizeof(pipePath), "%s/missing", root);
+  if (jpegMapFile(path, &file) || jpegMapFile(pipePath, &file)) {
+    printf("jpegMapFile failed! (accepted an empty or missing file)\n");
+    failures++;
+  }
+  unlink(path);
+  free(bytes);
+
+  // an image piped in loads as it would from a file
+  Image *image = makeImage(sizes[4][0], sizes[4][1], 3);
+  snprintf(path, sizeof(path), "%s/image.png", root);
+  stbi_write_png(path, image->width, image->height, 3, image->data, (int) image->stride);
+  if (jpegMapFile(path, &file)) {
+    fd = openFedPipe(&feed, &thread, file.data, file.length, pipePath, sizeof(pipePath));
+    Image *loaded = imageLoad(pipePath, 3);
+    snprintf(setting, sizeof(setting), "from a pipe");
+    failures += checkImage("imageLoad", loaded, image);
+    imageFree(loaded);
+    pthread_join(thread, NULL);
+    close(fd);
+    jpegUnmapFile(&file);
+  }
+  unlink(path);
+  imageFree(image);
+  rmdir(root);
+  return failures;
+}
+
+/**
+ * Checks that "-" reads standard input and writes standard output, and
+ * that the in-memory loaders and lossless transform match the file ones.
+ */
+static int testStandardStreams(void) {
+  int failures = 0;
+  char root[] = "/tmp/imageUtilsTesterXXXXXX";
+  if (mkdtemp(root) == NULL) {
+    printf("testStandardStreams failed! (unable to create a scratch directory)\n");
+    return 1;
+  }
+  char path[512], outPath[512], memoryPath[512], pipePath[64];
+  Image *image = makePhoto(sizes[5][0], sizes[5][1], 3);
+  MemoryFile jpeg = encodeRestart(image, 90, 0);
+  snprintf(path, sizeof(path), "%s/photo.jpg", root);
+  FILE *out = fopen(path, "wb");
+  fwrite(jpeg.data, 1, jpeg.length, out);
+  fclose(out);
+
+  // standard input, fed through a pipe
+  PipeFeed feed;
+  pthread_t thread;
+  int fd = openFedPipe(&feed, &thread, jpeg.data, jpeg.length, pipePath, sizeof(pipePath));
+  int savedIn = dup(0);
+  dup2(fd, 0);
+  JpegFileData file;
+  if (!jpegMapFile("-", &file) || file.length != jpeg.length || memcmp(file.data, jpeg.data, jpeg.length) != 0) {
+    printf("jpegMapFile failed! (standard input)\n");
+    failures++;
+  } else {
+    jpegUnmapFile(&file);
+  }
+  pthread_join(thread, NULL);
+  dup2(savedIn, 0);
+  close(savedIn);
+  close(fd);
+
+  // standard output, sent to a file
+  SaveOptions options = { IMAGE_FORMAT_PNG, 100, 0 };
+  imageSetSaveOptions(&options);
+  snprintf(outPath, sizeof(outPath), "%s/stdout", root);
+  fflush(stdout);
+  int savedOut = dup(1);
+  fd = open(outPath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  dup2(fd, 1);
+  close(fd);
+  int saved = imageSave("-", image);
+  fflush(stdout);
+  dup2(savedOut, 1);
+  close(savedOut);
+  Image *loaded = saved ? imageLoad(outPath, 3) : NULL;
+  snprintf(setting, sizeof(setting), "to standard output");
+  failures += checkImage("imageSave", loaded, image);
+  imageFree(loaded);
+
+  // failures are reported on standard error, so they can't end up in an image piped out
+  savedOut = dup(1);
+  fd = open(outPath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  dup2(fd, 1);
+  close(fd);
+  snprintf(memoryPath, sizeof(memoryPath), "%s/missing/image.png", root);
+  imageLoad(memoryPath, 3);
+  imageSave(memoryPath, image);
+  fflush(stdout);
+  dup2(savedOut, 1);
+  close(savedOut);
+  if (fileSize(outPath) != 0) {
+    printf("diagnostics failed! (%ld bytes written to standard output)\n", fileSize(outPath));
+    failures++;
+  }
+  options.format = IMAGE_FORMAT_AUTO;
+  imageSetSaveOptions(&options);
+
+  // loading and transforming from memory matches doing it from the file
+  int h1, w1, h2, w2;
+  Pixel **fromFile = loadImage(path, &h1, &w1);
+  Pixel **fromMemory = loadImageFromMemory(jpeg.data, jpeg.length, &h2, &w2);
+  if (fromFile == NULL || fromMemory == NULL || h1 != h2 || w1 != w2 ||
+      memcmp(fromFile[0], fromMemory[0], sizeof(Pixel) * h1 * w1) != 0) {
+    printf("loadImageFromMemory failed!\n");
+    failures++;
+  }
+  freeImage(fromFile);
+  freeImage(fromMemory);
+  snprintf(memoryPath, sizeof(memoryPath), "%s/memory.jpg", root);
+  JpegFileData a, b;
+  if (!jpegTransformFile(path, outPath, TRANSFORM_TRANSPOSE, JPEG_EDGE_TRIM) ||
+      !jpegTransformMemory(jpeg.data, jpeg.length, memoryPath, TRANSFORM_TRANSPOSE, JPEG_EDGE_TRIM) ||
+      !jpegMapFile(outPath, &a)) {
+    printf("jpegTransformMemory failed! (%s)\n", jpegFailureReason());
+    failures++;
+  } else {
+    if (!jpegMapFile(memoryPath, &b) || a.length != b.length || memcmp(a.data, b.data, a.length) != 0) {
+      printf("jpegTransformMemory failed! (differs from jpegTransformFile)\n");
+      failures++;
+    } else {
+      jpegUnmapFile(&b);
+    }
+    jpegUnmapFile(&a);
+  }
+
+  unlink(memoryPath);
+  unlink(outPath);
+  unlink(path);
+  free(jpeg.data);
+  imageFree(image);
+  rmdir(root);
+  return failures;
+}
+
+// a size class no other check allocates, above the mmap threshold testPool() sets
+#define POOL_TEST_BLOCK ((size_t) 12 << 20)
+
+/**
+ * Returns the bytes malloc() has mapped for large blocks, which is where
+ * every block of POOL_TEST_BLOCK goes.
+ */
+static size_t mappedBytes(void) {
+  return mallinfo2().hblkhd;
+}
+
+static void *allocAndFree(void *arg) {
+  void *block = poolAlloc(POOL_TEST_BLOCK);
+  *(void **) arg = block;
+  poolFree(block);
+  return NULL;
+}
+
+/**
+ * Checks that released blocks are reused, by the releasing thread and
+ * through the shared pool by others, that the shared pool keeps no more
+ * than its limit, and that trimming and a limit of 0 give blocks back.
+ */
+static int testPool(void) {
+  int failures = 0;
+  // a fixed threshold keeps glibc from raising it as blocks are freed, so the test blocks stay mapped
+  mallopt(M_MMAP_THRESHOLD, 1 << 20);
+  poolSetLimit(2 * POOL_TEST_BLOCK);
+  size_t base = mappedBytes();
+  size_t slack = 1 << 16;
+
+  void *blocks[5];
+  blocks[0] = poolAlloc(POOL_TEST_BLOCK);
+  poolFree(blocks[0]);
+  if (poolAlloc(POOL_TEST_BLOCK - 1000) != blocks[0]) {
+    printf("poolAlloc failed! (didn't reuse the block this thread released)\n");
+    failures++;
+  }
+  for (int k = 1; k<5; k++) {
+    blocks[k] = poolAlloc(POOL_TEST_BLOCK);
+  }
+  for (int k = 0; k<5; k++) {
+    poolFree(blocks[k]);
+  }
+  // one block in this thread's cache and two in the shared pool; the other two went back
+  size_t held = mappedBytes() - base;
+  if (held < 3 * POOL_TEST_BLOCK || held > 3 * POOL_TEST_BLOCK + slack) {
+    printf("poolFree failed! (%zu bytes held with a limit of two blocks)\n", held);
+    failures++;
+  }
+
+  void *taken;
+  pthread_t thread;
+  pthread_create(&thread, NULL, allocAndFree, &taken);
+  pthread_join(thread, NULL);
+  if (taken != blocks[1] && taken != blocks[2]) {
+    printf("poolAlloc failed! (another thread didn't reuse a shared block)\n");
+    failures++;
+  }
+
+  // trimming empties this thread's cache as well as the shared pool
+  poolTrim();
+  held = mappedBytes() - base;
+  if (held > slack) {
+    printf("poolTrim failed! (%zu bytes held)\n", held);
+    failures++;
+  }
+
+  // turning pooling off lets go of the block in this thread's cache, and keeps no more
+  poolFree(poolAlloc(POOL_TEST_BLOCK));
+  poolSetLimit(0);
+  if (mappedBytes() - base != held) {
+    printf("poolSetLimit failed! (kept this thread's cache with pooling off)\n");
+    failures++;
+  }
+  void *a = poolAlloc(POOL_TEST_BLOCK * 2);
+  void *b = poolAlloc(POOL_TEST_BLOCK * 2);
+  poolFree(a);
+  poolFree(b);
+  if (mappedBytes() - base != held) {
+    printf("poolFree failed! (kept blocks with pooling off)\n");
+    failures++;
+  }
+
+  // small requests and plain malloc() blocks pass through
+  void *small = poolAlloc(100);
+  void *plain = malloc(POOL_TEST_BLOCK);
+  poolFree(small);
+  poolFree(plain);
+  poolFree(NULL);
+
+  poolSetLimit(POOL_DEFAULT_LIMIT);
+  return failures;
+}
+
+/**
+ * Checks that sizes that don't fit are refused rather than wrapped
+ * around: images with no pixels or too many, and images stb's writers
+ * can't index.
+ */
+static int testLimits(void) {
+  int failures = 0;
+  static const int dimensions[][3] = {
+    { 0, 5, 3 }, { 5, 0, 3 }, { -1, 5, 3 }, { 5, 5, 0 }, { 5, 5, 5 }, { INT_MAX, INT_MAX, 4 }
+  };
+  for (int k = 0; k<6; k++) {
+    Image *image = imageCreate(dimensions[k][0], dimensions[k][1], dimensions[k][2]);
+    if (image != NULL) {
+      printf("imageCreate failed! (accepted %dx%d with %d channels)\n", dimensions[k][0], dimensions[k][1],
+             dimensions[k][2]);
+      failures++;
+      imageFree(image);
+    }
+  }
+
+  // a PNG of 50000x50000 gray pixels is past what stb can index, so it is refused before any pixel is read
+  char root[] = "/tmp/imageUtilsTesterXXXXXX";
+  if (mkdtemp(root) == NULL) {
+    printf("testLimits failed! (unable to create a scratch directory)\n");
+    return failures + 1;
+  }
+  char path[512];
+  snprintf(path, sizeof(path), "%s/huge.png", root);
+  unsigned char pixel = 0;
+  Image huge = { &pixel, 50000, 50000, 50000, 1, IMAGE_STORAGE_MALLOC };
+  if (imageSave(path, &huge)) {
+    printf("imageSave failed! (wrote a PNG past stb's limits)\n");
+    failures++;
+  }
+  unlink(path);
+  rmdir(root);
+  return failures;
+}
+
+/**
+ * Checks that transformPoint() moves every pixel where the reference
+ * maps do.
+ */
+static int testTransformPoint(void) {
+  int failures = 0;
+  for (int t = 0; t<8; t++) {
+    for (int i = 0; i<5; i++) {
+      for (int j = 0; j<7; j++) {
+        int i1, j1, i2, j2;
+        transformPoint((Transform) t, 5, 7, i, j, &i1, &j1);
+        transforms[t].map(5, 7, i, j, &i2, &j2);
+        if (i1 != i2 || j1 != j2) {
+          printf("transformPoint failed! (transform %d, [%d][%d] went to [%d][%d])\n", t, i, j, i1, j1);
+          failures++;
+          i = 5;
+          break;
+        }
+      }
+    }
+  }
+  return failures;
+}
+
+/**
+ * Compares a tiled image, row by row, with the image expected.
+ *
+ * @return 0 if they match, 1 if not.
+ */
+static int checkTiled(const char *name, TiledImage *tiled, const Image *expected) {
+  int same = tiled->height == expected->height && tiled->width == expected->width &&
+             tiled->channels == expected->channels;
+  size_t rowBytes = (size_t) expected->width * expected->channels;
+  unsigned char *row = (unsigned char *) malloc(rowBytes);
+  for (int i = 0; same && i<expected->height; i++) {
+    tiledReadRow(tiled, i, row);
+    same = memcmp(row, expected->data + expected->stride * i, rowBytes) == 0;
+  }
+  free(row);
+  if (!same) {
+    printf("%s failed! (%dx%d expected, %d channels, %s)\n", name, expected->height, expected->width,
+           expected->channels, setting);
+  }
+  return !same;
+}
+
+/**
+ * Checks the tiled store against the reference remap for every
+ * transform, channel count and size (several of which span more than
+ * one tile), and that the named operations, streamed JPEG saves and
+ * loads agree with the in-memory ones.
+ */
+static int testTiled(void) {
+  int failures = 0;
+  for (int s = 0; s<SIZE_COUNT; s++) {
+    for (int n = 1; n<=4; n++) {
+      Image *image = makeImage(sizes[s][0], sizes[s][1], n);
+      for (int t = 0; t<8; t++) {
+        TiledImage *tiled = tiledCreate(image->height, image->width, n);
+        if (tiled == NULL) {
+          printf("tiledCreate failed! (%s)\n", jpegFailureReason());
+          imageFree(image);
+          return failures + 1;
+        }
+        for (int i = 0; i<image->height; i++) {
+          tiledWriteRow(tiled, i, image->data + image->stride * i);
+        }
+        tiledTransform(tiled, (Transform) t);
+        Image *expected = referenceRemap(image, transforms[t].map, transforms[t].swapsAxes);
+        snprintf(setting, sizeof(setting), "transform %d", t);
+        failures += checkTiled("tiledTransform", tiled, expected);
+
+        // streamed straight from the tiles, the JPEG must match one encoded from memory
+        MemoryFile a = encodeRestart(expected, 90, 0);
+        MemoryFile b = { NULL, 0, 0 };
+        if (!jpegEncode(appendFile, &b, tiled->width, tiled->height, n, 90, 0, tiledRows, tiled) ||
+            a.data == NULL || a.length != b.length || memcmp(a.data, b.data, a.length) != 0) {
+          printf("tiled encode failed! (%dx%d, %d channels, transform %d)\n", sizes[s][0], sizes[s][1], n, t);
+          failures++;
+        }
+        free(a.data);
+        free(b.data);
+        imageFree(expected);
+        tiledFree(tiled);
+      }
+
+      // a chain of the named operations: clockwise, flip, counter-clockwise, flip vertically
+      TiledImage *tiled = tiledCreate(image->height, image->width, n);
+      for (int i = 0; tiled != NULL && i<image->height; i++) {
+        tiledWriteRow(tiled, i, image->data + image->stride * i);
+      }
+      if (tiled != NULL) {
+        tiledRotateClockwise(tiled);
+        tiledFlipHorizontal(tiled);
+        tiledRotateCounterClockwise(tiled);
+        tiledFlipVertical(tiled);
+        Transform chain[] = { TRANSFORM_ROTATE_90, TRANSFORM_FLIP_HORIZONTAL, TRANSFORM_ROTATE_270,
+                              TRANSFORM_ROTATE_180 };
+        Transform t = composeTransformList(chain, 4);
+        Image *expected = referenceRemap(image, transforms[t].map, transforms[t].swapsAxes);
+        snprintf(setting, sizeof(setting), "rotate, flip, rotate back, flip vertically");
+        failures += checkTiled("tiled operations", tiled, expected);
+        imageFree(expected);
+        tiledFree(tiled);
+      }
+      imageFree(image);
+    }
+  }
+
+  // saving and loading go through files as the in-memory functions do
+  char root[] = "/tmp/imageUtilsTesterXXXXXX";
+  if (mkdtemp(root) == NULL) {
+    printf("testTiled failed! (unable to create a scratch directory)\n");
+    return failures + 1;
+  }
+  char path[512];
+  snprintf(path, sizeof(path), "%s/tiled.png", root);
+  Image *image = makeImage(sizes[5][0], sizes[5][1], 3);
+  stbi_write_png(path, image->width, image->height, 3, image->data, (int) image->stride);
+  TiledImage *tiled = tiledLoad(path, 3);
+  if (tiled == NULL) {
+    printf("tiledLoad failed!\n");
+    failures++;
+  } else {
+    snprintf(setting, sizeof(setting), "loaded");
+    failures += checkTiled("tiledLoad", tiled, image);
+    tiledRotateClockwise(tiled);
+    Image *loaded = tiledSave(path, tiled) ? imageLoad(path, 3) : NULL;
+    Image *expected = referenceRemap(image, clockwisePoint, 1);
+    snprintf(setting, sizeof(setting), "rotated and saved");
+    failures += checkImage("tiledSave", loaded, expected);
+    imageFree(expected);
+    imageFree(loaded);
+    tiledFree(tiled);
+  }
+  unlink(path);
+  imageFree(image);
+
+  // JPEGs taller than a tile are decoded into the tiles a band at a time, with or without restart
+  // markers and subsampling, and give the pixels stb does
+  image = makePhoto(600, 517, 3);
+  for (int source = 0; source<3; source++) {
+    MemoryFile file = { NULL, 0, 0 };
+    if (source < 2) {
+      file = encodeRestart(image, 90, source);
+    } else {
+      stbi_write_jpg_to_func(appendStb, &file, image->width, image->height, 3, image->data, 90);
+    }
+    snprintf(setting, sizeof(setting), "%s", source == 0 ? "restart" : source == 1 ? "restart 4:2:0" : "stb");
+    Image *expected = imageLoadFromMemory(file.data, file.length, 3);
+    tiled = tiledLoadFromMemory(file.data, file.length, 3);
+    failures += tiled == NULL ? 1 : checkTiled("tiledLoadFromMemory", tiled, expected);
+    tiledFree(tiled);
+
+    // only a band is held, so a budget too small for the whole image still lets it load
+    JpegCoefImage frame;
+    jpegReadFrame(file.data, file.length, &frame);
+    for (int over = 0; over<=1; over++) {
+      ImageBudget budget = { 0, jpegDecodeRowsMemory(&frame, 3, TILE_SIZE) - over };
+      imageSetBudget(&budget);
+      Image *whole = imageLoadFromMemory(file.data, file.length, 3);
+      tiled = tiledLoadFromMemory(file.data, file.length, 3);
+      if (whole != NULL || (tiled == NULL) != over) {
+        printf("tiledLoadFromMemory failed! (%s, %s)\n", setting, whole != NULL ? "whole image within the budget" :
+               over ? "loaded over the budget" : "refused within the budget");
+        failures++;
+      }
+      imageFree(whole);
+      tiledFree(tiled);
+    }
+    ImageBudget none = { 0, 0 };
+    imageSetBudget(&none);
+    imageFree(expected);
+    free(file.data);
+  }
+
+  // and from a file
+  snprintf(path, sizeof(path), "%s/tiled.jpg", root);
+  stbi_write_jpg(path, image->width, image->height, 3, image->data, 90);
+  Image *expected = imageLoad(path, 3);
+  tiled = tiledLoad(path, 3);
+  snprintf(setting, sizeof(setting), "JPEG file");
+  failures += tiled == NULL ? 1 : checkTiled("tiledLoad", tiled, expected);
+  tiledFree(tiled);
+  imageFree(expected);
+  imageFree(image);
+  unlink(path);
+  rmdir(root);
+  return failures;
+}
+
+/**
+ * Checks that a batch run counts its images and failures, and writes
+ * each image transformed under its own name.
+ */
+static int testBatch(void) {
+  int failures = 0;
+  char root[] = "/tmp/imageUtilsTesterXXXXXX";
+  if (mkdtemp(root) == NULL) {
+    printf("testBatch failed! (unable to create a scratch directory)\n");
+    return 1;
+  }
+  char inDir[256], outDir[256], path[512];
+  snprintf(inDir, sizeof(inDir), "%s/in", root);
+  snprintf(outDir, sizeof(outDir), "%s/out", root);
+  mkdir(inDir, 0700);
+  mkdir(outDir, 0700);
+
+  // three images and one file that isn't an image
+  Image *saved[3];
+  for (int k = 0; k<3; k++) {
+    Image *image = makePhoto(sizes[k + 3][0], sizes[k + 3][1], 3);
+    snprintf(path, sizeof(path), "%s/photo%d.jpg", inDir, k);
+    imageSave(path, image);
+    imageFree(image);
+    saved[k] = imageLoad(path, 3);
+  }
+  snprintf(path, sizeof(path), "%s/notes.jpg", inDir);
+  FILE *junk = fopen(path, "w");
+  fputs("not an image\n", junk);
+  fclose(junk);
+
+  BatchOptions options;
+  memset(&options, 0, sizeof(options));
+  options.input = inDir;
+  options.outputDir = outDir;
+  options.transform = TRANSFORM_ROTATE_90;
+  options.threads = 2;
+  BatchResult result;
+  if (!runBatch(&options, &result) || result.processed != 3 || result.failed != 1) {
+    printf("runBatch failed! (directory: %d processed, %d failed)\n", result.processed, result.failed);
+    failures++;
+  }
+  snprintf(setting, sizeof(setting), "batch");
+  for (int k = 0; k<3; k++) {
+    snprintf(path, sizeof(path), "%s/photo%d.jpg", outDir, k);
+    Image *written = imageLoad(path, 3);
+    Image *expected = referenceRemap(saved[k], clockwisePoint, 1);
+    failures += checkImageNear("runBatch", written, expected, 8);
+    imageFree(expected);
+    imageFree(written);
+    imageFree(saved[k]);
+  }
+
+  // a manifest naming one of the images and a file that doesn't exist
+  snprintf(path, sizeof(path), "%s/manifest", root);
+  FILE *manifest = fopen(path, "w");
+  fprintf(manifest, "%s/photo1.jpg\n\n%s/missing.jpg\n", inDir, inDir);
+  fclose(manifest);
+  options.input = path;
+  options.lossless = 1;
+  if (!runBatch(&options, &result) || result.processed != 1 || result.failed != 1) {
+    printf("runBatch failed! (manifest: %d processed, %d failed)\n", result.processed, result.failed);
+    failures++;
+  }
+
+  // two inputs with the same name would be written to the same output, so the second is turned away
+  char subDir[256], copyPath[512];
+  snprintf(subDir, sizeof(subDir), "%s/sub", root);
+  mkdir(subDir, 0700);
+  snprintf(copyPath, sizeof(copyPath), "%s/photo1.jpg", subDir);
+  char sourcePath[512];
+  snprintf(sourcePath, sizeof(sourcePath), "%s/photo1.jpg", inDir);
+  JpegFileData original;
+  if (jpegMapFile(sourcePath, &original)) {
+    FILE *copy = fopen(copyPath, "wb");
+    fwrite(original.data, 1, original.length, copy);
+    fclose(copy);
+    jpegUnmapFile(&original);
+  }
+  manifest = fopen(path, "w");
+  fprintf(manifest, "%s\n%s\n", sourcePath, copyPath);
+  fclose(manifest);
+  if (!runBatch(&options, &result) || result.processed != 1 || result.failed != 1) {
+    printf("runBatch failed! (same name twice: %d processed, %d failed)\n", result.processed, result.failed);
+    failures++;
+  }
+  removeDirectory(subDir);
+
+  char missing[256];
+  snprintf(missing, sizeof(missing), "%s/nowhere", root);
+  options.input = missing;
+  if (runBatch(&options, &result)) {
+    printf("runBatch failed! (accepted a missing input directory)\n");
+    failures++;
+  }
+
+  unlink(path);
+  removeDirectory(inDir);
+  removeDirectory(outDir);
+  rmdir(root);
+  return failures;
+}
+
+int main(int argc, char **argv) {
+
+  int failures = 0;
+  srand(1);
+
+  failures += testThreadPool();
+
+  // every kernel is checked at each vector instruction set it has a path
+  // for, on the calling thread and split into bands on the shared pool
+  parallelSetThreads(4);
+  for (int banded = 0; banded<=1; banded++) {
+    parallelSetThreshold(banded ? 0 : (size_t) -1);
+    for (int simd = KERNEL_SIMD_NONE; simd<=KERNEL_SIMD_AVX2; simd++) {
+      kernelSetSimdLimit((KernelSimd) simd);
+      snprintf(setting, sizeof(setting), "%s, %s", simdNames[simd], banded ? "banded" : "serial");
+      failures += testRotations();
+      failures += testFlips();
+      failures += testTransforms();
+    }
+    failures += testCopy();
+  }
+
+  // the encoder and decoder work on the pool, even for the small images
+  failures += testEncoder();
+  failures += testDecoder();
+  failures += testDecodeRows();
+  parallelSetThreshold(PARALLEL_DEFAULT_THRESHOLD);
+
+  failures += testComposition();
+  failures += testLossless();
+  failures += testMarkers();
+  failures += testLoad();
+  failures += testSave();
+  failures += testBudget();
+  failures += testMapFile();
+  failures += testStandardStreams();
+  failures += testPool();
+  failures += testLimits();
+  failures += testTransformPoint();
+  failures += testTiled();
+  failures += testBatch();
+
+  if(failures > 0) {
+    printf("%d checks failed\n", failures);
+    return 1;
+  }
+  printf("all checks passed\n");
+  return 0;
+
+}
@@ -0,0 +1,475 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// SSSE3 and AVX2 kernels are compiled with target attributes and picked at run time
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define KERNELS_X86 1
+#endif
+
+#include "image_kernels.h"
+#include "thread_pool.h"
+
+static KernelSimd simdLimit = KERNEL_SIMD_AVX2;
+
+void kernelSetSimdLimit(KernelSimd limit) {
+  simdLimit = limit;
+}
+
+/*
+ * Pixel reversal.  Reversing a run of pixels is the core of flipHorizontal,
+ * flipVertical and rotate180.  The vector paths reverse whole registers of
+ * pixels at a time: 4-byte pixels with a 32-bit lane permute (SSE2 or AVX2),
+ * and 3-byte pixels 16 at a time, spread over three SSE registers, with
+ * SSSE3 byte shuffles.  Each returns how many pixels it handled so that the
+ * scalar loops can finish the rest.
+ */
+
+#ifdef KERNELS_X86
+/**
+ * Reverses the 16 3-byte pixels held in a0:a1:a2 (48 bytes) into o0:o1:o2.
+ * Every output register gathers its bytes from at most three input
+ * registers with one shuffle each.
+ */
+__attribute__((target("ssse3")))
+static inline void reverse16Pixels3(__m128i *o0, __m128i *o1, __m128i *o2, __m128i a0, __m128i a1, __m128i a2) {
+  const __m128i m01 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 14);
+  const __m128i m02 = _mm_setr_epi8(13, 14, 15, 10, 11, 12, 7, 8, 9, 4, 5, 6, 1, 2, 3, -1);
+  const __m128i m10 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 15, -1);
+  const __m128i m11 = _mm_setr_epi8(15, -1, 11, 12, 13, 8, 9, 10, 5, 6, 7, 2, 3, 4, -1, 0);
+  const __m128i m12 = _mm_setr_epi8(-1, 0, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+  const __m128i m20 = _mm_setr_epi8(-1, 12, 13, 14, 9, 10, 11, 6, 7, 8, 3, 4, 5, 0, 1, 2);
+  const __m128i m21 = _mm_setr_epi8(1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+  *o0 = _mm_or_si128(_mm_shuffle_epi8(a1, m01), _mm_shuffle_epi8(a2, m02));
+  *o1 = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a0, m10), _mm_shuffle_epi8(a1, m11)), _mm_shuffle_epi8(a2, m12));
+  *o2 = _mm_or_si128(_mm_shuffle_epi8(a0, m20), _mm_shuffle_epi8(a1, m21));
+}
+
+__attribute__((target("ssse3")))
+static size_t reverseRow3SSSE3(unsigned char *row, size_t width) {
+  unsigned char *left = row;
+  unsigned char *right = row + 3 * width;
+  size_t done = 0;
+  // swap 16 pixel blocks from both ends while two whole blocks remain between them
+  for (; right - left >= 96; left += 48, right -= 48, done += 16) {
+    __m128i l0 = _mm_loadu_si128((const __m128i *) left);
+    __m128i l1 = _mm_loadu_si128((const __m128i *) (left + 16));
+    __m128i l2 = _mm_loadu_si128((const __m128i *) (left + 32));
+    __m128i r0 = _mm_loadu_si128((const __m128i *) (right - 48));
+    __m128i r1 = _mm_loadu_si128((const __m128i *) (right - 32));
+    __m128i r2 = _mm_loadu_si128((const __m128i *) (right - 16));
+    __m128i o0, o1, o2;
+    reverse16Pixels3(&o0, &o1, &o2, r0, r1, r2);
+    _mm_storeu_si128((__m128i *) left, o0);
+    _mm_storeu_si128((__m128i *) (left + 16), o1);
+    _mm_storeu_si128((__m128i *) (left + 32), o2);
+    reverse16Pixels3(&o0, &o1, &o2, l0, l1, l2);
+    _mm_storeu_si128((__m128i *) (right - 48), o0);
+    _mm_storeu_si128((__m128i *) (right - 32), o1);
+    _mm_storeu_si128((__m128i *) (right - 16), o2);
+  }
+  return done;
+}
+
+__attribute__((target("ssse3")))
+static size_t reverseCopy3SSSE3(unsigned char *dst, const unsigned char *src, size_t count) {
+  unsigned char *d = dst + 3 * count;
+  size_t k = 0;
+  for (; k + 16 <= count; k += 16) {
+    __m128i o0, o1, o2;
+    reverse16Pixels3(&o0, &o1, &o2, _mm_loadu_si128((const __m128i *) (src + 3 * k)),
+                     _mm_loadu_si128((const __m128i *) (src + 3 * k + 16)),
+                     _mm_loadu_si128((const __m128i *) (src + 3 * k + 32)));
+    d -= 48;
+    _mm_storeu_si128((__m128i *) d, o0);
+    _mm_storeu_si128((__m128i *) (d + 16), o1);
+    _mm_storeu_si128((__m128i *) (d + 32), o2);
+  }
+  return k;
+}
+
+__attribute__((target("avx2")))
+static size_t reverseRow4AVX2(unsigned char *row, size_t width) {
+  const __m256i reverse = _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+  unsigned char *left = row;
+  unsigned char *right = row + 4 * width;
+  size_t done = 0;
+  for (; right - left >= 64; left += 32, right -= 32, done += 8) {
+    __m256i l = _mm256_loadu_si256((const __m256i *) left);
+    __m256i r = _mm256_loadu_si256((const __m256i *) (right - 32));
+    _mm256_storeu_si256((__m256i *) left, _mm256_permutevar8x32_epi32(r, reverse));
+    _mm256_storeu_si256((__m256i *) (right - 32), _mm256_permutevar8x32_epi32(l, reverse));
+  }
+  return done;
+}
+
+__attribute__((target("avx2")))
+static size_t reverseCopy4AVX2(unsigned char *dst, const unsigned char *src, size_t count) {
+  const __m256i reverse = _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+  unsigned char *d = dst + 4 * count;
+  size_t k = 0;
+  for (; k + 8 <= count; k += 8) {
+    __m256i v = _mm256_loadu_si256((const __m256i *) (src + 4 * k));
+    d -= 32;
+    _mm256_storeu_si256((__m256i *) d, _mm256_permutevar8x32_epi32(v, reverse));
+  }
+  return k;
+}
+#endif
+
+#ifdef __SSE2__
+static size_t reverseRow4SSE2(unsigned char *row, size_t width) {
+  unsigned char *left = row;
+  unsigned char *right = row + 4 * width;
+  size_t done = 0;
+  for (; right - left >= 32; left += 16, right -= 16, done += 4) {
+    __m128i l = _mm_loadu_si128((const __m128i *) left);
+    __m128i r = _mm_loadu_si128((const __m128i *) (right - 16));
+    _mm_storeu_si128((__m128i *) left, _mm_shuffle_epi32(r, _MM_SHUFFLE(0, 1, 2, 3)));
+    _mm_storeu_si128((__m128i *) (right - 16), _mm_shuffle_epi32(l, _MM_SHUFFLE(0, 1, 2, 3)));
+  }
+  return done;
+}
+
+static size_t reverseCopy4SSE2(unsigned char *dst, const unsigned char *src, size_t count) {
+  unsigned char *d = dst + 4 * count;
+  size_t k = 0;
+  for (; k + 4 <= count; k += 4) {
+    __m128i v = _mm_loadu_si128((const __m128i *) (src + 4 * k));
+    d -= 16;
+    _mm_storeu_si128((__m128i *) d, _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 1, 2, 3)));
+  }
+  return k;
+}
+#endif
+
+/**
+ * Reverses the width pixels of one row in place, using the widest vector
+ * path the CPU supports for the outer pixels.
+ */
+static void reverseRow(unsigned char *row, size_t width, size_t pixelSize) {
+  size_t done = 0;
+#ifdef KERNELS_X86
+  if (pixelSize == 3 && simdLimit >= KERNEL_SIMD_SSSE3 && __builtin_cpu_supports("ssse3")) {
+    done = reverseRow3SSSE3(row, width);
+  } else if (pixelSize == 4 && simdLimit >= KERNEL_SIMD_AVX2 && __builtin_cpu_supports("avx2")) {
+    done = reverseRow4AVX2(row, width);
+  }
+#endif
+#ifdef __SSE2__
+  if (pixelSize == 4 && done == 0 && simdLimit >= KERNEL_SIMD_SSE2) {
+    done = reverseRow4SSE2(row, width);
+  }
+#endif
+  unsigned char temp[4];
+  unsigned char *left = row + pixelSize * done;
+  unsigned char *right = row + pixelSize * (width - 1 - done);
+  while (left < right) {
+    memcpy(temp, left, pixelSize);
+    memcpy(left, right, pixelSize);
+    memcpy(right, temp, pixelSize);
+    left += pixelSize;
+    right -= pixelSize;
+  }
+}
+
+/**
+ * Copies count pixels from src to dst in reverse order, so that the
+ * first source pixel becomes the last destination pixel.
+ */
+static void reverseCopy(unsigned char *dst, const unsigned char *src, size_t count, size_t pixelSize) {
+  size_t k = 0;
+#ifdef KERNELS_X86
+  if (pixelSize == 3 && simdLimit >= KERNEL_SIMD_SSSE3 && __builtin_cpu_supports("ssse3")) {
+    k = reverseCopy3SSSE3(dst, src, count);
+  } else if (pixelSize == 4 && simdLimit >= KERNEL_SIMD_AVX2 && __builtin_cpu_supports("avx2")) {
+    k = reverseCopy4AVX2(dst, src, count);
+  }
+#endif
+#ifdef __SSE2__
+  if (pixelSize == 4 && k == 0 && simdLimit >= KERNEL_SIMD_SSE2) {
+    k = reverseCopy4SSE2(dst, src, count);
+  }
+#endif
+  unsigned char *d = dst + pixelSize * (count - k);
+  for (; k < count; k++) {
+    d -= pixelSize;
+    memcpy(d, src + pixelSize * k, pixelSize);
+  }
+}
+
+/*
+ * The public kernels hand their loops to parallelFor() as bands of rows
+ * (or of tile rows, or of row pairs for the in-place swaps).  Every band
+ * writes a disjoint part of the destination, so they need no locking.
+ * PackedJob carries a kernel's arguments to its band function.
+ */
+typedef struct {
+  unsigned char *dst;
+  size_t dstStride;
+  const unsigned char *src;
+  size_t srcStride;
+  int height;
+  int width;
+  size_t pixelSize;
+  ptrdiff_t rowStep;
+  ptrdiff_t colStep;
+} PackedJob;
+
+static void reverseRowsBand(void *context, int begin, int end) {
+  PackedJob *job = (PackedJob *) context;
+  for (int i = begin; i<end; i++) {
+    reverseRow(job->dst + job->dstStride * i, job->width, job->pixelSize);
+  }
+}
+
+void reversePackedRows(unsigned char *data, size_t stride, int height, int width, size_t pixelSize) {
+  PackedJob job = { data, stride, NULL, 0, height, width, pixelSize, 0, 0 };
+  parallelFor(0, height, pixelSize * width, reverseRowsBand, &job);
+}
+
+/*
+ * The transpose and the 90/270 degree rotations all send source row i to
+ * destination column i and source column j to destination row j; they only
+ * differ in which way the destination rows and columns are walked.  The
+ * tile kernels below therefore write pixel [i][j] to
+ *
+ *     origin + j * rowStep + i * colStep
+ *
+ * where rowStep is +/- the destination stride and colStep is +/- the pixel
+ * size, with origin pointing at wherever pixel [0][0] ends up.
+ */
+
+/**
+ * Transposes the rows [i0, i1) and columns [j0, j1) of a 4-byte pixel image.
+ */
+static void transposeTile4(unsigned char *origin, ptrdiff_t rowStep, ptrdiff_t colStep,
+                           const unsigned char *src, size_t srcStride, int i0, int i1, int j0, int j1) {
+  int i = i0;
+#ifdef __SSE2__
+  // 4x4 blocks: four row loads, an unpack based transpose, four row stores.  When the
+  // destination columns run backwards the lanes are reversed and stored from pixel i+3.
+  int reversed = colStep < 0;
+  for (; simdLimit >= KERNEL_SIMD_SSE2 && i + 4 <= i1; i += 4) {
+    const unsigned char *s = src + srcStride * i;
+    unsigned char *rowOrigin = origin + colStep * (reversed ? i + 3 : i);
+    int j = j0;
+    for (; j + 4 <= j1; j += 4) {
+      __m128i r0 = _mm_loadu_si128((const __m128i *) (s + 4 * j));
+      __m128i r1 = _mm_loadu_si128((const __m128i *) (s + srcStride + 4 * j));
+      __m128i r2 = _mm_loadu_si128((const __m128i *) (s + srcStride * 2 + 4 * j));
+      __m128i r3 = _mm_loadu_si128((const __m128i *) (s + srcStride * 3 + 4 * j));
+      __m128i t0 = _mm_unpacklo_epi32(r0, r1); // a0 b0 a1 b1
+      __m128i t1 = _mm_unpacklo_epi32(r2, r3); // c0 d0 c1 d1
+      __m128i t2 = _mm_unpackhi_epi32(r0, r1); // a2 b2 a3 b3
+      __m128i t3 = _mm_unpackhi_epi32(r2, r3); // c2 d2 c3 d3
+      __m128i c0 = _mm_unpacklo_epi64(t0, t1);
+      __m128i c1 = _mm_unpackhi_epi64(t0, t1);
+      __m128i c2 = _mm_unpacklo_epi64(t2, t3);
+      __m128i c3 = _mm_unpackhi_epi64(t2, t3);
+      if (reversed) {
+        c0 = _mm_shuffle_epi32(c0, _MM_SHUFFLE(0, 1, 2, 3));
+        c1 = _mm_shuffle_epi32(c1, _MM_SHUFFLE(0, 1, 2, 3));
+        c2 = _mm_shuffle_epi32(c2, _MM_SHUFFLE(0, 1, 2, 3));
+        c3 = _mm_shuffle_epi32(c3, _MM_SHUFFLE(0, 1, 2, 3));
+      }
+      unsigned char *d = rowOrigin + rowStep * j;
+      _mm_storeu_si128((__m128i *) d, c0);
+      _mm_storeu_si128((__m128i *) (d + rowStep), c1);
+      _mm_storeu_si128((__m128i *) (d + rowStep * 2), c2);
+      _mm_storeu_si128((__m128i *) (d + rowStep * 3), c3);
+    }
+    // leftover columns of this band of 4 rows
+    for (; j < j1; j++) {
+      for (int k = 0; k<4; k++) {
+        memcpy(origin + rowStep * j + colStep * (i + k), src + srcStride * (i + k) + 4 * j, 4);
+      }
+    }
+  }
+#endif
+  for (; i < i1; i++) {
+    const unsigned char *s = src + srcStride * i;
+    for (int j = j0; j<j1; j++) {
+      memcpy(origin + rowStep * j + colStep * i, s + 4 * j, 4);
+    }
+  }
+}
+
+/**
+ * Transposes the rows [i0, i1) and columns [j0, j1) of a 3-byte pixel image.
+ */
+static void transposeTile3(unsigned char *origin, ptrdiff_t rowStep, ptrdiff_t colStep,
+                           const unsigned char *src, size_t srcStride, int i0, int i1, int j0, int j1) {
+  for (int i = i0; i<i1; i++) {
+    const unsigned char *s = src + srcStride * i + 3 * j0;
+    unsigned char *d = origin + rowStep * j0 + colStep * i;
+    for (int j = j0; j<j1; j++) {
+      d[0] = s[0];
+      d[1] = s[1];
+      d[2] = s[2];
+      s += 3;
+      d += rowStep;
+    }
+  }
+}
+
+/**
+ * Transposes the rows [i0, i1) and columns [j0, j1) of an image of any pixel size.
+ */
+static void transposeTileAny(unsigned char *origin, ptrdiff_t rowStep, ptrdiff_t colStep,
+                             const unsigned char *src, size_t srcStride, int i0, int i1, int j0, int j1,
+                             size_t pixelSize) {
+  for (int i = i0; i<i1; i++) {
+    const unsigned char *s = src + srcStride * i;
+    for (int j = j0; j<j1; j++) {
+      memcpy(origin + rowStep * j + colStep * i, s + pixelSize * j, pixelSize);
+    }
+  }
+}
+
+/**
+ * Transposes the tile rows [begin, end) of a transposeMapped() job.
+ */
+static void transposeBand(void *context, int begin, int end) {
+  PackedJob *job = (PackedJob *) context;
+  int height = job->height;
+  int width = job->width;
+  for (int ti = begin * KERNEL_TILE; ti < end * KERNEL_TILE && ti<height; ti += KERNEL_TILE) {
+    int i1 = ti + KERNEL_TILE < height ? ti + KERNEL_TILE : height;
+    for (int tj = 0; tj<width; tj += KERNEL_TILE) {
+      int j1 = tj + KERNEL_TILE < width ? tj + KERNEL_TILE : width;
+      if (job->pixelSize == 4) {
+        transposeTile4(job->dst, job->rowStep, job->colStep, job->src, job->srcStride, ti, i1, tj, j1);
+      } else if (job->pixelSize == 3) {
+        transposeTile3(job->dst, job->rowStep, job->colStep, job->src, job->srcStride, ti, i1, tj, j1);
+      } else {
+        transposeTileAny(job->dst, job->rowStep, job->colStep, job->src, job->srcStride, ti, i1, tj, j1,
+                         job->pixelSize);
+      }
+    }
+  }
+}
+
+/**
+ * Walks the (height x width) source in KERNEL_TILE tiles, sending pixel
+ * [i][j] to origin + j * rowStep + i * colStep.  Bands are whole rows of
+ * tiles, so each band writes its own strip of destination columns.
+ */
+static void transposeMapped(unsigned char *origin, ptrdiff_t rowStep, ptrdiff_t colStep,
+                            const unsigned char *src, size_t srcStride, int height, int width, size_t pixelSize) {
+  PackedJob job = { origin, 0, src, srcStride, height, width, pixelSize, rowStep, colStep };
+  int tileRows = (height + KERNEL_TILE - 1) / KERNEL_TILE;
+  parallelFor(0, tileRows, pixelSize * KERNEL_TILE * width, transposeBand, &job);
+}
+
+void transposePacked(unsigned char *dst, size_t dstStride, const unsigned char *src, size_t srcStride,
+                     int height, int width, size_t pixelSize) {
+  transposeMapped(dst, dstStride, pixelSize, src, srcStride, height, width, pixelSize);
+}
+
+void rotatePackedClockwise(unsigned char *dst, size_t dstStride, const unsigned char *src, size_t srcStride,
+                           int height, int width, size_t pixelSize) {
+  // [i][j] -> [j][height-1-i]: destination columns run right to left
+  transposeMapped(dst + pixelSize * (height - 1), dstStride, -(ptrdiff_t) pixelSize,
+                  src, srcStride, height, width, pixelSize);
+}
+
+void rotatePackedCounterClockwise(unsigned char *dst, size_t dstStride, const unsigned char *src, size_t srcStride,
+                                  int height, int width, size_t pixelSize) {
+  // [i][j] -> [width-1-j][i]: destination rows run bottom to top
+  transposeMapped(dst + dstStride * (width - 1), -(ptrdiff_t) dstStride, pixelSize,
+                  src, srcStride, height, width, pixelSize);
+}
+
+void transversePacked(unsigned char *dst, size_t dstStride, const unsigned char *src, size_t srcStride,
+                      int height, int width, size_t pixelSize) {
+  // [i][j] -> [width-1-j][height-1-i]: destination rows and columns both run backwards
+  transposeMapped(dst + dstStride * (width - 1) + pixelSize * (height - 1), -(ptrdiff_t) dstStride,
+                  -(ptrdiff_t) pixelSize, src, srcStride, height, width, pixelSize);
+}
+
+static void rotate180Band(void *context, int begin, int end) {
+  PackedJob *job = (PackedJob *) context;
+  size_t rowBytes = job->pixelSize * job->width;
+  if (job->dstStride == rowBytes && job->srcStride == rowBytes) {
+    // both images are one unbroken run of pixels, and the rotation is its reverse
+    reverseCopy(job->dst + job->dstStride * (job->height - end), job->src + job->srcStride * begin,
+                (size_t) (end - begin) * job->width, job->pixelSize);
+    return;
+  }
+  for (int i = begin; i<end; i++) {
+    reverseCopy(job->dst + job->dstStride * (job->height - 1 - i), job->src + job->srcStride * i,
+                job->width, job->pixelSize);
+  }
+}
+
+void rotatePacked180(unsigned char *dst, size_t dstStride, const unsigned char *src, size_t srcStride,
+                     int height, int width, size_t pixelSize) {
+  PackedJob job = { dst, dstStride, src, srcStride, height, width, pixelSize, 0, 0 };
+  parallelFor(0, height, pixelSize * width, rotate180Band, &job);
+}
+
+/**
+ * Swaps the row pairs [begin, end) (top row begin with bottom row
+ * height-1-begin, and so on), reversing each row as it moves.  An odd
+ * height's middle row pairs with itself and is just reversed.
+ */
+static void rotate180InPlaceBand(void *context, int begin, int end) {
+  PackedJob *job = (PackedJob *) context;
+  // a multiple of both 3 and 4 bytes, so whole pixels always fill it
+  unsigned char bounce[FLIP_BOUNCE_BYTES];
+  size_t pixelSize = job->pixelSize;
+  size_t width = job->width;
+  size_t chunk = sizeof(bounce) / pixelSize;
+  for (int top = begin; top<end; top++) {
+    int bottom = job->height - 1 - top;
+    unsigned char *topRow = job->dst + job->dstStride * top;
+    if (top == bottom) {
+      reverseRow(topRow, width, pixelSize);
+      continue;
+    }
+    // the start of the top row trades places with the (reversed) end of the bottom row
+    unsigned char *bottomRow = job->dst + job->dstStride * bottom;
+    for (size_t j = 0; j < width; j += chunk) {
+      size_t n = width - j < chunk ? width - j : chunk;
+      unsigned char *t = topRow + pixelSize * j;
+      unsigned char *b = bottomRow + pixelSize * (width - j - n);
+      memcpy(bounce, t, pixelSize * n);
+      reverseCopy(t, b, n, pixelSize);
+      reverseCopy(b, bounce, n, pixelSize);
+    }
+  }
+}
+
+void rotatePacked180InPlace(unsigned char *data, size_t stride, int height, int width, size_t pixelSize) {
+  PackedJob job = { data, stride, NULL, 0, height, width, pixelSize, 0, 0 };
+  parallelFor(0, (height + 1) / 2, 2 * pixelSize * width, rotate180InPlaceBand, &job);
+}
+
+static void reverseRowOrderBand(void *context, int begin, int end) {
+  PackedJob *job = (PackedJob *) context;
+  unsigned char bounce[FLIP_BOUNCE_BYTES];
+  size_t rowBytes = job->pixelSize * job->width;
+  for (int top = begin; top<end; top++) {
+    unsigned char *topRow = job->dst + job->dstStride * top;
+    unsigned char *bottomRow = job->dst + job->dstStride * (job->height - 1 - top);
+    for (size_t j = 0; j < rowBytes; j += sizeof(bounce)) {
+      size_t n = rowBytes - j < sizeof(bounce) ? rowBytes - j : sizeof(bounce);
+      memcpy(bounce, topRow + j, n);
+      memcpy(topRow + j, bottomRow + j, n);
+      memcpy(bottomRow + j, bounce, n);
+    }
+  }
+}
+
+void reverseRowOrderPacked(unsigned char *data, size_t stride, int height, int width, size_t pixelSize) {
+  PackedJob job = { data, stride, NULL, 0, height, width, pixelSize, 0, 0 };
+  parallelFor(0, height / 2, 2 * pixelSize * width, reverseRowOrderBand, &job);
+}
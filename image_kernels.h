@@ -0,0 +1,113 @@
+/**
+ * Low level pixel kernels shared by the image utilities.
+ *
+ * Every kernel works on a packed image given as a pointer to its first
+ * row, the distance in bytes between rows (stride) and the size of one
+ * pixel in bytes.  None of them allocate the destination; callers in
+ * image_utils.c take care of that.
+ *
+ * Each kernel splits its work into bands of rows and runs them with
+ * parallelFor() (see thread_pool.h), so large images use every core and
+ * small ones stay on the calling thread.
+ */
+#ifndef IMAGE_KERNELS_H
+#define IMAGE_KERNELS_H
+
+#include <stddef.h>
+
+/**
+ * Side length, in pixels, of the square tiles used by the transposing
+ * kernels.  A 32x32 tile of 4-byte pixels is 4KB, so a source tile and
+ * its destination tile sit in L1 together.
+ */
+#define KERNEL_TILE 32
+
+/**
+ * Size in bytes of the stack bounce buffer used when swapping pixels
+ * in place.  Divisible by 3 and 4 so it always holds whole pixels.
+ */
+#define FLIP_BOUNCE_BYTES 3072
+
+/**
+ * The vector instruction sets the kernels can use, narrowest first.
+ */
+typedef enum {
+  KERNEL_SIMD_NONE,
+  KERNEL_SIMD_SSE2,
+  KERNEL_SIMD_SSSE3,
+  KERNEL_SIMD_AVX2
+} KernelSimd;
+
+/**
+ * Keeps the kernels to the given instruction set and the ones below it,
+ * even where the CPU has wider ones, so that every path can be checked
+ * against the scalar code.  By default there is no limit.
+ */
+void kernelSetSimdLimit(KernelSimd limit);
+
+/**
+ * Reverses the pixels of every row of a packed image whose rows are
+ * stride bytes apart and whose pixels are pixelSize bytes wide.
+ */
+void reversePackedRows(unsigned char *data, size_t stride, int height, int width, size_t pixelSize);
+
+/**
+ * Writes the transpose of the (height x width) packed source image into
+ * the (width x height) destination image, so that pixel [i][j] lands
+ * at [j][i].  The image is walked in KERNEL_TILE tiles, and 4-byte
+ * pixels are transposed 4x4 at a time in SSE registers.
+ */
+void transposePacked(unsigned char *dst, size_t dstStride, const unsigned char *src, size_t srcStride,
+                     int height, int width, size_t pixelSize);
+
+/**
+ * Writes the 90 degree clockwise rotation of the (height x width) packed
+ * source image into the (width x height) destination image, so that
+ * pixel [i][j] lands at [j][height-1-i].  This is a single tiled pass
+ * that writes every destination pixel exactly once.
+ */
+void rotatePackedClockwise(unsigned char *dst, size_t dstStride, const unsigned char *src, size_t srcStride,
+                           int height, int width, size_t pixelSize);
+
+/**
+ * Writes the 90 degree counter-clockwise rotation of the (height x width)
+ * packed source image into the (width x height) destination image, so
+ * that pixel [i][j] lands at [width-1-j][i].  Same tiled pass as
+ * rotatePackedClockwise(), with the destination rows walked backwards.
+ */
+void rotatePackedCounterClockwise(unsigned char *dst, size_t dstStride, const unsigned char *src, size_t srcStride,
+                                  int height, int width, size_t pixelSize);
+
+/**
+ * Writes the transverse (mirror across the anti-diagonal) of the
+ * (height x width) packed source image into the (width x height)
+ * destination image, so that pixel [i][j] lands at
+ * [width-1-j][height-1-i].  Same tiled pass as rotatePackedClockwise().
+ */
+void transversePacked(unsigned char *dst, size_t dstStride, const unsigned char *src, size_t srcStride,
+                      int height, int width, size_t pixelSize);
+
+/**
+ * Writes the 180 degree rotation of the (height x width) packed source
+ * image into the (height x width) destination image.  When both images
+ * are tightly packed this is one linear reverse over the whole buffer.
+ * The destination must not overlap the source.
+ */
+void rotatePacked180(unsigned char *dst, size_t dstStride, const unsigned char *src, size_t srcStride,
+                     int height, int width, size_t pixelSize);
+
+/**
+ * Rotates a (height x width) packed image 180 degrees in place, which is
+ * what flipVertical() does.  Each pair of rows is swapped and reversed in
+ * one pass through a small bounce buffer; rows stay where they are in memory.
+ */
+void rotatePacked180InPlace(unsigned char *data, size_t stride, int height, int width, size_t pixelSize);
+
+/**
+ * Reverses the order of the rows of a (height x width) packed image in
+ * place, leaving each row's pixels as they are.  Row contents are
+ * swapped through a small bounce buffer; rows stay where they are in memory.
+ */
+void reverseRowOrderPacked(unsigned char *data, size_t stride, int height, int width, size_t pixelSize);
+
+#endif
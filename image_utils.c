@@ -1,5 +1,20 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <limits.h>
+#include <stdint.h>
+#include <math.h>
+
+#include "buffer_pool.h"
+
+// stb's decode buffers and its writers' scratch come from the pool as well
+#define STBI_MALLOC(size) poolAlloc(size)
+#define STBI_REALLOC(block, size) poolRealloc(block, size)
+#define STBI_FREE(block) poolFree(block)
+#define STBIW_MALLOC(size) poolAlloc(size)
+#define STBIW_REALLOC(block, size) poolRealloc(block, size)
+#define STBIW_FREE(block) poolFree(block)
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
@@ -8,90 +23,492 @@
 #include "stb_image_write.h"
 
 #include "image_utils.h"
+#include "image_kernels.h"
+#include "thread_pool.h"
+#include "jpeg_encoder.h"
+#include "jpeg_decoder.h"
+#include "jpeg_coefficients.h"
+
+/**
+ * Works out the size of a (height x width) image's pixel block and of its
+ * table of row pointers, with all the arithmetic in size_t.
+ *
+ * @return 1 on success, or 0 if a dimension isn't positive or either size
+ *         doesn't fit in a size_t.
+ */
+static int imageSizes(int height, int width, size_t pixelSize, size_t *blockBytes, size_t *tableBytes) {
+  if (height < 1 || width < 1 || (size_t) width > SIZE_MAX / pixelSize / (size_t) height
+      || (size_t) height > SIZE_MAX / sizeof(void *)) {
+    return 0;
+  }
+  *blockBytes = pixelSize * (size_t) width * (size_t) height;
+  *tableBytes = sizeof(void *) * (size_t) height;
+  return 1;
+}
+
+/**
+ * Allocates a (height x width) Pixel image in the loadImage() layout:
+ * a table of row pointers into one contiguous block of pixels.
+ */
+static Pixel **allocPixels(int height, int width) {
+  size_t blockBytes, tableBytes;
+  if (!imageSizes(height, width, sizeof(Pixel), &blockBytes, &tableBytes)) {
+    return NULL;
+  }
+  Pixel **image = (Pixel **) malloc(tableBytes);
+  if (image == NULL) {
+    return NULL;
+  }
+  image[0] = (Pixel *) poolAlloc(blockBytes);
+  if (image[0] == NULL) {
+    free(image);
+    return NULL;
+  }
+  for (int i = 1; i<height; i++) {
+    image[i] = image[0] + (size_t) width * i;
+  }
+  return image;
+}
+
+/**
+ * The arguments of a Pixel transform, handed to its band function by
+ * parallelFor().  Bands are ranges of source rows (or of tile rows, or
+ * of row pairs for the in-place flips), each writing its own part of dst.
+ */
+typedef struct {
+  Pixel **src;
+  Pixel **dst;
+  int height;
+  int width;
+} PixelJob;
+
+static ImageBudget budget = { 0, 0 };
+
+void imageSetBudget(const ImageBudget *newBudget) {
+  budget = *newBudget;
+}
+
+int imageProbeMemory(const unsigned char *buffer, size_t length, ImageInfo *info) {
+  if (length > INT_MAX) {
+    return stbi__err("file too large", "Image file is too large");
+  }
+  if (!stbi_info_from_memory(buffer, (int) length, &info->width, &info->height, &info->channels)) {
+    return 0;
+  }
+  info->bitDepth = stbi_is_hdr_from_memory(buffer, (int) length) ? 32 :
+                   stbi_is_16_bit_from_memory(buffer, (int) length) ? 16 : 8;
+  return 1;
+}
+
+int imageProbe(const char *filePath, ImageInfo *info) {
+  // only the header is read; stb puts the file position back after each look
+  FILE *file = fopen(filePath, "rb");
+  if (file == NULL) {
+    return stbi__err("can't fopen", "Unable to open file");
+  }
+  int ok = stbi_info_from_file(file, &info->width, &info->height, &info->channels);
+  if (ok) {
+    info->bitDepth = stbi_is_hdr_from_file(file) ? 32 : stbi_is_16_bit_from_file(file) ? 16 : 8;
+  }
+  fclose(file);
+  return ok;
+}
+
+int imageWithinBudget(const ImageInfo *info, size_t bytesPerPixel) {
+  size_t pixels = (size_t) info->width * info->height;
+  if (budget.maxPixels != 0 && pixels > budget.maxPixels) {
+    return stbi__err("too many pixels", "Image is over the pixel budget");
+  }
+  if (budget.maxBytes != 0 && pixels > budget.maxBytes / bytesPerPixel) {
+    return stbi__err("too large", "Image is over the memory budget");
+  }
+  return 1;
+}
+
+int imageWithinBudgetBytes(const ImageInfo *info, size_t bytes) {
+  size_t pixels = (size_t) info->width * info->height;
+  if (budget.maxPixels != 0 && pixels > budget.maxPixels) {
+    return stbi__err("too many pixels", "Image is over the pixel budget");
+  }
+  if (budget.maxBytes != 0 && bytes > budget.maxBytes) {
+    return stbi__err("too large", "Image is over the memory budget");
+  }
+  return 1;
+}
+
+/**
+ * Estimates the memory a decoder works in per pixel, on top of its
+ * output: a byte per sample for the component planes, plus a wider copy
+ * of every sample.  That copy is the coefficients for JPEGs, a short per
+ * sample in both the parallel decoder and stb's progressive one.  For
+ * 16-bit and HDR files it is the samples at their own depth, before they
+ * are converted to 8 bits.  Chroma subsampling is ignored, so for JPEGs
+ * this is an upper bound.
+ */
+static size_t decoderBytesPerPixel(const ImageInfo *info) {
+  size_t wide = info->bitDepth > 8 ? (size_t) info->bitDepth / 8 : sizeof(short);
+  return (size_t) info->channels * (1 + wide);
+}
+
+/**
+ * Decodes an encoded image to 8-bit pixels with the given number of
+ * channels, like stbi_load_from_memory().  JPEGs with restart markers
+ * are decoded in parallel; everything else, and anything the parallel
+ * decoder turns down, goes through stb.  Either way the result comes from
+ * the buffer pool and is released with stbi_image_free().
+ *
+ * The header is checked against the budget first.  The estimate counts
+ * the decoded pixels, the decoder's working memory, and bytesPerPixel
+ * for the caller's own copy of the image.
+ */
+static unsigned char *decodeMemory(const unsigned char *buffer, size_t length, int *width, int *height,
+                                   int channels, size_t bytesPerPixel) {
+  ImageInfo info;
+  if (!imageProbeMemory(buffer, length, &info) ||
+      !imageWithinBudget(&info, channels + decoderBytesPerPixel(&info) + bytesPerPixel)) {
+    return NULL;
+  }
+  unsigned char *data = jpegDecodePixels(buffer, length, width, height, channels);
+  if (data == NULL) {
+    int n;
+    data = stbi_load_from_memory(buffer, (int) length, width, height, &n, channels);
+  }
+  return data;
+}
+
+/**
+ * Decodes an image file as decodeMemory() does.  The file is mapped
+ * rather than read through stdio, so the decoders work straight from the
+ * page cache.
+ */
+static unsigned char *decodeFile(const char *filePath, int *width, int *height, int channels,
+                                 size_t bytesPerPixel) {
+  JpegFileData file;
+  if (!jpegMapFile(filePath, &file)) {
+    stbi__err("can't fopen", "Unable to open file");
+    return NULL;
+  }
+  unsigned char *data = decodeMemory(file.data, file.length, width, height, channels, bytesPerPixel);
+  jpegUnmapFile(&file);
+  return data;
+}
+
+/**
+ * Converts decoded RGBA pixels into a new Pixel image, releasing them.
+ *
+ * @return The image, or NULL if it can't be allocated.
+ */
+static Pixel **toPixels(unsigned char *data, int x, int y) {
+  Pixel **image = allocPixels(y, x);
+  if (image != NULL) {
+    // the block is contiguous, so it is filled in one pass; offsets are size_t for images past 2^31 bytes
+    Pixel *pixels = image[0];
+    size_t count = (size_t) x * y;
+    for (size_t i = 0; i<count; i++) {
+      pixels[i].red   = data[4 * i + 0];
+      pixels[i].green = data[4 * i + 1];
+      pixels[i].blue  = data[4 * i + 2];
+    }
+  }
+  stbi_image_free(data);
+  return image;
+}
 
 Pixel **loadImage(const char *filePath, int *height, int *width) {
-  int x,y,n;
-  unsigned char *data = stbi_load(filePath, &x, &y, &n, 4); //4 = force RGBA channels
+  int x,y;
+  unsigned char *data = decodeFile(filePath, &x, &y, 4, sizeof(Pixel)); //4 = force RGBA channels
+  if (data == NULL) {
+    fprintf(stderr, "Unable to load %s: %s\n", filePath, stbi_failure_reason());
+    return NULL;
+  }
+  Pixel **image = toPixels(data, x, y);
+  if (image == NULL) {
+    fprintf(stderr, "Unable to allocate new image (loadImage).\n");
+    return NULL;
+  }
   *height = y;
   *width = x;
+  return image;
+}
 
-  //contiguous allocation:
-  Pixel **image = (Pixel **)malloc(sizeof(Pixel *) * y);
-  image[0] = (Pixel *)malloc(sizeof(Pixel) * (y * x));
-  for(int i=1; i<y; i++) {
-    image[i] = (*image + (x * i));
-  }
-
-  int rowIndex = 0;
-  int colIndex = 0;
-  for(int i=0; i<(x * y * 4); i+=4) { //for each row
-      image[rowIndex][colIndex].red   = data[i+0];
-      image[rowIndex][colIndex].green = data[i+1];
-      image[rowIndex][colIndex].blue  = data[i+2];
-      colIndex++;
-      if(colIndex == x) {
-        //go to next row, reset column
-        rowIndex++;
-        colIndex=0;
-      }
+Pixel **loadImageFromMemory(const unsigned char *buffer, size_t length, int *height, int *width) {
+  int x,y;
+  unsigned char *data = decodeMemory(buffer, length, &x, &y, 4, sizeof(Pixel)); //4 = force RGBA channels
+  if (data == NULL) {
+    fprintf(stderr, "Unable to load image: %s\n", stbi_failure_reason());
+    return NULL;
   }
-  stbi_image_free(data);
+  Pixel **image = toPixels(data, x, y);
+  if (image == NULL) {
+    fprintf(stderr, "Unable to allocate new image (loadImageFromMemory).\n");
+    return NULL;
+  }
+  *height = y;
+  *width = x;
   return image;
 }
 
-void saveImage(const char *fileName, Pixel **image, int height, int width) {
+/**
+ * Where the JPEG encoder reads rows from: either a Pixel image, converted
+ * to RGB a row at a time, or packed rows that are handed over as they are.
+ */
+typedef struct {
+  Pixel **pixels;
+  const unsigned char *data;
+  size_t stride;
+  int width;
+  ImageRowSource rows;   // a caller's own rows, for imageSaveRows()
+  void *context;
+} RowSource;
 
-  // Convert height x width Pixel array to single array with
-  // 3 (RGB) channels, ignoring the alpha channel and assume 100% opaque
-  unsigned char *data = (unsigned char *) malloc(height * width * 3);
-  int x = 0;
-  for(int i=0; i<height; i++) {
-    for(int j=0; j<width; j++) {
-      data[x+0] = image[i][j].red;
-      data[x+1] = image[i][j].green;
-      data[x+2] = image[i][j].blue;
-      x+=3;
+static const unsigned char *pixelRows(void *context, int row, unsigned char *buffer) {
+  const RowSource *source = (const RowSource *) context;
+  const Pixel *pixels = source->pixels[row];
+  // ignoring the alpha channel and assuming 100% opaque
+  for (size_t j = 0; j<(size_t) source->width; j++) {
+    buffer[3 * j + 0] = pixels[j].red;
+    buffer[3 * j + 1] = pixels[j].green;
+    buffer[3 * j + 2] = pixels[j].blue;
+  }
+  return buffer;
+}
+
+static const unsigned char *packedRows(void *context, int row, unsigned char *buffer) {
+  const RowSource *source = (const RowSource *) context;
+  return source->data + source->stride * row;
+}
+
+static const unsigned char *callerRows(void *context, int row, unsigned char *buffer) {
+  const RowSource *source = (const RowSource *) context;
+  return source->rows(source->context, row, buffer);
+}
+
+// bytes gathered before each fwrite()
+#define WRITE_BUFFER_SIZE (1 << 16)
+
+/**
+ * Gathers encoder output on its way to a file, so the many small writes
+ * the encoders make turn into a few large fwrite() calls.  writeBuffered()
+ * has the stbi_write_func signature, so the same writer serves the
+ * stbi_write_*_to_func() functions.
+ */
+typedef struct {
+  FILE *file;
+  size_t used;
+  int failed;
+  unsigned char buffer[WRITE_BUFFER_SIZE];
+} BufferedWriter;
+
+static void flushWriter(BufferedWriter *writer) {
+  if (writer->used > 0 && fwrite(writer->buffer, 1, writer->used, writer->file) != writer->used) {
+    writer->failed = 1;
+  }
+  writer->used = 0;
+}
+
+static void writeBuffered(void *context, void *data, int size) {
+  BufferedWriter *writer = (BufferedWriter *) context;
+  if (writer->used + size > WRITE_BUFFER_SIZE) {
+    flushWriter(writer);
+  }
+  if (size >= WRITE_BUFFER_SIZE) {
+    // large pieces go straight through rather than being copied
+    if (fwrite(data, 1, size, writer->file) != (size_t) size) {
+      writer->failed = 1;
     }
+    return;
   }
-  //write
-  stbi_write_jpg(fileName, width, height, 3, data, 100);
-  free(data);
-  return;
+  memcpy(writer->buffer + writer->used, data, size);
+  writer->used += size;
 }
 
-Pixel ** copyImage(Pixel **image, int height, int width) {
-  // this is essentially a deep copy of a 2D array of pixels instead of a 2D array of integers
+static int writeEncoded(void *context, const void *data, size_t size) {
+  BufferedWriter *writer = (BufferedWriter *) context;
+  while (size > 0 && !writer->failed) {
+    int piece = size < INT_MAX ? (int) size : INT_MAX;
+    writeBuffered(writer, (void *) data, piece);
+    data = (const unsigned char *) data + piece;
+    size -= piece;
+  }
+  return !writer->failed;
+}
 
-  if (image == NULL) return NULL;
-  if (height < 1 || width < 1) return NULL;
+static SaveOptions saveOptions = { IMAGE_FORMAT_AUTO, 100, 0 };
 
-  //allocate memory for the new image
-  Pixel **newImage = (Pixel **) malloc(sizeof(Pixel *) * height);
-  if (newImage == NULL) {
-    printf("Unable to allocate new image.\n");
-    return NULL;
+static const char *formatExtensions[] = { NULL, "jpg", "png", "bmp", "tga", "hdr" };
+
+void imageSetSaveOptions(const SaveOptions *options) {
+  saveOptions = *options;
+}
+
+ImageFormat imageFormatFromPath(const char *filePath) {
+  const char *dot = strrchr(filePath, '.');
+  if (dot == NULL || strchr(dot, '/') != NULL) {
+    return IMAGE_FORMAT_AUTO;
+  }
+  if (strcasecmp(dot + 1, "jpeg") == 0) {
+    return IMAGE_FORMAT_JPEG;
   }
+  for (int format = IMAGE_FORMAT_JPEG; format <= IMAGE_FORMAT_HDR; format++) {
+    if (strcasecmp(dot + 1, formatExtensions[format]) == 0) {
+      return (ImageFormat) format;
+    }
+  }
+  return IMAGE_FORMAT_AUTO;
+}
 
-  // iterate over each Pixel array in and newImage and create an array of pixels
-  for (int i = 0; i<height; i++) {
-    newImage[i] = (Pixel *) malloc(sizeof(Pixel) * width);
-    if (newImage[i] == NULL) {
-      // malloc for this row has failed, free previous rows allcoated and table
-      printf("Unable to allocat the %d row in new image (copyImage)\n", i+1);
-      for (int j = 0; j<i; j++) {
-        free(newImage[j]); // free row
+ImageFormat imageSaveFormat(const char *filePath) {
+  ImageFormat format = saveOptions.format != IMAGE_FORMAT_AUTO ? saveOptions.format : imageFormatFromPath(filePath);
+  return format != IMAGE_FORMAT_AUTO ? format : IMAGE_FORMAT_JPEG;
+}
+
+const char *imageFormatExtension(ImageFormat format) {
+  return formatExtensions[format != IMAGE_FORMAT_AUTO ? format : IMAGE_FORMAT_JPEG];
+}
+
+/**
+ * Writes an image with one of stb's writers.  Unlike the JPEG encoder
+ * they take the whole image at once, so Pixel images (and padded rows,
+ * for all but PNG) are packed into a temporary copy first.  HDR takes
+ * linear floats, which are made with the same 2.2 gamma stb_image uses
+ * to turn 8-bit images into HDR ones.
+ *
+ * @return 1 on success, 0 on failure.
+ */
+static int writeWithStb(BufferedWriter *writer, ImageFormat format, int height, int width, int channels,
+                        JpegRowSource rows, RowSource *source) {
+  size_t rowBytes = (size_t) width * channels;
+  // stb's writers index the image (and PNG its filtered copy, a byte longer per row) with int offsets
+  if (height < 1 || rowBytes + 1 > (size_t) INT_MAX / height || rowBytes * height > SIZE_MAX / sizeof(float)) {
+    return jpegFail("image too large for this format");
+  }
+  const unsigned char *data = source->data;
+  size_t stride = source->stride;
+  unsigned char *packed = NULL;
+  if (data == NULL || (stride != rowBytes && format != IMAGE_FORMAT_PNG)) {
+    packed = (unsigned char *) poolAlloc(rowBytes * height);
+    if (packed == NULL) {
+      return jpegFail("out of memory");
+    }
+    for (int i = 0; i<height; i++) {
+      const unsigned char *row = rows(source, i, packed + rowBytes * i);
+      if (row != packed + rowBytes * i) {
+        memcpy(packed + rowBytes * i, row, rowBytes);
       }
-      free(newImage); // free the new image
-    } 
+    }
+    data = packed;
+    stride = rowBytes;
+  }
 
-    // if malloc for row successful: copy the array of pixels of image[i] to newImage[i]
-    for (int k = 0; k<width; k++) {
-      newImage[i][k] = image[i][k];
+  int ok = 0;
+  if (format == IMAGE_FORMAT_PNG) {
+    ok = stbi_write_png_to_func(writeBuffered, writer, width, height, channels, data, (int) stride);
+  } else if (format == IMAGE_FORMAT_BMP) {
+    ok = stbi_write_bmp_to_func(writeBuffered, writer, width, height, channels, data);
+  } else if (format == IMAGE_FORMAT_TGA) {
+    ok = stbi_write_tga_to_func(writeBuffered, writer, width, height, channels, data);
+  } else {
+    float linear[256];
+    for (int v = 0; v<256; v++) {
+      linear[v] = powf(v / 255.0f, 2.2f);
+    }
+    float *pixels = (float *) poolAlloc(sizeof(float) * rowBytes * height);
+    if (pixels != NULL) {
+      for (size_t i = 0; i<rowBytes * height; i++) {
+        pixels[i] = linear[data[i]];
+      }
+      ok = stbi_write_hdr_to_func(writeBuffered, writer, width, height, channels, pixels);
+      poolFree(pixels);
     }
   }
+  poolFree(packed);
+  return ok || jpegFail("unable to encode image");
+}
 
-  return newImage;
+/**
+ * Saves rows from a RowSource through a BufferedWriter, in the format and
+ * with the options set by imageSetSaveOptions().  JPEGs are streamed
+ * through the encoder a strip at a time; the other formats go to stb.
+ *
+ * @return 1 on success, 0 on failure (see jpegFailureReason()).
+ */
+static int writeImage(const char *filePath, int height, int width, int channels,
+                      JpegRowSource rows, RowSource *source) {
+  ImageFormat format = imageSaveFormat(filePath);
+  BufferedWriter *writer = (BufferedWriter *) poolAlloc(sizeof(BufferedWriter));
+  if (writer == NULL) {
+    return jpegFail("out of memory");
+  }
+  writer->used = 0;
+  writer->failed = 0;
+  int toStdout = strcmp(filePath, "-") == 0;
+  writer->file = toStdout ? stdout : fopen(filePath, "wb");
+  if (writer->file == NULL) {
+    poolFree(writer);
+    return jpegFail("unable to open file");
+  }
+  int ok;
+  if (format == IMAGE_FORMAT_JPEG) {
+    ok = jpegEncode(writeEncoded, writer, width, height, channels, saveOptions.quality, saveOptions.subsample,
+                    rows, source);
+  } else {
+    ok = writeWithStb(writer, format, height, width, channels, rows, source);
+  }
+  flushWriter(writer);
+  if ((toStdout ? fflush(writer->file) : fclose(writer->file)) != 0 || writer->failed) {
+    ok = ok && jpegFail("unable to write file");
+  }
+  poolFree(writer);
+  return ok;
+}
+
+int saveImage(const char *fileName, Pixel **image, int height, int width) {
+  // rows are converted as the encoder's strips ask for them, so no RGB copy of the whole image is made
+  RowSource source = { image, NULL, 0, width };
+  if (!writeImage(fileName, height, width, 3, pixelRows, &source)) {
+    fprintf(stderr, "Unable to save %s: %s\n", fileName, jpegFailureReason());
+    return 0;
+  }
+  return 1;
+}
+
+void freeImage(Pixel **image) {
+  if (image == NULL) return;
+  poolFree(image[0]);
+  free(image);
+}
+
+static void copyRowsBand(void *context, int begin, int end) {
+  PixelJob *job = (PixelJob *) context;
+  for (int i = begin; i<end; i++) {
+    memcpy(job->dst[i], job->src[i], sizeof(Pixel) * job->width);
+  }
+}
+
+static void copyBlockBand(void *context, int begin, int end) {
+  PixelJob *job = (PixelJob *) context;
+  memcpy(job->dst[begin], job->src[begin], sizeof(Pixel) * job->width * (end - begin));
+}
 
+Pixel ** copyImage(Pixel **image, int height, int width) {
+  if (image == NULL) return NULL;
+  if (height < 1 || width < 1) return NULL;
+
+  // the copy is in the loadImage() layout whatever the original's, so it is released the same way
+  Pixel **newImage = allocPixels(height, width);
+  if (newImage == NULL) {
+    fprintf(stderr, "Unable to allocate new image (copyImage).\n");
+    return NULL;
+  }
+
+  // an original in that layout too is copied a band of rows per memcpy, others a row at a time
+  int contiguous = 1;
+  for (int i = 1; contiguous && i<height; i++) {
+    contiguous = image[i] == image[0] + (size_t) width * i;
+  }
+  PixelJob job = { image, newImage, height, width };
+  parallelFor(0, height, 2 * sizeof(Pixel) * width, contiguous ? copyBlockBand : copyRowsBand, &job);
+  return newImage;
 }
 
 void flipHorizontal(Pixel **image, int height, int width) {
@@ -99,85 +516,170 @@ void flipHorizontal(Pixel **image, int height, int width) {
   reverseRows(image, height, width);
 }
 
+static void flipVerticalBand(void *context, int begin, int end) {
+  PixelJob *job = (PixelJob *) context;
+  Pixel **image = job->dst;
+  int width = job->width;
+  Pixel bounce[FLIP_BOUNCE_BYTES / sizeof(Pixel)];
+  int chunk = FLIP_BOUNCE_BYTES / sizeof(Pixel);
+  for (int top = begin; top<end; top++) {
+    int bottom = job->height - 1 - top;
+    if (top == bottom) {
+      // odd height: the middle row only needs reversing
+      reverseRows(image + top, 1, width);
+      continue;
+    }
+    for (int j = 0; j<width; j += chunk) {
+      int n = width - j < chunk ? width - j : chunk;
+      // top[j, j+n) trades places with bottom[width-j-n, width-j), reversed
+      memcpy(bounce, image[top] + j, sizeof(Pixel) * n);
+      for (int k = 0; k<n; k++) {
+        image[top][j + k] = image[bottom][width - 1 - j - k];
+      }
+      for (int k = 0; k<n; k++) {
+        image[bottom][width - 1 - j - k] = bounce[k];
+      }
+    }
+  }
+}
+
 void flipVertical(Pixel **image, int height, int width) {
 
-  // reverse the array order
-  int top = 0;
-  int bottom = height - 1;
-  while (top < bottom) {
-    Pixel *temp = image[top];
-    image[top] = image[bottom];
-    image[bottom] = temp;
-    top++;
-    bottom--;
+  // swap the contents of the rows rather than the row pointers, so the image keeps the
+  // contiguous layout from loadImage.  Each row is reversed as it is swapped, which gives
+  // the same result as swapping the rows and then calling reverseRows, in a single pass.
+  // The bands are ranges of row pairs (top row i with bottom row height-1-i).
+  PixelJob job = { image, image, height, width };
+  parallelFor(0, (height + 1) / 2, 2 * sizeof(Pixel) * width, flipVerticalBand, &job);
+}
+
+/*
+ * The transpose-like Pixel transforms are split into bands of KERNEL_TILE
+ * source rows, so each band is a row of whole tiles.  TILE_LOOP walks the
+ * tiles of the band's rows [ti0, ti1) and runs body for each pixel [i][j].
+ */
+#define TILE_LOOP(job, begin, end, body) \
+  for (int ti = (begin) * KERNEL_TILE; ti < (end) * KERNEL_TILE && ti < (job)->height; ti += KERNEL_TILE) { \
+    int iEnd = ti + KERNEL_TILE < (job)->height ? ti + KERNEL_TILE : (job)->height; \
+    for (int tj = 0; tj < (job)->width; tj += KERNEL_TILE) { \
+      int jEnd = tj + KERNEL_TILE < (job)->width ? tj + KERNEL_TILE : (job)->width; \
+      for (int i = ti; i<iEnd; i++) { \
+        for (int j = tj; j<jEnd; j++) { \
+          body; \
+        } \
+      } \
+    } \
   }
 
-  // reverse the rows
-  reverseRows(image, height, width);
+static int tileRows(int height) {
+  return (height + KERNEL_TILE - 1) / KERNEL_TILE;
 }
 
-Pixel ** rotateClockwise(Pixel **image, int height, int width) {
-  // first tanspose an array, then reverse the transposed array rows
-  // new height and width of transposed array
-  int tHeight, tWidth;
-  Pixel **transposedImage = transpose(image, height, width, &tHeight, &tWidth);
-  reverseRows(transposedImage, tHeight, tWidth);
-  return transposedImage;
+static void rotateClockwiseBand(void *context, int begin, int end) {
+  PixelJob *job = (PixelJob *) context;
+  int height = job->height;
+  TILE_LOOP(job, begin, end, job->dst[j][height - 1 - i] = job->src[i][j]);
 }
 
-Pixel ** rotateCounterClockwise(Pixel **image, int height, int width) {
+static void rotateCounterClockwiseBand(void *context, int begin, int end) {
+  PixelJob *job = (PixelJob *) context;
+  int width = job->width;
+  TILE_LOOP(job, begin, end, job->dst[width - 1 - j][i] = job->src[i][j]);
+}
 
+static void transposeBand(void *context, int begin, int end) {
+  PixelJob *job = (PixelJob *) context;
+  TILE_LOOP(job, begin, end, job->dst[j][i] = job->src[i][j]);
 }
 
-Pixel **transpose(Pixel **image, int height, int width, int *tHeight, int *tWidth) {
+static void transverseBand(void *context, int begin, int end) {
+  PixelJob *job = (PixelJob *) context;
+  int height = job->height;
+  int width = job->width;
+  TILE_LOOP(job, begin, end, job->dst[width - 1 - j][height - 1 - i] = job->src[i][j]);
+}
 
-  // no need to check for null pointer or invalid h,w
+static void rotate180Band(void *context, int begin, int end) {
+  PixelJob *job = (PixelJob *) context;
+  Pixel *out = job->dst[0] + (size_t) (job->height - begin) * job->width;
+  for (int i = begin; i<end; i++) {
+    for (int j = 0; j<job->width; j++) {
+      *--out = job->src[i][j];
+    }
+  }
+}
 
-  // create a new array of opposite dimensions
-  Pixel **newImage = (Pixel **) malloc(sizeof(Pixel *) * width);
-  if (newImage == NULL) {
-    printf("Allocation for new image failed in transpose.\n");
+Pixel ** rotateClockwise(Pixel **image, int height, int width) {
+  // the rotated image is (width x height), with pixel [i][j] moving to [j][height-1-i]
+  Pixel **rotated = allocPixels(width, height);
+  if (rotated == NULL) {
+    fprintf(stderr, "Allocation for new image failed in rotateClockwise.\n");
     return NULL;
   }
 
-  // create the rows of length height to change dimensions
-  for (int i = 0; i<width; i++) { // using width here will iterate over the number of rows
-    newImage[i] = (Pixel *) malloc(sizeof(Pixel) * height); // height here will create (height) number of rows
-    // check if allocation failed for a new row
-    if (newImage[i] == NULL) {
-      // free prev allocated rows from 0 to i (not including i as it was not successfully allocated)
-      for (int k = 0; k<i; k++) {
-        free(newImage[k]);
-      }
-      // free the newImage
-      free(newImage);
-      return NULL;
-    }
+  // one tiled pass, so every pixel is written once and the rows being written stay in cache
+  PixelJob job = { image, rotated, height, width };
+  parallelFor(0, tileRows(height), sizeof(Pixel) * KERNEL_TILE * width, rotateClockwiseBand, &job);
+  return rotated;
+}
 
-    // else: row was allocated
+Pixel ** rotateCounterClockwise(Pixel **image, int height, int width) {
+  // the rotated image is (width x height), with pixel [i][j] moving to [width-1-j][i]
+  Pixel **rotated = allocPixels(width, height);
+  if (rotated == NULL) {
+    fprintf(stderr, "Allocation for new image failed in rotateCounterClockwise.\n");
+    return NULL;
   }
 
-  // whole table was allocated if we get to this point
+  // same tiled single pass as rotateClockwise, walking the destination rows bottom up
+  PixelJob job = { image, rotated, height, width };
+  parallelFor(0, tileRows(height), sizeof(Pixel) * KERNEL_TILE * width, rotateCounterClockwiseBand, &job);
+  return rotated;
+}
 
-  // iterate over original image using its dimentions (height * width) 
-  for (int i = 0; i<height; i++) {
-    for (int j = 0; j<width; j++) {
-      // set new image at [j][i] to the val at original image [i][j] 
-      // which exists due to the new dimensions
-      newImage[j][i] = image[i][j];
-    }
+Pixel ** rotate180(Pixel **image, int height, int width) {
+  Pixel **rotated = allocPixels(height, width);
+  if (rotated == NULL) {
+    fprintf(stderr, "Allocation for new image failed in rotate180.\n");
+    return NULL;
   }
 
+  // the result is one contiguous block, so the rotation is a single linear reverse:
+  // walk the source forwards while filling the result from its last pixel backwards
+  PixelJob job = { image, rotated, height, width };
+  parallelFor(0, height, 2 * sizeof(Pixel) * width, rotate180Band, &job);
+  return rotated;
+}
+
+Pixel **transpose(Pixel **image, int height, int width, int *tHeight, int *tWidth) {
+
+  // no need to check for null pointer or invalid h,w
+
+  // create a new array of opposite dimensions, in the same contiguous layout as loadImage
+  Pixel **newImage = allocPixels(width, height);
+  if (newImage == NULL) {
+    fprintf(stderr, "Allocation for new image failed in transpose.\n");
+    return NULL;
+  }
+
+  // walk the original image in square tiles: writing newImage[j][i] down a column touches
+  // a different row (and cache line) for every pixel, so keep those rows to a tile's worth
+  PixelJob job = { image, newImage, height, width };
+  parallelFor(0, tileRows(height), sizeof(Pixel) * KERNEL_TILE * width, transposeBand, &job);
+
   // give the calling scope the update tHeight and tWidth variables for using this new image
   *tHeight = width;
   *tWidth = height;
   return newImage;
 }
 
-void reverseRows(Pixel **image, int height, int width) {
+static void reverseRowsBand(void *context, int begin, int end) {
+  PixelJob *job = (PixelJob *) context;
+  Pixel **image = job->dst;
+  int width = job->width;
   int left, right;
   Pixel temp;
-  for (int i = 0; i<height; i++) {
+  for (int i = begin; i<end; i++) {
     left = 0;
     right = width-1;
     while (left < right) {
@@ -189,3 +691,495 @@ void reverseRows(Pixel **image, int height, int width) {
     }
   }
 }
+
+void reverseRows(Pixel **image, int height, int width) {
+  PixelJob job = { image, image, height, width };
+  parallelFor(0, height, sizeof(Pixel) * width, reverseRowsBand, &job);
+}
+
+/*
+ * Each transform, seen as a map on pixel coordinates measured from the
+ * image's centre, optionally swaps x and y and then negates either of
+ * them.  Bit 2 is the swap, bit 0 negates x and bit 1 negates y.
+ */
+static const unsigned char transformBits[8] = {
+  0, // identity:        ( x,  y)
+  1, // flip horizontal: (-x,  y)
+  2, // flip vertical:   ( x, -y)
+  5, // rotate 90:       (-y,  x)
+  3, // rotate 180:      (-x, -y)
+  6, // rotate 270:      ( y, -x)
+  4, // transpose:       ( y,  x)
+  7  // transverse:      (-y, -x)
+};
+
+static const Transform transformFromBits[8] = {
+  TRANSFORM_IDENTITY, TRANSFORM_FLIP_HORIZONTAL, TRANSFORM_FLIP_VERTICAL, TRANSFORM_ROTATE_180,
+  TRANSFORM_TRANSPOSE, TRANSFORM_ROTATE_90, TRANSFORM_ROTATE_270, TRANSFORM_TRANSVERSE
+};
+
+Transform composeTransforms(Transform first, Transform second) {
+  int a = transformBits[first];
+  int b = transformBits[second];
+  // second's swap moves first's negations onto the other axis before its own are applied
+  int carried = (b & 4) ? ((a & 1) << 1) | ((a & 2) >> 1) : (a & 3);
+  return transformFromBits[((a ^ b) & 4) | (carried ^ (b & 3))];
+}
+
+Transform composeTransformList(const Transform *ops, int count) {
+  Transform result = TRANSFORM_IDENTITY;
+  for (int i = 0; i<count; i++) {
+    result = composeTransforms(result, ops[i]);
+  }
+  return result;
+}
+
+int transformSwapsAxes(Transform transform) {
+  return (transformBits[transform] & 4) != 0;
+}
+
+void transformPoint(Transform transform, int height, int width, int i, int j, int *newI, int *newJ) {
+  int bits = transformBits[transform];
+  if (bits & 4) {
+    int t = i; i = j; j = t;
+    t = height; height = width; width = t;
+  }
+  *newI = (bits & 2) ? height - 1 - i : i;
+  *newJ = (bits & 1) ? width - 1 - j : j;
+}
+
+/**
+ * Mirrors the image across its anti-diagonal, so that pixel [i][j] moves
+ * to [width-1-j][height-1-i] of a new (width x height) image.
+ */
+static Pixel **transverse(Pixel **image, int height, int width) {
+  Pixel **result = allocPixels(width, height);
+  if (result == NULL) {
+    fprintf(stderr, "Allocation for new image failed in transverse.\n");
+    return NULL;
+  }
+
+  // same tiled single pass as rotateClockwise, walking the destination backwards both ways
+  PixelJob job = { image, result, height, width };
+  parallelFor(0, tileRows(height), sizeof(Pixel) * KERNEL_TILE * width, transverseBand, &job);
+  return result;
+}
+
+/**
+ * Reverses the order of the rows without mirroring them.  The row contents
+ * are swapped so an image in the loadImage() layout stays contiguous.
+ */
+static void reverseRowOrderBand(void *context, int begin, int end) {
+  PixelJob *job = (PixelJob *) context;
+  Pixel **image = job->dst;
+  int width = job->width;
+  Pixel bounce[FLIP_BOUNCE_BYTES / sizeof(Pixel)];
+  int chunk = FLIP_BOUNCE_BYTES / sizeof(Pixel);
+  for (int top = begin; top<end; top++) {
+    int bottom = job->height - 1 - top;
+    for (int j = 0; j<width; j += chunk) {
+      size_t bytes = sizeof(Pixel) * (width - j < chunk ? width - j : chunk);
+      memcpy(bounce, image[top] + j, bytes);
+      memcpy(image[top] + j, image[bottom] + j, bytes);
+      memcpy(image[bottom] + j, bounce, bytes);
+    }
+  }
+}
+
+static void reverseRowOrder(Pixel **image, int height, int width) {
+  PixelJob job = { image, image, height, width };
+  parallelFor(0, height / 2, 2 * sizeof(Pixel) * width, reverseRowOrderBand, &job);
+}
+
+Pixel **transformImage(Pixel **image, int height, int width, Transform transform, int *newHeight, int *newWidth) {
+  int swaps = transformSwapsAxes(transform);
+  *newHeight = swaps ? width : height;
+  *newWidth = swaps ? height : width;
+
+  switch (transform) {
+    case TRANSFORM_FLIP_HORIZONTAL:
+      reverseRows(image, height, width);
+      return image;
+    case TRANSFORM_FLIP_VERTICAL:
+      reverseRowOrder(image, height, width);
+      return image;
+    case TRANSFORM_ROTATE_180:
+      flipVertical(image, height, width);
+      return image;
+    case TRANSFORM_ROTATE_90:
+      return rotateClockwise(image, height, width);
+    case TRANSFORM_ROTATE_270:
+      return rotateCounterClockwise(image, height, width);
+    case TRANSFORM_TRANSPOSE:
+      return transpose(image, height, width, newHeight, newWidth);
+    case TRANSFORM_TRANSVERSE:
+      return transverse(image, height, width);
+    default:
+      return image;
+  }
+}
+
+// the packed pixel types are handed to stb as raw bytes, so they must not be padded
+typedef char pixelRGBSizeCheck[(sizeof(PixelRGB) == 3) ? 1 : -1];
+typedef char pixelRGBASizeCheck[(sizeof(PixelRGBA) == 4) ? 1 : -1];
+
+static PixelRGB **allocImageRGB(int height, int width) {
+  size_t blockBytes, tableBytes;
+  if (!imageSizes(height, width, sizeof(PixelRGB), &blockBytes, &tableBytes)) {
+    return NULL;
+  }
+  PixelRGB **image = (PixelRGB **) malloc(tableBytes);
+  if (image == NULL) {
+    return NULL;
+  }
+  image[0] = (PixelRGB *) poolAlloc(blockBytes);
+  if (image[0] == NULL) {
+    free(image);
+    return NULL;
+  }
+  for (int i = 1; i<height; i++) {
+    image[i] = image[0] + (size_t) width * i;
+  }
+  return image;
+}
+
+static PixelRGBA **allocImageRGBA(int height, int width) {
+  size_t blockBytes, tableBytes;
+  if (!imageSizes(height, width, sizeof(PixelRGBA), &blockBytes, &tableBytes)) {
+    return NULL;
+  }
+  PixelRGBA **image = (PixelRGBA **) malloc(tableBytes);
+  if (image == NULL) {
+    return NULL;
+  }
+  image[0] = (PixelRGBA *) poolAlloc(blockBytes);
+  if (image[0] == NULL) {
+    free(image);
+    return NULL;
+  }
+  for (int i = 1; i<height; i++) {
+    image[i] = image[0] + (size_t) width * i;
+  }
+  return image;
+}
+
+PixelRGB **loadImageRGB(const char *filePath, int *height, int *width) {
+  int x, y;
+  unsigned char *data = decodeFile(filePath, &x, &y, 3, sizeof(PixelRGB)); //3 = force RGB channels
+  if (data == NULL) {
+    fprintf(stderr, "Unable to load %s: %s\n", filePath, stbi_failure_reason());
+    return NULL;
+  }
+
+  // stb already hands back packed RGB, so a single block copy fills the image
+  PixelRGB **image = allocImageRGB(y, x);
+  if (image == NULL) {
+    fprintf(stderr, "Unable to allocate new image (loadImageRGB).\n");
+  } else {
+    memcpy(image[0], data, sizeof(PixelRGB) * (size_t) y * x);
+    *height = y;
+    *width = x;
+  }
+  stbi_image_free(data);
+  return image;
+}
+
+int saveImageRGB(const char *filePath, PixelRGB **image, int height, int width) {
+  // the pixel block is already in the layout the encoder expects, no staging buffer needed
+  RowSource source = { NULL, (const unsigned char *) image[0], sizeof(PixelRGB) * width, width };
+  if (!writeImage(filePath, height, width, 3, packedRows, &source)) {
+    fprintf(stderr, "Unable to save %s: %s\n", filePath, jpegFailureReason());
+    return 0;
+  }
+  return 1;
+}
+
+void freeImageRGB(PixelRGB **image) {
+  if (image == NULL) return;
+  poolFree(image[0]);
+  free(image);
+}
+
+void flipHorizontalRGB(PixelRGB **image, int height, int width) {
+  reversePackedRows((unsigned char *) image[0], sizeof(PixelRGB) * width, height, width, sizeof(PixelRGB));
+}
+
+void flipVerticalRGB(PixelRGB **image, int height, int width) {
+  rotatePacked180InPlace((unsigned char *) image[0], sizeof(PixelRGB) * width, height, width, sizeof(PixelRGB));
+}
+
+PixelRGB **rotateClockwiseRGB(PixelRGB **image, int height, int width) {
+  PixelRGB **rotated = allocImageRGB(width, height);
+  if (rotated == NULL) {
+    fprintf(stderr, "Allocation for new image failed in rotateClockwiseRGB.\n");
+    return NULL;
+  }
+  rotatePackedClockwise((unsigned char *) rotated[0], sizeof(PixelRGB) * height,
+                        (const unsigned char *) image[0], sizeof(PixelRGB) * width,
+                        height, width, sizeof(PixelRGB));
+  return rotated;
+}
+
+PixelRGBA **loadImageRGBA(const char *filePath, int *height, int *width) {
+  int x, y;
+  unsigned char *data = decodeFile(filePath, &x, &y, 4, sizeof(PixelRGBA)); //4 = force RGBA channels
+  if (data == NULL) {
+    fprintf(stderr, "Unable to load %s: %s\n", filePath, stbi_failure_reason());
+    return NULL;
+  }
+
+  PixelRGBA **image = allocImageRGBA(y, x);
+  if (image == NULL) {
+    fprintf(stderr, "Unable to allocate new image (loadImageRGBA).\n");
+  } else {
+    memcpy(image[0], data, sizeof(PixelRGBA) * (size_t) y * x);
+    *height = y;
+    *width = x;
+  }
+  stbi_image_free(data);
+  return image;
+}
+
+int saveImageRGBA(const char *filePath, PixelRGBA **image, int height, int width) {
+  // the encoder reads the first 3 of the 4 channels and ignores alpha
+  RowSource source = { NULL, (const unsigned char *) image[0], sizeof(PixelRGBA) * width, width };
+  if (!writeImage(filePath, height, width, 4, packedRows, &source)) {
+    fprintf(stderr, "Unable to save %s: %s\n", filePath, jpegFailureReason());
+    return 0;
+  }
+  return 1;
+}
+
+void freeImageRGBA(PixelRGBA **image) {
+  if (image == NULL) return;
+  poolFree(image[0]);
+  free(image);
+}
+
+void flipHorizontalRGBA(PixelRGBA **image, int height, int width) {
+  reversePackedRows((unsigned char *) image[0], sizeof(PixelRGBA) * width, height, width, sizeof(PixelRGBA));
+}
+
+void flipVerticalRGBA(PixelRGBA **image, int height, int width) {
+  rotatePacked180InPlace((unsigned char *) image[0], sizeof(PixelRGBA) * width, height, width, sizeof(PixelRGBA));
+}
+
+PixelRGBA **rotateClockwiseRGBA(PixelRGBA **image, int height, int width) {
+  PixelRGBA **rotated = allocImageRGBA(width, height);
+  if (rotated == NULL) {
+    fprintf(stderr, "Allocation for new image failed in rotateClockwiseRGBA.\n");
+    return NULL;
+  }
+  rotatePackedClockwise((unsigned char *) rotated[0], sizeof(PixelRGBA) * height,
+                        (const unsigned char *) image[0], sizeof(PixelRGBA) * width,
+                        height, width, sizeof(PixelRGBA));
+  return rotated;
+}
+
+Image *imageCreate(int height, int width, int channels) {
+  size_t blockBytes, tableBytes;
+  if (channels < 1 || channels > 4 || !imageSizes(height, width, channels, &blockBytes, &tableBytes)) {
+    return NULL;
+  }
+
+  Image *image = (Image *) malloc(sizeof(Image));
+  if (image == NULL) {
+    return NULL;
+  }
+  image->width = width;
+  image->height = height;
+  image->channels = channels;
+  image->stride = (size_t) width * channels;
+  image->storage = IMAGE_STORAGE_MALLOC;
+  image->data = (unsigned char *) poolAlloc(blockBytes);
+  if (image->data == NULL) {
+    free(image);
+    return NULL;
+  }
+  return image;
+}
+
+void imageFree(Image *image) {
+  if (image == NULL) return;
+  if (image->storage == IMAGE_STORAGE_STB) {
+    stbi_image_free(image->data);
+  } else {
+    poolFree(image->data);
+  }
+  free(image);
+}
+
+/**
+ * Wraps a decoded buffer, which is already packed rows of the requested
+ * channels, in an Image that keeps it as the pixel block.
+ */
+static Image *adoptDecoded(unsigned char *data, int x, int y, int channels) {
+  Image *image = (Image *) malloc(sizeof(Image));
+  if (image == NULL) {
+    fprintf(stderr, "Unable to allocate new image (imageLoad).\n");
+    stbi_image_free(data);
+    return NULL;
+  }
+  image->data = data;
+  image->width = x;
+  image->height = y;
+  image->channels = channels;
+  image->stride = (size_t) x * channels;
+  image->storage = IMAGE_STORAGE_STB;
+  return image;
+}
+
+Image *imageLoad(const char *filePath, int channels) {
+  int x, y;
+  if (channels < 1 || channels > 4) {
+    return NULL;
+  }
+  // the decoded buffer becomes the image, so nothing more is needed per pixel
+  unsigned char *data = decodeFile(filePath, &x, &y, channels, 0);
+  if (data == NULL) {
+    fprintf(stderr, "Unable to load %s: %s\n", filePath, stbi_failure_reason());
+    return NULL;
+  }
+  return adoptDecoded(data, x, y, channels);
+}
+
+Image *imageLoadFromMemory(const unsigned char *buffer, size_t length, int channels) {
+  int x, y;
+  if (channels < 1 || channels > 4) {
+    return NULL;
+  }
+  unsigned char *data = decodeMemory(buffer, length, &x, &y, channels, 0);
+  if (data == NULL) {
+    fprintf(stderr, "Unable to load image: %s\n", stbi_failure_reason());
+    return NULL;
+  }
+  return adoptDecoded(data, x, y, channels);
+}
+
+int imageSave(const char *filePath, const Image *image) {
+  // the encoder takes rows one at a time, so padded rows need no packing
+  RowSource source = { NULL, image->data, image->stride, image->width };
+  return writeImage(filePath, image->height, image->width, image->channels, packedRows, &source);
+}
+
+int imageSaveRows(const char *filePath, int height, int width, int channels, ImageRowSource rows, void *context) {
+  RowSource source = { NULL, NULL, 0, width, rows, context };
+  return writeImage(filePath, height, width, channels, callerRows, &source);
+}
+
+Image *imageCopy(const Image *image) {
+  if (image == NULL) return NULL;
+
+  Image *copy = imageCreate(image->height, image->width, image->channels);
+  if (copy == NULL) {
+    fprintf(stderr, "Unable to allocate new image (imageCopy).\n");
+    return NULL;
+  }
+  if (copy->stride == image->stride) {
+    memcpy(copy->data, image->data, image->stride * (size_t) image->height);
+  } else {
+    for (int i = 0; i<image->height; i++) {
+      memcpy(copy->data + copy->stride * i, image->data + image->stride * i, copy->stride);
+    }
+  }
+  return copy;
+}
+
+Image *imageTranspose(const Image *image) {
+  if (image == NULL) return NULL;
+
+  Image *transposed = imageCreate(image->width, image->height, image->channels);
+  if (transposed == NULL) {
+    fprintf(stderr, "Allocation for new image failed in imageTranspose.\n");
+    return NULL;
+  }
+  transposePacked(transposed->data, transposed->stride, image->data, image->stride,
+                  image->height, image->width, image->channels);
+  return transposed;
+}
+
+void imageReverseRows(Image *image) {
+  reversePackedRows(image->data, image->stride, image->height, image->width, image->channels);
+}
+
+void imageFlipHorizontal(Image *image) {
+  imageReverseRows(image);
+}
+
+void imageFlipVertical(Image *image) {
+  rotatePacked180InPlace(image->data, image->stride, image->height, image->width, image->channels);
+}
+
+Image *imageRotateClockwise(const Image *image) {
+  if (image == NULL) return NULL;
+
+  Image *rotated = imageCreate(image->width, image->height, image->channels);
+  if (rotated == NULL) {
+    fprintf(stderr, "Allocation for new image failed in imageRotateClockwise.\n");
+    return NULL;
+  }
+  rotatePackedClockwise(rotated->data, rotated->stride, image->data, image->stride,
+                        image->height, image->width, image->channels);
+  return rotated;
+}
+
+Image *imageRotateCounterClockwise(const Image *image) {
+  if (image == NULL) return NULL;
+
+  Image *rotated = imageCreate(image->width, image->height, image->channels);
+  if (rotated == NULL) {
+    fprintf(stderr, "Allocation for new image failed in imageRotateCounterClockwise.\n");
+    return NULL;
+  }
+  rotatePackedCounterClockwise(rotated->data, rotated->stride, image->data, image->stride,
+                               image->height, image->width, image->channels);
+  return rotated;
+}
+
+Image *imageRotate180(const Image *image) {
+  if (image == NULL) return NULL;
+
+  Image *rotated = imageCreate(image->height, image->width, image->channels);
+  if (rotated == NULL) {
+    fprintf(stderr, "Allocation for new image failed in imageRotate180.\n");
+    return NULL;
+  }
+  rotatePacked180(rotated->data, rotated->stride, image->data, image->stride,
+                  image->height, image->width, image->channels);
+  return rotated;
+}
+
+Image *imageTransform(Image *image, Transform transform) {
+  if (image == NULL) return NULL;
+
+  switch (transform) {
+    case TRANSFORM_IDENTITY:
+      return image;
+    case TRANSFORM_FLIP_HORIZONTAL:
+      imageFlipHorizontal(image);
+      return image;
+    case TRANSFORM_FLIP_VERTICAL:
+      reverseRowOrderPacked(image->data, image->stride, image->height, image->width, image->channels);
+      return image;
+    case TRANSFORM_ROTATE_180:
+      imageFlipVertical(image);
+      return image;
+    case TRANSFORM_ROTATE_90:
+      return imageRotateClockwise(image);
+    case TRANSFORM_ROTATE_270:
+      return imageRotateCounterClockwise(image);
+    case TRANSFORM_TRANSPOSE:
+      return imageTranspose(image);
+    default:
+      break;
+  }
+
+  Image *result = imageCreate(image->width, image->height, image->channels);
+  if (result == NULL) {
+    fprintf(stderr, "Allocation for new image failed in imageTransform.\n");
+    return NULL;
+  }
+  transversePacked(result->data, result->stride, image->data, image->stride,
+                   image->height, image->width, image->channels);
+  return result;
+}
@@ -1,3 +1,8 @@
+#ifndef IMAGE_UTILS_H
+#define IMAGE_UTILS_H
+
+#include <stddef.h>
+#include <stdint.h>
 
 /**
  * A structure that represents a single pixel value using
@@ -10,43 +15,194 @@ typedef struct {
   int blue;
 } Pixel;
 
+/**
+ * A packed pixel value using the RGB color model with one byte
+ * per channel.  A PixelRGB occupies 3 bytes, a quarter of the
+ * memory of a Pixel, and rows of them can be handed to stb
+ * directly without any conversion.
+ */
+typedef struct {
+  uint8_t red;
+  uint8_t green;
+  uint8_t blue;
+} PixelRGB;
+
+/**
+ * A packed pixel value using the RGBA color model with one byte
+ * per channel (4 bytes per pixel).  The alpha channel is ignored
+ * when saving to a format without transparency (JPEG).
+ */
+typedef struct {
+  uint8_t red;
+  uint8_t green;
+  uint8_t blue;
+  uint8_t alpha;
+} PixelRGBA;
+
+/**
+ * Where an Image's pixel block came from, which decides how imageFree()
+ * releases it.
+ */
+typedef enum {
+  IMAGE_STORAGE_MALLOC,   // allocated by imageCreate()
+  IMAGE_STORAGE_STB       // the decoder's own buffer, adopted by imageLoad()
+} ImageStorage;
+
+/**
+ * An image stored as one contiguous block of packed 8-bit pixels.
+ * Row i starts at data + i * stride and holds width pixels of
+ * channels bytes each (3 = RGB, 4 = RGBA).  The stride may be larger
+ * than width * channels when rows are padded.
+ */
+typedef struct {
+  unsigned char *data;
+  int width;
+  int height;
+  size_t stride;
+  int channels;
+  ImageStorage storage;
+} Image;
+
+/**
+ * The file formats images can be saved in.  IMAGE_FORMAT_AUTO chooses
+ * one from the file name's extension (.jpg/.jpeg, .png, .bmp, .tga,
+ * .hdr), and JPEG for any other name.
+ */
+typedef enum {
+  IMAGE_FORMAT_AUTO,
+  IMAGE_FORMAT_JPEG,
+  IMAGE_FORMAT_PNG,
+  IMAGE_FORMAT_BMP,
+  IMAGE_FORMAT_TGA,
+  IMAGE_FORMAT_HDR
+} ImageFormat;
+
+/**
+ * How the save functions write their files.  The defaults are
+ * IMAGE_FORMAT_AUTO, JPEG quality 100 and no chroma subsampling.
+ */
+typedef struct {
+  ImageFormat format;
+  int quality;     // JPEG quality, 1 (smallest) to 100 (best)
+  int subsample;   // nonzero to store JPEG chroma at half resolution (4:2:0)
+} SaveOptions;
+
+/**
+ * What a probe learns from an image file's header: its size, the number
+ * of channels stored in the file (1 to 4) and the bits per channel (8,
+ * 16, or 32 for floating point HDR).
+ */
+typedef struct {
+  int width;
+  int height;
+  int channels;
+  int bitDepth;
+} ImageInfo;
+
+/**
+ * Limits on the images the load functions will decode, so an oversize
+ * input is turned away before any large allocation.  0 means no limit;
+ * the default is no limits at all.
+ *
+ * The memory estimate covers the decoder's working memory, its output and
+ * the loaded image.  Copies the caller makes later (such as a rotated
+ * image) come on top, as do released blocks the buffer pool keeps for
+ * reuse.
+ */
+typedef struct {
+  size_t maxPixels;   // width x height
+  size_t maxBytes;    // memory decoding and loading the image would need
+} ImageBudget;
+
+/**
+ * The eight ways of mapping a rectangular image onto itself by flipping
+ * and rotating it (the dihedral group of order 8).  Rotations are
+ * clockwise; TRANSFORM_FLIP_VERTICAL only reverses the order of the rows,
+ * TRANSPOSE mirrors across the main diagonal and TRANSVERSE across the
+ * anti-diagonal.
+ *
+ * The single step operations correspond to:
+ *   flipHorizontal()         TRANSFORM_FLIP_HORIZONTAL
+ *   flipVertical()           TRANSFORM_ROTATE_180 (it also mirrors every row)
+ *   rotateClockwise()        TRANSFORM_ROTATE_90
+ *   rotateCounterClockwise() TRANSFORM_ROTATE_270
+ *   rotate180()              TRANSFORM_ROTATE_180
+ *   transpose()              TRANSFORM_TRANSPOSE
+ */
+typedef enum {
+  TRANSFORM_IDENTITY,
+  TRANSFORM_FLIP_HORIZONTAL,
+  TRANSFORM_FLIP_VERTICAL,
+  TRANSFORM_ROTATE_90,
+  TRANSFORM_ROTATE_180,
+  TRANSFORM_ROTATE_270,
+  TRANSFORM_TRANSPOSE,
+  TRANSFORM_TRANSVERSE
+} Transform;
+
 /**
  * Loads an image file specified by the given file path/name.
  * The height and width are indicated in the two pass-by-reference variables.
  * The image is returned as a two-dimensional array of Pixel values
  * of dimension (height x width) where the pixel at [0][0] corresponds to
- * the top-left most pixel value.
+ * the top-left most pixel value, or NULL if the file can't be loaded or
+ * is over the budget set with imageSetBudget().  A path of "-" reads the
+ * image from standard input.
  */
 Pixel **loadImage(const char *filePath, int *height, int *width);
 
+/**
+ * Loads an image from an encoded file held in memory, as loadImage().
+ */
+Pixel **loadImageFromMemory(const unsigned char *buffer, size_t length, int *height, int *width);
+
 /**
  * Saves the given image (which is assumed to have the same format as in
  * loadImage() and is of the given height x width) to the file specified
- * by the given path/name.
+ * by the given path/name, in the format set with imageSetSaveOptions()
+ * (by default, the one the file name's extension names).  A path of "-"
+ * writes the image to standard output.
+ *
+ * @return 1 on success, 0 on failure (the reason is printed to stderr).
+ */
+int saveImage(const char *filePath, Pixel **image, int height, int width);
+
+/**
+ * Releases a Pixel image: anything returned by loadImage(),
+ * loadImageFromMemory(), copyImage(), transpose(), the rotations or
+ * transformImage(), or built by hand in the same layout (a table of row
+ * pointers into one block from malloc()).  The in-place operations keep
+ * that layout, so a flipped image is released the same way.  Passing NULL
+ * is a no-op.
  */
-void saveImage(const char *filePath, Pixel **image, int height, int width);
+void freeImage(Pixel **image);
 
 /**
  * Copies an image.
  * @param image A 2D array of Pixel objects representing the image to be copied.
  * @param height The height of the image.
  * @param width The width of the image.
- * @return A new 2D array of Pixel objects representing the copied image.
+ * @return A new 2D array of Pixel objects representing the copied image,
+ *         in the same contiguous layout as loadImage(), or NULL if
+ *         allocation fails.
  */
 Pixel ** copyImage(Pixel **image, int height, int width);
 
 
 /**
- * @brief Copies and rotates an image 90 degrees clockwise.
+ * @brief Copies and transposes an image.
  *
- * This function takes an input image represented as a 2D array of Pixels and 
- * returns a new image that is a rotated copy of the original image. The 
- * rotation is performed 90 degrees clockwise.
+ * This function takes an input image represented as a 2D array of Pixels and
+ * returns a new image in which the pixel at [i][j] of the original is at [j][i].
+ * The copy is done tile by tile so that it stays cache friendly on large images.
  *
  * @param image The original image represented as a 2D array of Pixels.
  * @param height The height of the original image.
  * @param width The width of the original image.
- * @return A new 2D array of Pixels representing the rotated image.
+ * @param tHeight Set to the height of the transposed image (width).
+ * @param tWidth Set to the width of the transposed image (height).
+ * @return A new 2D array of Pixels, in the same contiguous layout as
+ *         loadImage(), representing the transposed image.
  */
 Pixel **transpose(Pixel **image, int height, int widt, int *tHeight, int *tWidth);
 
@@ -69,7 +225,10 @@ void reverseRows(Pixel **image, int height, int width);
 void flipHorizontal(Pixel **image, int height, int width);
 
 /**
- * Flips the given image vertically.
+ * Flips the given image vertically: the rows are put in reverse order and
+ * each row is mirrored (the same as swapping the rows and then calling
+ * reverseRows()).  Row contents are swapped in place, so an image in the
+ * loadImage() layout keeps its single contiguous block.
  * @param image A 2D array of Pixel objects representing the image to be flipped.
  * @param height The height of the image.
  * @param width The width of the image.
@@ -87,3 +246,319 @@ void flipVertical(Pixel **image, int height, int width);
  */
 Pixel ** rotateClockwise(Pixel **image, int height, int width);
 
+/**
+ * Rotates the given image 90 degrees counter-clockwise.
+ *
+ * @param image A 2D array of Pixel objects representing the image to be rotated.
+ * @param height The height of the image.
+ * @param width The width of the image.
+ * @return A new (width x height) 2D array of Pixel objects representing the rotated image.
+ */
+Pixel ** rotateCounterClockwise(Pixel **image, int height, int width);
+
+/**
+ * Rotates the given image 180 degrees.
+ *
+ * @param image A 2D array of Pixel objects representing the image to be rotated.
+ * @param height The height of the image.
+ * @param width The width of the image.
+ * @return A new (height x width) 2D array of Pixel objects representing the rotated image.
+ */
+Pixel ** rotate180(Pixel **image, int height, int width);
+
+/**
+ * Returns the single transform equivalent to applying first and then second.
+ */
+Transform composeTransforms(Transform first, Transform second);
+
+/**
+ * Collapses a list of operations, applied in order, into the single
+ * equivalent transform.  An empty list is the identity.
+ */
+Transform composeTransformList(const Transform *ops, int count);
+
+/**
+ * Returns 1 if the transform exchanges the image's width and height
+ * (the 90/270 degree rotations, transpose and transverse), 0 otherwise.
+ */
+int transformSwapsAxes(Transform transform);
+
+/**
+ * Finds where pixel [i][j] of a (height x width) image ends up once the
+ * transform is applied, setting newI and newJ to its row and column in
+ * the result.
+ */
+void transformPoint(Transform transform, int height, int width, int i, int j, int *newI, int *newJ);
+
+/**
+ * Applies a transform to the image in a single pass.
+ *
+ * Transforms that keep the image's shape are done in place and return
+ * image itself (the identity does no work at all).  The others return a
+ * new image in the loadImage() layout and leave the original untouched,
+ * so the caller still owns it.
+ *
+ * @param newHeight Set to the height of the result.
+ * @param newWidth Set to the width of the result.
+ * @return The transformed image, or NULL if allocation fails.
+ */
+Pixel **transformImage(Pixel **image, int height, int width, Transform transform, int *newHeight, int *newWidth);
+
+
+/**
+ * Loads an image file into packed 3-byte RGB pixels.  The layout is the
+ * same as loadImage(): a table of row pointers into a single contiguous
+ * block of (height x width) pixels.
+ */
+PixelRGB **loadImageRGB(const char *filePath, int *height, int *width);
+
+/**
+ * Saves the given packed RGB image (as returned by loadImageRGB())
+ * to the file specified by the given path/name.
+ *
+ * @return 1 on success, 0 on failure (the reason is printed to stderr).
+ */
+int saveImageRGB(const char *filePath, PixelRGB **image, int height, int width);
+
+/**
+ * Releases a packed RGB image from loadImageRGB() or
+ * rotateClockwiseRGB().  Passing NULL is a no-op.
+ */
+void freeImageRGB(PixelRGB **image);
+
+/**
+ * Flips the given packed RGB image horizontally, in place.
+ */
+void flipHorizontalRGB(PixelRGB **image, int height, int width);
+
+/**
+ * Flips the given packed RGB image vertically, in place, with the same
+ * result as flipVertical().  Row contents are swapped so the row pointer
+ * table still describes one contiguous block.
+ */
+void flipVerticalRGB(PixelRGB **image, int height, int width);
+
+/**
+ * Rotates the given packed RGB image 90 degrees clockwise.
+ *
+ * @return A new (width x height) image in the loadImageRGB() layout.
+ */
+PixelRGB **rotateClockwiseRGB(PixelRGB **image, int height, int width);
+
+/**
+ * Loads an image file into packed 4-byte RGBA pixels, in the same
+ * contiguous layout as loadImageRGB().  Images without an alpha channel
+ * are given an opaque (255) alpha.
+ */
+PixelRGBA **loadImageRGBA(const char *filePath, int *height, int *width);
+
+/**
+ * Saves the given packed RGBA image to the file specified by the given
+ * path/name.  The alpha channel is dropped.
+ *
+ * @return 1 on success, 0 on failure (the reason is printed to stderr).
+ */
+int saveImageRGBA(const char *filePath, PixelRGBA **image, int height, int width);
+
+/**
+ * Releases a packed RGBA image from loadImageRGBA() or
+ * rotateClockwiseRGBA().  Passing NULL is a no-op.
+ */
+void freeImageRGBA(PixelRGBA **image);
+
+/**
+ * Flips the given packed RGBA image horizontally, in place.
+ */
+void flipHorizontalRGBA(PixelRGBA **image, int height, int width);
+
+/**
+ * Flips the given packed RGBA image vertically, in place, with the same
+ * result as flipVertical().
+ */
+void flipVerticalRGBA(PixelRGBA **image, int height, int width);
+
+/**
+ * Rotates the given packed RGBA image 90 degrees clockwise.
+ *
+ * @return A new (width x height) image in the loadImageRGBA() layout.
+ */
+PixelRGBA **rotateClockwiseRGBA(PixelRGBA **image, int height, int width);
+
+/**
+ * Allocates a new (height x width) image with the given number of
+ * channels (1 to 4) and tightly packed rows.  The pixel values are
+ * left uninitialized.
+ *
+ * @return The new image, or NULL if the arguments are invalid or
+ *         allocation fails.  Release it with imageFree().
+ */
+Image *imageCreate(int height, int width, int channels);
+
+/**
+ * Releases an image created by any of the image*() functions.
+ * Passing NULL is a no-op.
+ */
+void imageFree(Image *image);
+
+/**
+ * Reads an image file's header without decoding it.
+ *
+ * @return 1 on success, 0 if the file can't be opened or isn't an image
+ *         stb can read (see stbi_failure_reason()).
+ */
+int imageProbe(const char *filePath, ImageInfo *info);
+
+/**
+ * Reads the header of an image file held in memory, as imageProbe().
+ */
+int imageProbeMemory(const unsigned char *buffer, size_t length, ImageInfo *info);
+
+/**
+ * Sets the budget every load function checks from then on.  Call it
+ * before any images are loaded.
+ */
+void imageSetBudget(const ImageBudget *budget);
+
+/**
+ * Checks a probed image against the budget, taking bytesPerPixel bytes
+ * of memory for every pixel.
+ *
+ * @return 1 if it fits, 0 if not (see stbi_failure_reason()).
+ */
+int imageWithinBudget(const ImageInfo *info, size_t bytesPerPixel);
+
+/**
+ * Checks a probed image against the budget, taking bytes of memory in
+ * all, for callers that know their memory use more exactly than a whole
+ * number of bytes per pixel.
+ *
+ * @return 1 if it fits, 0 if not (see stbi_failure_reason()).
+ */
+int imageWithinBudgetBytes(const ImageInfo *info, size_t bytes);
+
+/**
+ * Loads an image file into a new Image with the given number of
+ * channels (1 to 4); stb converts the file's channels as needed.  The
+ * decoded buffer becomes the image's pixel block as it is, without a
+ * copy, so loading needs no more memory than the decode itself.
+ *
+ * @return The loaded image, or NULL on failure.
+ */
+Image *imageLoad(const char *filePath, int channels);
+
+/**
+ * Loads an image from an encoded file held in memory, as imageLoad().
+ */
+Image *imageLoadFromMemory(const unsigned char *buffer, size_t length, int channels);
+
+/**
+ * Saves the given image to the file specified by the given path/name,
+ * with the options set by imageSetSaveOptions().
+ *
+ * @return 1 on success, 0 on failure.
+ */
+int imageSave(const char *filePath, const Image *image);
+
+/**
+ * Supplies row `row` of an image being saved with imageSaveRows() as
+ * width x channels bytes: either a pointer into the caller's own storage,
+ * or `buffer` (which has room for one row) filled in and returned.  Rows
+ * may be asked for out of order and from several threads at once.
+ */
+typedef const unsigned char *(*ImageRowSource)(void *context, int row, unsigned char *buffer);
+
+/**
+ * Saves a (height x width) image with the given number of channels whose
+ * rows come from a callback, with the options set by
+ * imageSetSaveOptions().  JPEGs are encoded a strip at a time as the rows
+ * are asked for, so the whole image never has to be in memory; the other
+ * formats gather it into one buffer first.
+ *
+ * @return 1 on success, 0 on failure.
+ */
+int imageSaveRows(const char *filePath, int height, int width, int channels, ImageRowSource rows, void *context);
+
+/**
+ * Sets the options every save function (saveImage(), imageSave(), ...)
+ * uses from then on.  Call it before any images are saved.
+ */
+void imageSetSaveOptions(const SaveOptions *options);
+
+/**
+ * Returns the format the file name's extension names, or
+ * IMAGE_FORMAT_AUTO if it names none.
+ */
+ImageFormat imageFormatFromPath(const char *filePath);
+
+/**
+ * Returns the format a save to the given path would write with the
+ * current options (never IMAGE_FORMAT_AUTO).
+ */
+ImageFormat imageSaveFormat(const char *filePath);
+
+/**
+ * Returns the usual file name extension for a format, without the dot.
+ */
+const char *imageFormatExtension(ImageFormat format);
+
+/**
+ * Copies an image.
+ *
+ * @return A new, tightly packed copy of the image, or NULL on failure.
+ */
+Image *imageCopy(const Image *image);
+
+/**
+ * Transposes an image so that pixel [i][j] moves to [j][i].
+ *
+ * @return A new (width x height) image, or NULL on failure.
+ */
+Image *imageTranspose(const Image *image);
+
+/**
+ * Reverses every row of the image in place.
+ */
+void imageReverseRows(Image *image);
+
+/**
+ * Flips the image horizontally, in place.
+ */
+void imageFlipHorizontal(Image *image);
+
+/**
+ * Flips the image vertically, in place, with the same result as
+ * flipVertical().
+ */
+void imageFlipVertical(Image *image);
+
+/**
+ * Rotates the image 90 degrees clockwise.
+ *
+ * @return A new (width x height) image, or NULL on failure.
+ */
+Image *imageRotateClockwise(const Image *image);
+
+/**
+ * Rotates the image 90 degrees counter-clockwise.
+ *
+ * @return A new (width x height) image, or NULL on failure.
+ */
+Image *imageRotateCounterClockwise(const Image *image);
+
+/**
+ * Rotates the image 180 degrees.
+ *
+ * @return A new (height x width) image, or NULL on failure.
+ */
+Image *imageRotate180(const Image *image);
+
+/**
+ * Applies a transform to the image in a single pass, with the same
+ * ownership rules as transformImage(): transforms that keep the shape are
+ * done in place and return image, the others return a new image.
+ *
+ * @return The transformed image, or NULL on failure.
+ */
+Image *imageTransform(Image *image, Transform transform);
+
+#endif
@@ -0,0 +1,1187 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "jpeg_coefficients.h"
+#include "thread_pool.h"
+#include "buffer_pool.h"
+
+static __thread const char *failureReason = "no error";
+
+int jpegFail(const char *reason) {
+  failureReason = reason;
+  return 0;
+}
+
+const char *jpegFailureReason(void) {
+  return failureReason;
+}
+
+// natural (row major) index of the k-th coefficient in zigzag order
+static const unsigned char naturalOrder[64] = {
+  0, 1, 8, 16, 9, 2, 3, 10, 17, 24, 32, 25, 18, 11, 4, 5,
+  12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13, 6, 7, 14, 21, 28,
+  35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+  58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63
+};
+
+// the standard Huffman tables from Annex K of the JPEG spec: code counts per length, then values
+static const unsigned char stdDcLuminanceBits[16] = { 0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0 };
+static const unsigned char stdDcLuminanceValues[12] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 };
+static const unsigned char stdDcChrominanceBits[16] = { 0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0 };
+static const unsigned char stdDcChrominanceValues[12] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 };
+static const unsigned char stdAcLuminanceBits[16] = { 0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d };
+static const unsigned char stdAcLuminanceValues[162] = {
+  0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+  0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+  0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+  0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+  0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+  0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+  0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+  0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+  0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+  0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+  0xf9, 0xfa
+};
+static const unsigned char stdAcChrominanceBits[16] = { 0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77 };
+static const unsigned char stdAcChrominanceValues[162] = {
+  0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+  0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
+  0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+  0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+  0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+  0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+  0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+  0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+  0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+  0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+  0xf9, 0xfa
+};
+
+/*
+ * Entropy decoding
+ */
+
+// codes up to this many bits are decoded with a single table lookup
+#define HUFFMAN_LOOKAHEAD 9
+
+typedef struct {
+  unsigned char lookupLength[1 << HUFFMAN_LOOKAHEAD];  // 0 = longer code, use the slow path
+  unsigned char lookupValue[1 << HUFFMAN_LOOKAHEAD];
+  int maxCode[17];     // largest code of each length, -1 if there are none
+  int valueOffset[17]; // values[valueOffset[len] + code] is the symbol of a len-bit code
+  unsigned char values[256];
+  // for AC codes whose size bits also fit in the lookahead: the coefficient
+  // value << 8 | run << 4 | total bits used, 0 if not applicable
+  short fastAc[1 << HUFFMAN_LOOKAHEAD];
+  int defined;
+} HuffmanDecoder;
+
+static int buildDecoder(HuffmanDecoder *table, const unsigned char bits[16], const unsigned char *values, int count) {
+  memset(table, 0, sizeof(HuffmanDecoder));
+  memcpy(table->values, values, count);
+
+  int code = 0;
+  int k = 0;
+  for (int len = 1; len <= 16; len++) {
+    table->valueOffset[len] = k - code;
+    for (int i = 0; i<bits[len - 1]; i++) {
+      if (len <= HUFFMAN_LOOKAHEAD) {
+        // every lookahead pattern starting with this code decodes to it
+        int shift = HUFFMAN_LOOKAHEAD - len;
+        for (int fill = 0; fill < (1 << shift); fill++) {
+          table->lookupLength[(code << shift) | fill] = len;
+          table->lookupValue[(code << shift) | fill] = values[k];
+        }
+      }
+      code++;
+      k++;
+    }
+    table->maxCode[len] = bits[len - 1] ? code - 1 : -1;
+    if (code > (1 << len)) {
+      return jpegFail("bad Huffman table");
+    }
+    code <<= 1;
+  }
+
+  for (int peek = 0; peek < (1 << HUFFMAN_LOOKAHEAD); peek++) {
+    int len = table->lookupLength[peek];
+    int rs = table->lookupValue[peek];
+    int run = rs >> 4;
+    int s = rs & 15;
+    if (len && s && len + s <= HUFFMAN_LOOKAHEAD) {
+      int value = (peek >> (HUFFMAN_LOOKAHEAD - len - s)) & ((1 << s) - 1);
+      if (value < (1 << (s - 1))) {
+        value += (int) (~0U << s) + 1;
+      }
+      // the value must fit the short's high byte, or the entry stays 0
+      // and the symbol takes the slow path
+      if (value >= -128 && value <= 127) {
+        table->fastAc[peek] = (short) (value * 256 + run * 16 + len + s);
+      }
+    }
+  }
+  table->defined = 1;
+  return 1;
+}
+
+/**
+ * Reads the entropy coded segment of a scan.  Stuffed 0xFF00 bytes are
+ * unescaped, and once a marker is reached only zero bits are returned.
+ */
+typedef struct {
+  const unsigned char *p;
+  const unsigned char *end;
+  uint64_t buffer;   // next bits, left aligned
+  int bits;
+  int atMarker;
+} BitReader;
+
+static void fillBits(BitReader *r) {
+  while (r->bits <= 56) {
+    unsigned int byte = 0;
+    if (!r->atMarker && r->p < r->end) {
+      byte = *r->p;
+      if (byte != 0xFF) {
+        r->p++;
+      } else if (r->p + 1 < r->end && r->p[1] == 0x00) {
+        r->p += 2;
+      } else {
+        r->atMarker = 1;
+        byte = 0;
+      }
+    }
+    r->buffer |= (uint64_t) byte << (56 - r->bits);
+    r->bits += 8;
+  }
+}
+
+static int decodeSymbol(BitReader *r, const HuffmanDecoder *table) {
+  if (r->bits < 16) {
+    fillBits(r);
+  }
+  unsigned int peek = (unsigned int) (r->buffer >> (64 - HUFFMAN_LOOKAHEAD));
+  int len = table->lookupLength[peek];
+  if (len) {
+    r->buffer <<= len;
+    r->bits -= len;
+    return table->lookupValue[peek];
+  }
+
+  unsigned int code16 = (unsigned int) (r->buffer >> 48);
+  for (len = HUFFMAN_LOOKAHEAD + 1; len <= 16; len++) {
+    int code = code16 >> (16 - len);
+    if (code <= table->maxCode[len]) {
+      r->buffer <<= len;
+      r->bits -= len;
+      return table->values[table->valueOffset[len] + code];
+    }
+  }
+  return -1;
+}
+
+/**
+ * Reads an s-bit magnitude and sign extends it as in section F.2.2.1.
+ */
+static int receiveExtend(BitReader *r, int s) {
+  if (s == 0) {
+    return 0;
+  }
+  if (r->bits < s) {
+    fillBits(r);
+  }
+  int value = (int) (r->buffer >> (64 - s));
+  r->buffer <<= s;
+  r->bits -= s;
+  if (value < (1 << (s - 1))) {
+    value += (int) (~0U << s) + 1;
+  }
+  return value;
+}
+
+/**
+ * Skips to the end of the current restart interval and past its RSTn marker.
+ */
+static void restartBits(BitReader *r) {
+  r->buffer = 0;
+  r->bits = 0;
+  r->atMarker = 0;
+  while (r->p + 1 < r->end && !(r->p[0] == 0xFF && r->p[1] >= 0xD0 && r->p[1] <= 0xD7)) {
+    r->p++;
+  }
+  if (r->p + 1 < r->end) {
+    r->p += 2;
+  }
+}
+
+static int decodeBlock(BitReader *r, short *block, const HuffmanDecoder *dc, const HuffmanDecoder *ac, int *pred) {
+  int t = decodeSymbol(r, dc);
+  if (t < 0 || t > 11) {
+    return jpegFail("bad DC code");
+  }
+  *pred += receiveExtend(r, t);
+  block[0] = (short) *pred;
+
+  for (int k = 1; k < 64;) {
+    if (r->bits < 16) {
+      fillBits(r);
+    }
+    int fast = ac->fastAc[r->buffer >> (64 - HUFFMAN_LOOKAHEAD)];
+    if (fast) {
+      r->buffer <<= fast & 15;
+      r->bits -= fast & 15;
+      k += (fast >> 4) & 15;
+      if (k > 63) {
+        return jpegFail("bad AC run length");
+      }
+      block[naturalOrder[k++]] = (short) (fast >> 8);
+      continue;
+    }
+    int rs = decodeSymbol(r, ac);
+    if (rs < 0) {
+      return jpegFail("bad AC code");
+    }
+    int s = rs & 15;
+    int run = rs >> 4;
+    if (s == 0) {
+      if (run != 15) {
+        break; // end of block
+      }
+      k += 16;
+      continue;
+    }
+    k += run;
+    if (k > 63) {
+      return jpegFail("bad AC run length");
+    }
+    block[naturalOrder[k]] = (short) receiveExtend(r, s);
+    k++;
+  }
+  return 1;
+}
+
+/*
+ * Marker parsing
+ */
+
+static int read16(const unsigned char *p) {
+  return (p[0] << 8) | p[1];
+}
+
+/**
+ * Computes maxH/maxV, the MCU counts and each component's padded block
+ * grid from the size and sampling factors.
+ */
+static void layoutComponents(JpegCoefImage *image) {
+  image->maxH = 1;
+  image->maxV = 1;
+  for (int c = 0; c<image->numComponents; c++) {
+    if (image->comp[c].h > image->maxH) image->maxH = image->comp[c].h;
+    if (image->comp[c].v > image->maxV) image->maxV = image->comp[c].v;
+  }
+  image->mcusWide = (image->width + 8 * image->maxH - 1) / (8 * image->maxH);
+  image->mcusHigh = (image->height + 8 * image->maxV - 1) / (8 * image->maxV);
+  for (int c = 0; c<image->numComponents; c++) {
+    image->comp[c].blocksWide = image->mcusWide * image->comp[c].h;
+    image->comp[c].blocksHigh = image->mcusHigh * image->comp[c].v;
+  }
+}
+
+size_t jpegCoefficientBytes(const JpegCoefImage *frame) {
+  JpegCoefImage image = *frame;
+  layoutComponents(&image);
+  size_t bytes = 0;
+  for (int c = 0; c<image.numComponents; c++) {
+    bytes += sizeof(short) * 64 * image.comp[c].blocksWide * image.comp[c].blocksHigh;
+  }
+  return bytes;
+}
+
+/**
+ * Allocates zeroed coefficient grids of the block counts already laid out.
+ */
+static int allocGrids(JpegCoefImage *image) {
+  for (int c = 0; c<image->numComponents; c++) {
+    JpegComponent *comp = &image->comp[c];
+    size_t bytes = sizeof(short) * comp->blocksWide * comp->blocksHigh * 64;
+    comp->coefs = (short *) poolAlloc(bytes);
+    if (comp->coefs == NULL) {
+      jpegFreeCoefficients(image);
+      return jpegFail("out of memory");
+    }
+    memset(comp->coefs, 0, bytes);
+  }
+  return 1;
+}
+
+int jpegAllocCoefficients(JpegCoefImage *image) {
+  layoutComponents(image);
+  return allocGrids(image);
+}
+
+void jpegFreeCoefficients(JpegCoefImage *image) {
+  for (int c = 0; c<JPEG_MAX_COMPONENTS; c++) {
+    poolFree(image->comp[c].coefs);
+    image->comp[c].coefs = NULL;
+  }
+  free(image->markers);
+  image->markers = NULL;
+  image->markersLength = 0;
+}
+
+/**
+ * Appends a marker segment (marker byte plus payload) to the copied markers.
+ */
+static int keepMarker(JpegCoefImage *image, const unsigned char *segment, size_t length) {
+  unsigned char *grown = (unsigned char *) realloc(image->markers, image->markersLength + length);
+  if (grown == NULL) {
+    return jpegFail("out of memory");
+  }
+  memcpy(grown + image->markersLength, segment, length);
+  image->markers = grown;
+  image->markersLength += length;
+  return 1;
+}
+
+/**
+ * What one scan covers, shared by the serial and the parallel decoders.
+ */
+typedef struct {
+  JpegCoefImage *image;
+  int count;
+  const int *scanComps;
+  const HuffmanDecoder *dc[JPEG_MAX_COMPONENTS];
+  const HuffmanDecoder *ac[JPEG_MAX_COMPONENTS];
+  int mcusWide;
+  int mcuTotal;
+  int firstRow;     // MCU row at the top of the coefficient grids
+} Scan;
+
+/**
+ * Decodes the MCUs [first, last) of a scan, in raster order.
+ */
+static int decodeMcus(const Scan *scan, BitReader *r, int *pred, int first, int last) {
+  for (int mcu = first; mcu<last; mcu++) {
+    int my = mcu / scan->mcusWide - scan->firstRow;
+    int mx = mcu % scan->mcusWide;
+    for (int k = 0; k<scan->count; k++) {
+      JpegComponent *comp = &scan->image->comp[scan->scanComps[k]];
+      int h = scan->count == 1 ? 1 : comp->h;
+      int v = scan->count == 1 ? 1 : comp->v;
+      for (int by = 0; by<v; by++) {
+        for (int bx = 0; bx<h; bx++) {
+          size_t block = (size_t) (my * v + by) * comp->blocksWide + (mx * h + bx);
+          if (!decodeBlock(r, comp->coefs + 64 * block, scan->dc[k], scan->ac[k], &pred[scan->scanComps[k]])) {
+            return 0;
+          }
+        }
+      }
+    }
+  }
+  return 1;
+}
+
+/**
+ * Finds where each restart interval of a scan starting at p begins, by
+ * looking for the RSTn markers between them.
+ *
+ * @return A malloc'd array of the expected number of start pointers, or
+ *         NULL if the markers don't match the interval count.
+ */
+static const unsigned char **findIntervals(const unsigned char *p, const unsigned char *end, int expected) {
+  const unsigned char **starts = (const unsigned char **) malloc(sizeof(unsigned char *) * expected);
+  if (starts == NULL) {
+    return NULL;
+  }
+  int found = 0;
+  starts[found++] = p;
+  while ((p = memchr(p, 0xFF, end - p)) != NULL && p + 1 < end) {
+    if (p[1] >= 0xD0 && p[1] <= 0xD7) {
+      if (found == expected || p[1] != 0xD0 + ((found - 1) & 7)) {
+        break;
+      }
+      starts[found++] = p + 2;
+    } else if (p[1] != 0x00 && p[1] != 0xFF) {
+      break; // the marker after the scan
+    }
+    p++;
+  }
+  if (found != expected) {
+    free(starts);
+    return NULL;
+  }
+  return starts;
+}
+
+/**
+ * Where the decoding of one restart interval (or of the whole scan, without
+ * them) has got to.  A band may end partway through an interval, so this is
+ * kept until the next band carries on from it.
+ */
+typedef struct {
+  BitReader r;
+  int pred[JPEG_MAX_COMPONENTS];  // last DC value of each component
+} IntervalState;
+
+typedef struct {
+  const Scan *scan;
+  IntervalState *states;
+  int first;                    // the MCUs of the band being decoded
+  int last;
+  int failed;                   // set by any worker, so accessed atomically, as is the reason;
+                                // the join orders both for the caller
+  const char *reason;
+} IntervalJob;
+
+static void decodeIntervals(void *context, int begin, int end) {
+  IntervalJob *job = (IntervalJob *) context;
+  int interval = job->scan->image->restartInterval;
+  for (int i = begin; i<end && !__atomic_load_n(&job->failed, __ATOMIC_RELAXED); i++) {
+    // the part of the interval that lies in the band
+    int first = i * interval > job->first ? i * interval : job->first;
+    int last = (i + 1) * interval < job->scan->mcuTotal ? (i + 1) * interval : job->scan->mcuTotal;
+    last = last < job->last ? last : job->last;
+    if (!decodeMcus(job->scan, &job->states[i].r, job->states[i].pred, first, last)) {
+      // the reason is per thread, so it is carried back to the caller
+      __atomic_store_n(&job->reason, jpegFailureReason(), __ATOMIC_RELAXED);
+      __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+/**
+ * Decodes the MCUs [first, last) of a scan without located restart
+ * intervals, skipping to the next RSTn marker at each interval boundary
+ * (which also gets past damaged ones).
+ */
+static int decodeSerial(const Scan *scan, IntervalState *state, int first, int last) {
+  int interval = scan->image->restartInterval;
+  for (int mcu = first; mcu<last; ) {
+    if (interval && mcu > 0 && mcu % interval == 0) {
+      restartBits(&state->r);
+      memset(state->pred, 0, sizeof(state->pred));
+    }
+    int next = interval && (mcu / interval + 1) * interval < last ? (mcu / interval + 1) * interval : last;
+    if (!decodeMcus(scan, &state->r, state->pred, mcu, next)) {
+      return 0;
+    }
+    mcu = next;
+  }
+  return 1;
+}
+
+/**
+ * Decodes the entropy coded data of one scan, which starts at *pos, and
+ * leaves *pos at the marker that follows it.
+ *
+ * Restart intervals don't depend on each other, so when the scan has them
+ * they are located up front and decoded in parallel.
+ *
+ * With a band function, the coefficient grids hold bandRows MCU rows, and
+ * the scan is decoded into them a band at a time, each handed to band()
+ * before the grids are cleared for the next.  Otherwise the grids hold the
+ * whole image and the scan is decoded as one band.
+ */
+static int decodeScan(JpegCoefImage *image, const unsigned char *buf, size_t length, size_t *pos,
+                      int count, const int *scanComps, HuffmanDecoder *dcTables, HuffmanDecoder *acTables,
+                      const int *dcSel, const int *acSel, int bandRows, JpegBandFunction band, void *context) {
+  Scan scan;
+  scan.image = image;
+  scan.count = count;
+  scan.scanComps = scanComps;
+  for (int k = 0; k<count; k++) {
+    if (!dcTables[dcSel[k]].defined || !acTables[acSel[k]].defined) {
+      return jpegFail("scan uses an undefined Huffman table");
+    }
+    scan.dc[k] = &dcTables[dcSel[k]];
+    scan.ac[k] = &acTables[acSel[k]];
+  }
+
+  // a single component scan is not interleaved: one block per MCU, over the
+  // component's own (unpadded) block grid
+  int mcusWide = image->mcusWide;
+  int mcusHigh = image->mcusHigh;
+  int blocksPerMcu = 0;
+  for (int k = 0; k<count; k++) {
+    blocksPerMcu += image->comp[scanComps[k]].h * image->comp[scanComps[k]].v;
+  }
+  if (count == 1) {
+    const JpegComponent *comp = &image->comp[scanComps[0]];
+    int compWidth = (image->width * comp->h + image->maxH - 1) / image->maxH;
+    int compHeight = (image->height * comp->v + image->maxV - 1) / image->maxV;
+    mcusWide = (compWidth + 7) / 8;
+    mcusHigh = (compHeight + 7) / 8;
+    blocksPerMcu = 1;
+  }
+  scan.mcusWide = mcusWide;
+  scan.mcuTotal = mcusWide * mcusHigh;
+  scan.firstRow = 0;
+  if (band == NULL) {
+    bandRows = mcusHigh;
+  }
+
+  const unsigned char **starts = NULL;
+  int intervals = 0;
+  if (image->restartInterval) {
+    intervals = (scan.mcuTotal + image->restartInterval - 1) / image->restartInterval;
+    starts = findIntervals(buf + *pos, buf + length, intervals);
+  }
+  // without located intervals (no restart markers, or damaged ones) one state walks the whole scan
+  int stateCount = starts != NULL ? intervals : 1;
+  IntervalState *states = (IntervalState *) calloc(stateCount, sizeof(IntervalState));
+  if (states == NULL) {
+    free(starts);
+    return jpegFail("out of memory");
+  }
+  for (int i = 0; i<stateCount; i++) {
+    states[i].r.p = starts != NULL ? starts[i] : buf + *pos;
+    states[i].r.end = buf + length;
+  }
+  free(starts);
+
+  int ok = 1;
+  for (int row = 0; ok && row<mcusHigh; row += bandRows) {
+    int rows = row + bandRows < mcusHigh ? bandRows : mcusHigh - row;
+    if (band != NULL) {
+      // decoding only writes the nonzero coefficients, so the last band's must go
+      for (int c = 0; c<image->numComponents; c++) {
+        const JpegComponent *comp = &image->comp[c];
+        memset(comp->coefs, 0, sizeof(short) * 64 * comp->blocksWide * comp->blocksHigh);
+      }
+      scan.firstRow = row;
+    }
+    int first = row * mcusWide;
+    int last = (row + rows) * mcusWide;
+    if (stateCount > 1) {
+      IntervalJob job = { &scan, states, first, last, 0, NULL };
+      parallelFor(first / image->restartInterval, (last - 1) / image->restartInterval + 1,
+                  (size_t) image->restartInterval * blocksPerMcu * 64 * sizeof(short), decodeIntervals, &job);
+      ok = job.failed ? jpegFail(job.reason) : 1;
+    } else {
+      ok = decodeSerial(&scan, &states[0], first, last);
+    }
+    ok = ok && (band == NULL || band(context, image, row, rows));
+  }
+  const unsigned char *p = states[stateCount - 1].r.p;
+  free(states);
+  if (!ok) {
+    return 0;
+  }
+
+  // continue after the scan: find the next marker that isn't a restart marker
+  while (p + 1 < buf + length && !(p[0] == 0xFF && p[1] != 0x00 && p[1] != 0xFF && !(p[1] >= 0xD0 && p[1] <= 0xD7))) {
+    p++;
+  }
+  *pos = p - buf;
+  return 1;
+}
+
+/**
+ * Reads a SOF0/SOF1 segment into the image's size and components.
+ */
+static int readFrame(const unsigned char *seg, int segLength, JpegCoefImage *image) {
+  if (segLength < 6 || seg[0] != 8) {
+    return jpegFail("unsupported frame (only one 8-bit frame is supported)");
+  }
+  image->height = read16(seg + 1);
+  image->width = read16(seg + 3);
+  image->numComponents = seg[5];
+  if (image->width == 0 || image->height == 0 || image->numComponents < 1 ||
+      image->numComponents > JPEG_MAX_COMPONENTS || segLength < 6 + 3 * image->numComponents) {
+    return jpegFail("unsupported frame header");
+  }
+  for (int c = 0; c<image->numComponents; c++) {
+    JpegComponent *comp = &image->comp[c];
+    comp->id = seg[6 + 3 * c];
+    comp->h = seg[7 + 3 * c] >> 4;
+    comp->v = seg[7 + 3 * c] & 15;
+    comp->quantTable = seg[8 + 3 * c];
+    if (comp->h < 1 || comp->h > 4 || comp->v < 1 || comp->v > 4) {
+      return jpegFail("bad sampling factors");
+    }
+    if (comp->quantTable > 3) {
+      return jpegFail("bad quantization table selector");
+    }
+    // a single component image is never interleaved, so its MCU is one block
+    if (image->numComponents == 1) {
+      comp->h = 1;
+      comp->v = 1;
+    }
+    image->quantUsed[comp->quantTable] = 1;
+  }
+  return 1;
+}
+
+int jpegReadFrame(const unsigned char *buf, size_t length, JpegCoefImage *image) {
+  memset(image, 0, sizeof(JpegCoefImage));
+  if (length < 4 || buf[0] != 0xFF || buf[1] != 0xD8) {
+    return jpegFail("not a JPEG file");
+  }
+  size_t pos = 2;
+  while (pos + 4 <= length && buf[pos] == 0xFF) {
+    int marker = buf[pos + 1];
+    if (marker == 0xFF || marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) {
+      pos += marker == 0xFF ? 1 : 2; // fill bytes and markers without a payload
+      continue;
+    }
+    int segLength = read16(buf + pos + 2);
+    if (marker == 0xDA || marker == 0xD9 || segLength < 2 || pos + 2 + segLength > length) {
+      break;
+    }
+    if (marker == 0xC0 || marker == 0xC1) {
+      if (!readFrame(buf + pos + 4, segLength - 2, image)) {
+        return 0;
+      }
+      layoutComponents(image);
+      return 1;
+    }
+    pos += 2 + segLength;
+  }
+  return jpegFail("JPEG has no supported frame header");
+}
+
+/**
+ * Reads a JPEG file's coefficients, either whole or a band at a time (see
+ * decodeScan()).
+ */
+static int readCoefficients(const unsigned char *buf, size_t length, JpegCoefImage *image, int bandRows,
+                            JpegBandFunction band, void *context) {
+  HuffmanDecoder dcTables[4];
+  HuffmanDecoder acTables[4];
+  int quantDefined[4] = { 0 };
+  int frameSeen = 0;
+  int scanSeen = 0;
+
+  memset(image, 0, sizeof(JpegCoefImage));
+  for (int t = 0; t<4; t++) {
+    dcTables[t].defined = 0;
+    acTables[t].defined = 0;
+  }
+
+  if (length < 4 || buf[0] != 0xFF || buf[1] != 0xD8) {
+    return jpegFail("not a JPEG file");
+  }
+
+  size_t pos = 2;
+  while (1) {
+    // skip fill bytes before the marker
+    while (pos < length && buf[pos] == 0xFF && pos + 1 < length && buf[pos + 1] == 0xFF) {
+      pos++;
+    }
+    if (pos + 2 > length || buf[pos] != 0xFF) {
+      jpegFreeCoefficients(image);
+      return jpegFail("corrupt JPEG: expected a marker");
+    }
+    int marker = buf[pos + 1];
+    pos += 2;
+    if (marker == 0xD9) {
+      break; // EOI
+    }
+    if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) {
+      continue; // markers without a payload
+    }
+    if (pos + 2 > length || read16(buf + pos) < 2 || pos + read16(buf + pos) > length) {
+      jpegFreeCoefficients(image);
+      return jpegFail("corrupt JPEG: truncated segment");
+    }
+    const unsigned char *seg = buf + pos + 2;
+    int segLength = read16(buf + pos) - 2;
+    int ok = 1;
+
+    if (marker == 0xDB) { // DQT
+      int i = 0;
+      while (ok && i < segLength) {
+        int precision = seg[i] >> 4;
+        int id = seg[i] & 15;
+        int size = precision ? 128 : 64;
+        if (id > 3 || i + 1 + size > segLength) {
+          ok = jpegFail("bad quantization table");
+          break;
+        }
+        for (int k = 0; k<64; k++) {
+          image->quant[id][naturalOrder[k]] = precision ? read16(seg + i + 1 + 2 * k) : seg[i + 1 + k];
+        }
+        quantDefined[id] = 1;
+        i += 1 + size;
+      }
+    } else if (marker == 0xC4) { // DHT
+      int i = 0;
+      while (ok && i + 17 <= segLength) {
+        int tableClass = seg[i] >> 4;
+        int id = seg[i] & 15;
+        int count = 0;
+        for (int k = 0; k<16; k++) {
+          count += seg[i + 1 + k];
+        }
+        if (tableClass > 1 || id > 3 || count > 256 || i + 17 + count > segLength) {
+          ok = jpegFail("bad Huffman table");
+          break;
+        }
+        ok = buildDecoder(tableClass ? &acTables[id] : &dcTables[id], seg + i + 1, seg + i + 17, count);
+        i += 17 + count;
+      }
+    } else if (marker == 0xDD) { // DRI
+      image->restartInterval = segLength >= 2 ? read16(seg) : 0;
+    } else if (marker == 0xC0 || marker == 0xC1) { // baseline or extended sequential, Huffman
+      if (frameSeen) {
+        ok = jpegFail("unsupported frame (only one 8-bit frame is supported)");
+      } else {
+        ok = readFrame(seg, segLength, image);
+        if (ok) {
+          layoutComponents(image);
+          // banded grids hold bandRows MCU rows, cut to the image's height
+          for (int c = 0; band != NULL && c<image->numComponents; c++) {
+            int rows = bandRows < image->mcusHigh ? bandRows : image->mcusHigh;
+            image->comp[c].blocksHigh = rows * image->comp[c].v;
+          }
+          ok = allocGrids(image);
+        }
+        frameSeen = 1;
+      }
+    } else if ((marker >= 0xC2 && marker <= 0xCF) && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+      ok = jpegFail("unsupported JPEG process (progressive, lossless or arithmetic coded)");
+    } else if (marker == 0xDA) { // SOS
+      int count = segLength > 0 ? seg[0] : 0;
+      int scanComps[JPEG_MAX_COMPONENTS];
+      int dcSel[JPEG_MAX_COMPONENTS];
+      int acSel[JPEG_MAX_COMPONENTS];
+      if (!frameSeen || count < 1 || count > image->numComponents || segLength < 4 + 2 * count) {
+        ok = jpegFail("bad scan header");
+      } else {
+        for (int k = 0; ok && k<count; k++) {
+          scanComps[k] = -1;
+          for (int c = 0; c<image->numComponents; c++) {
+            if (image->comp[c].id == seg[1 + 2 * k]) {
+              scanComps[k] = c;
+            }
+          }
+          dcSel[k] = (seg[2 + 2 * k] >> 4) & 3;
+          acSel[k] = seg[2 + 2 * k] & 3;
+          if (scanComps[k] < 0) {
+            ok = jpegFail("scan references an unknown component");
+          }
+        }
+        const unsigned char *spectral = seg + 1 + 2 * count;
+        if (ok && (spectral[0] != 0 || spectral[1] != 63 || spectral[2] != 0)) {
+          ok = jpegFail("unsupported scan (spectral selection or successive approximation)");
+        }
+        // a band is handed on as soon as it is decoded, so every component must be in this one scan
+        if (ok && band != NULL && (scanSeen || count != image->numComponents)) {
+          ok = jpegFail("unsupported scans (only a single scan of every component can be decoded in bands)");
+        }
+        for (int k = 0; ok && band != NULL && k<count; k++) {
+          if (!quantDefined[image->comp[scanComps[k]].quantTable]) {
+            ok = jpegFail("missing quantization table");
+          }
+        }
+        if (ok) {
+          pos += 2 + segLength;
+          ok = decodeScan(image, buf, length, &pos, count, scanComps, dcTables, acTables, dcSel, acSel,
+                          bandRows, band, context);
+          scanSeen = 1;
+          if (ok) {
+            continue;
+          }
+        }
+      }
+    } else if ((marker >= 0xE0 && marker <= 0xEF) || marker == 0xFE) {
+      // application segments (JFIF, EXIF, ICC profiles, Adobe, ...) and comments are passed
+      // through; jpegTransformCoefficients() fixes up what a transform invalidates
+      ok = keepMarker(image, buf + pos - 2, segLength + 4);
+    }
+
+    if (!ok) {
+      jpegFreeCoefficients(image);
+      return 0;
+    }
+    pos += 2 + segLength;
+  }
+
+  if (!frameSeen || !scanSeen) {
+    jpegFreeCoefficients(image);
+    return jpegFail("JPEG has no image data");
+  }
+  // the frame header only names the tables; each must also have come in a DQT segment
+  for (int c = 0; c<image->numComponents; c++) {
+    if (!quantDefined[image->comp[c].quantTable]) {
+      jpegFreeCoefficients(image);
+      return jpegFail("missing quantization table");
+    }
+  }
+  return 1;
+}
+
+int jpegReadCoefficients(const unsigned char *buf, size_t length, JpegCoefImage *image) {
+  return readCoefficients(buf, length, image, 0, NULL, NULL);
+}
+
+int jpegReadCoefficientBands(const unsigned char *buf, size_t length, int bandRows, JpegBandFunction band,
+                             void *context) {
+  if (bandRows < 1) {
+    return jpegFail("bad band height");
+  }
+  JpegCoefImage image;
+  int ok = readCoefficients(buf, length, &image, bandRows, band, context);
+  if (ok) {
+    jpegFreeCoefficients(&image);
+  }
+  return ok;
+}
+
+/*
+ * Entropy encoding
+ */
+
+void jpegBufferPut(JpegBuffer *out, const void *bytes, size_t count) {
+  if (out->failed) return;
+  if (out->length + count > out->capacity) {
+    size_t capacity = out->capacity ? out->capacity * 2 : 4096;
+    while (capacity < out->length + count) {
+      capacity *= 2;
+    }
+    unsigned char *grown = (unsigned char *) poolRealloc(out->data, capacity);
+    if (grown == NULL) {
+      out->failed = 1;
+      return;
+    }
+    out->data = grown;
+    out->capacity = capacity;
+  }
+  memcpy(out->data + out->length, bytes, count);
+  out->length += count;
+}
+
+static void putByte(JpegBuffer *out, int byte) {
+  unsigned char b = (unsigned char) byte;
+  if (!out->failed && out->length < out->capacity) {
+    out->data[out->length++] = b;
+  } else {
+    jpegBufferPut(out, &b, 1);
+  }
+}
+
+static void put16(JpegBuffer *out, int value) {
+  putByte(out, value >> 8);
+  putByte(out, value & 0xFF);
+}
+
+typedef struct {
+  unsigned short code[256];
+  unsigned char size[256];
+} HuffmanEncoder;
+
+static void buildEncoder(HuffmanEncoder *table, const unsigned char bits[16], const unsigned char *values) {
+  memset(table, 0, sizeof(HuffmanEncoder));
+  int code = 0;
+  int k = 0;
+  for (int len = 1; len <= 16; len++) {
+    for (int i = 0; i<bits[len - 1]; i++) {
+      table->code[values[k]] = code;
+      table->size[values[k]] = len;
+      code++;
+      k++;
+    }
+    code <<= 1;
+  }
+}
+
+// the standard tables as codes, shared by every coder; index 0 is luma, 1 chroma
+static HuffmanEncoder dcEncoders[2];
+static HuffmanEncoder acEncoders[2];
+static pthread_once_t encodersOnce = PTHREAD_ONCE_INIT;
+
+static void buildEncoders(void) {
+  buildEncoder(&dcEncoders[0], stdDcLuminanceBits, stdDcLuminanceValues);
+  buildEncoder(&acEncoders[0], stdAcLuminanceBits, stdAcLuminanceValues);
+  buildEncoder(&dcEncoders[1], stdDcChrominanceBits, stdDcChrominanceValues);
+  buildEncoder(&acEncoders[1], stdAcChrominanceBits, stdAcChrominanceValues);
+}
+
+void jpegEntropyInit(JpegEntropyCoder *coder) {
+  pthread_once(&encodersOnce, buildEncoders);
+  memset(coder, 0, sizeof(JpegEntropyCoder));
+}
+
+static void writeBits(JpegEntropyCoder *w, unsigned int value, int count) {
+  w->bitBuffer = (w->bitBuffer << count) | (value & ((1u << count) - 1));
+  w->bitCount += count;
+  while (w->bitCount >= 8) {
+    int byte = (int) (w->bitBuffer >> (w->bitCount - 8)) & 0xFF;
+    putByte(&w->out, byte);
+    if (byte == 0xFF) {
+      putByte(&w->out, 0x00); // byte stuffing
+    }
+    w->bitCount -= 8;
+  }
+}
+
+void jpegEntropyFlush(JpegEntropyCoder *coder) {
+  if (coder->bitCount > 0) {
+    writeBits(coder, 0x7F, 8 - coder->bitCount);
+  }
+  coder->bitBuffer = 0;
+}
+
+void jpegEntropyRestart(JpegEntropyCoder *coder, int index) {
+  jpegEntropyFlush(coder);
+  putByte(&coder->out, 0xFF);
+  putByte(&coder->out, 0xD0 + (index & 7));
+  memset(coder->pred, 0, sizeof(coder->pred));
+}
+
+static int bitLength(int value) {
+  int magnitude = value < 0 ? -value : value;
+  int n = 0;
+  while (magnitude) {
+    n++;
+    magnitude >>= 1;
+  }
+  return n;
+}
+
+int jpegEntropyBlock(JpegEntropyCoder *w, const short *block, int component) {
+  const HuffmanEncoder *dc = &dcEncoders[component == 0 ? 0 : 1];
+  const HuffmanEncoder *ac = &acEncoders[component == 0 ? 0 : 1];
+  int diff = block[0] - w->pred[component];
+  w->pred[component] = block[0];
+  int n = bitLength(diff);
+  if (n > 11) {
+    return jpegFail("DC coefficient out of range");
+  }
+  writeBits(w, dc->code[n], dc->size[n]);
+  if (n) {
+    writeBits(w, diff < 0 ? diff - 1 : diff, n);
+  }
+
+  int run = 0;
+  for (int k = 1; k<64; k++) {
+    int value = block[naturalOrder[k]];
+    if (value == 0) {
+      run++;
+      continue;
+    }
+    while (run > 15) {
+      writeBits(w, ac->code[0xF0], ac->size[0xF0]); // ZRL: 16 zeros
+      run -= 16;
+    }
+    n = bitLength(value);
+    if (n > 10) {
+      return jpegFail("AC coefficient out of range");
+    }
+    writeBits(w, ac->code[(run << 4) | n], ac->size[(run << 4) | n]);
+    writeBits(w, value < 0 ? value - 1 : value, n);
+    run = 0;
+  }
+  if (run > 0) {
+    writeBits(w, ac->code[0x00], ac->size[0x00]); // EOB
+  }
+  return 1;
+}
+
+static void putHuffmanTable(JpegBuffer *out, int tableClass, int id, const unsigned char bits[16],
+                            const unsigned char *values, int count) {
+  putByte(out, (tableClass << 4) | id);
+  jpegBufferPut(out, bits, 16);
+  jpegBufferPut(out, values, count);
+}
+
+int jpegWriteHeaders(const JpegCoefImage *image, JpegBuffer *out) {
+  static const unsigned char jfif[] = { 0xFF, 0xE0, 0, 16, 'J', 'F', 'I', 'F', 0, 1, 1, 0, 0, 1, 0, 1, 0, 0 };
+
+  // baseline allows only 8-bit quantization tables; larger values need the extended process
+  int extended = 0;
+  for (int t = 0; t<4; t++) {
+    for (int k = 0; image->quantUsed[t] && k<64; k++) {
+      if (image->quant[t][k] > 255) {
+        extended = 1;
+      }
+    }
+  }
+
+  put16(out, 0xFFD8);
+  if (image->markersLength) {
+    jpegBufferPut(out, image->markers, image->markersLength);
+  } else {
+    jpegBufferPut(out, jfif, sizeof(jfif));
+  }
+
+  for (int t = 0; t<4; t++) {
+    if (!image->quantUsed[t]) continue;
+    int precision = extended ? 1 : 0;
+    put16(out, 0xFFDB);
+    put16(out, 2 + 1 + 64 * (precision + 1));
+    putByte(out, (precision << 4) | t);
+    for (int k = 0; k<64; k++) {
+      if (precision) {
+        put16(out, image->quant[t][naturalOrder[k]]);
+      } else {
+        putByte(out, image->quant[t][naturalOrder[k]]);
+      }
+    }
+  }
+
+  put16(out, extended ? 0xFFC1 : 0xFFC0);
+  put16(out, 8 + 3 * image->numComponents);
+  putByte(out, 8);
+  put16(out, image->height);
+  put16(out, image->width);
+  putByte(out, image->numComponents);
+  for (int c = 0; c<image->numComponents; c++) {
+    putByte(out, image->comp[c].id);
+    putByte(out, (image->comp[c].h << 4) | image->comp[c].v);
+    putByte(out, image->comp[c].quantTable);
+  }
+
+  put16(out, 0xFFC4);
+  put16(out, 2 + 4 * 17 + 12 + 162 + 12 + 162);
+  putHuffmanTable(out, 0, 0, stdDcLuminanceBits, stdDcLuminanceValues, 12);
+  putHuffmanTable(out, 1, 0, stdAcLuminanceBits, stdAcLuminanceValues, 162);
+  putHuffmanTable(out, 0, 1, stdDcChrominanceBits, stdDcChrominanceValues, 12);
+  putHuffmanTable(out, 1, 1, stdAcChrominanceBits, stdAcChrominanceValues, 162);
+
+  if (image->restartInterval) {
+    put16(out, 0xFFDD);
+    put16(out, 4);
+    put16(out, image->restartInterval);
+  }
+
+  put16(out, 0xFFDA);
+  put16(out, 6 + 2 * image->numComponents);
+  putByte(out, image->numComponents);
+  for (int c = 0; c<image->numComponents; c++) {
+    // the first component (luma) uses table 0, the others (chroma) table 1
+    putByte(out, image->comp[c].id);
+    putByte(out, c == 0 ? 0x00 : 0x11);
+  }
+  putByte(out, 0);
+  putByte(out, 63);
+  putByte(out, 0);
+  return !out->failed;
+}
+
+unsigned char *jpegWriteCoefficients(const JpegCoefImage *image, size_t *length) {
+  JpegEntropyCoder w;
+  jpegEntropyInit(&w);
+  jpegWriteHeaders(image, &w.out);
+  int ok = 1;
+
+  // a single component is written non-interleaved over its own block grid
+  int mcusWide = image->mcusWide;
+  int mcusHigh = image->mcusHigh;
+  if (image->numComponents == 1) {
+    mcusWide = (image->width + 7) / 8;
+    mcusHigh = (image->height + 7) / 8;
+  }
+  int mcuCount = 0;
+  int restartCount = 0;
+  for (int my = 0; ok && my<mcusHigh; my++) {
+    for (int mx = 0; ok && mx<mcusWide; mx++) {
+      if (image->restartInterval && mcuCount == image->restartInterval) {
+        jpegEntropyRestart(&w, restartCount++);
+        mcuCount = 0;
+      }
+      mcuCount++;
+      for (int c = 0; ok && c<image->numComponents; c++) {
+        const JpegComponent *comp = &image->comp[c];
+        for (int by = 0; ok && by<comp->v; by++) {
+          for (int bx = 0; ok && bx<comp->h; bx++) {
+            size_t block = (size_t) (my * comp->v + by) * comp->blocksWide + (mx * comp->h + bx);
+            ok = jpegEntropyBlock(&w, comp->coefs + 64 * block, c);
+          }
+        }
+      }
+    }
+  }
+  jpegEntropyFlush(&w);
+  put16(&w.out, 0xFFD9);
+
+  if (!ok || w.out.failed) {
+    poolFree(w.out.data);
+    if (w.out.failed) jpegFail("out of memory");
+    return NULL;
+  }
+  *length = w.out.length;
+  return w.out.data;
+}
+
+/**
+ * Reads everything left on a file descriptor into a malloc'd buffer.
+ */
+static int readAll(int fd, JpegFileData *file) {
+  size_t capacity = 1 << 16;
+  size_t length = 0;
+  unsigned char *data = (unsigned char *) malloc(capacity);
+  while (data != NULL) {
+    if (length == capacity) {
+      unsigned char *grown = (unsigned char *) realloc(data, capacity * 2);
+      if (grown == NULL) {
+        break;
+      }
+      data = grown;
+      capacity *= 2;
+    }
+    ssize_t got = read(fd, data + length, capacity - length);
+    if (got < 0 && errno == EINTR) {
+      continue;
+    }
+    if (got <= 0) {
+      if (got == 0 && length > 0) {
+        file->data = data;
+        file->length = length;
+        file->mapped = 0;
+        return 1;
+      }
+      break;
+    }
+    length += got;
+  }
+  free(data);
+  return jpegFail("unable to read file");
+}
+
+int jpegMapFile(const char *filePath, JpegFileData *file) {
+  if (strcmp(filePath, "-") == 0) {
+    return readAll(STDIN_FILENO, file);
+  }
+  int fd = open(filePath, O_RDONLY);
+  if (fd < 0) {
+    return jpegFail("unable to open file");
+  }
+  struct stat info;
+  if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode)) {
+    if (info.st_size == 0) {
+      close(fd);
+      return jpegFail("unable to read file");
+    }
+    void *data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data != MAP_FAILED) {
+      madvise(data, info.st_size, MADV_SEQUENTIAL);
+      close(fd);
+      file->data = (const unsigned char *) data;
+      file->length = info.st_size;
+      file->mapped = 1;
+      return 1;
+    }
+  }
+  int ok = readAll(fd, file);
+  close(fd);
+  return ok;
+}
+
+void jpegUnmapFile(JpegFileData *file) {
+  if (file->mapped) {
+    munmap((void *) file->data, file->length);
+  } else {
+    free((void *) file->data);
+  }
+  file->data = NULL;
+  file->length = 0;
+}
@@ -0,0 +1,231 @@
+/**
+ * Reading and writing baseline JPEG files at the level of their
+ * quantized DCT coefficients, without running the IDCT or FDCT.
+ *
+ * This is what lossless transforms (see jpeg_transform.h) are built on:
+ * the coefficients are entropy decoded into memory, rearranged, and
+ * entropy coded again, so the image data itself never changes.
+ *
+ * Sequential Huffman coded JPEGs with 8-bit samples (SOF0/SOF1) are
+ * supported; progressive, arithmetic coded and lossless files are
+ * rejected and should be handled by the pixel path instead.
+ */
+#ifndef JPEG_COEFFICIENTS_H
+#define JPEG_COEFFICIENTS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define JPEG_MAX_COMPONENTS 4
+
+/**
+ * One color component of a JPEG image.  The coefficients are stored as a
+ * grid of (blocksWide x blocksHigh) 8x8 blocks, padded out to whole MCUs,
+ * each holding 64 quantized values in natural (row major, not zigzag)
+ * order: coefs[64 * (by * blocksWide + bx) + 8 * v + u] is the coefficient
+ * of vertical frequency v and horizontal frequency u of block (bx, by).
+ */
+typedef struct {
+  int id;
+  int h;
+  int v;
+  int quantTable;
+  int blocksWide;
+  int blocksHigh;
+  short *coefs;
+} JpegComponent;
+
+/**
+ * A JPEG image held as quantized DCT coefficients.
+ */
+typedef struct {
+  int width;
+  int height;
+  int numComponents;
+  JpegComponent comp[JPEG_MAX_COMPONENTS];
+  int maxH;
+  int maxV;
+  int mcusWide;
+  int mcusHigh;
+  unsigned short quant[4][64];   // natural order
+  int quantUsed[4];
+  int restartInterval;           // MCUs per restart interval, 0 = none
+  unsigned char *markers;        // APPn and COM segments copied from the source
+  size_t markersLength;
+} JpegCoefImage;
+
+/**
+ * Decodes the coefficients of the JPEG file held in buf.
+ *
+ * @return 1 on success, 0 on failure (see jpegFailureReason()).  On
+ *         success the image must be released with jpegFreeCoefficients().
+ */
+int jpegReadCoefficients(const unsigned char *buf, size_t length, JpegCoefImage *image);
+
+/**
+ * Receives a band of coefficients from jpegReadCoefficientBands(): the
+ * MCU rows [firstRow, firstRow + rows) of the image, held from the top of
+ * image's coefficient grids.
+ *
+ * @return 1 to carry on, 0 to stop decoding with a failure.
+ */
+typedef int (*JpegBandFunction)(void *context, const JpegCoefImage *image, int firstRow, int rows);
+
+/**
+ * Decodes the coefficients of the JPEG file held in buf a band of bandRows
+ * MCU rows at a time, handing each band to band() in order from the top,
+ * so only one band's coefficients are held however tall the image is.  The
+ * grids of the image passed to band() are bandRows MCU rows high (their
+ * blocksHigh counts those) and are reused for every band.  Restart
+ * intervals in a band are decoded in parallel, and one that runs across
+ * bands carries on where it stopped.
+ *
+ * Only files whose one scan holds every component can be decoded this
+ * way; jpegReadCoefficients() takes the rest.
+ *
+ * @return 1 on success, 0 on failure (see jpegFailureReason()).
+ */
+int jpegReadCoefficientBands(const unsigned char *buf, size_t length, int bandRows, JpegBandFunction band,
+                             void *context);
+
+/**
+ * Encodes the coefficients as a baseline JPEG using the standard
+ * (Annex K) Huffman tables.
+ *
+ * @return A buffer from poolAlloc() holding the file, with its size in
+ *         *length, or NULL on failure.
+ */
+unsigned char *jpegWriteCoefficients(const JpegCoefImage *image, size_t *length);
+
+/**
+ * A growing byte buffer from poolAlloc().  Once an allocation fails,
+ * failed is set and further writes are dropped.
+ */
+typedef struct {
+  unsigned char *data;
+  size_t length;
+  size_t capacity;
+  int failed;
+} JpegBuffer;
+
+/**
+ * Appends bytes to a buffer.
+ */
+void jpegBufferPut(JpegBuffer *out, const void *bytes, size_t count);
+
+/**
+ * Writes everything up to and including the SOS segment for an image with
+ * the given components, quantization tables and restart interval: SOI,
+ * the copied markers (or a JFIF APP0), DQT, SOF, the standard Huffman
+ * tables, DRI and SOS.  The coefficient grids are not used.
+ *
+ * @return 1 on success, 0 if the buffer couldn't grow.
+ */
+int jpegWriteHeaders(const JpegCoefImage *image, JpegBuffer *out);
+
+/**
+ * Huffman codes quantized blocks of a baseline scan with the standard
+ * tables into out.  Coders are independent, so several threads can each
+ * code their own restart intervals and the results be joined with RSTn
+ * markers in between.
+ */
+typedef struct {
+  JpegBuffer out;
+  uint64_t bitBuffer;
+  int bitCount;
+  int pred[JPEG_MAX_COMPONENTS];  // last DC value of each component
+} JpegEntropyCoder;
+
+/**
+ * Starts a coder with an empty buffer and zeroed DC predictions.
+ */
+void jpegEntropyInit(JpegEntropyCoder *coder);
+
+/**
+ * Codes one block (64 coefficients in natural order) of the given
+ * component; component 0 uses the luminance tables, the rest chrominance.
+ *
+ * @return 1 on success, 0 if a coefficient is out of range for baseline.
+ */
+int jpegEntropyBlock(JpegEntropyCoder *coder, const short *block, int component);
+
+/**
+ * Pads the last partial byte with 1 bits, ending a restart interval.
+ */
+void jpegEntropyFlush(JpegEntropyCoder *coder);
+
+/**
+ * Ends the current restart interval and writes the RSTn marker for the
+ * index-th one (n = index mod 8), resetting the DC predictions.
+ */
+void jpegEntropyRestart(JpegEntropyCoder *coder, int index);
+
+/**
+ * Allocates the coefficient grids of every component from the sizes and
+ * sampling factors already filled in, and computes maxH/maxV, the MCU
+ * counts and each component's padded block grid.  The coefficients are
+ * zeroed.
+ *
+ * @return 1 on success, 0 on failure.
+ */
+int jpegAllocCoefficients(JpegCoefImage *image);
+
+/**
+ * Reads only the frame header (SOF0/SOF1) of the JPEG file held in buf,
+ * filling in the size, components and block grids of image as
+ * jpegReadCoefficients() would, but allocating nothing.
+ *
+ * @return 1 on success, 0 if no supported frame header precedes the scan.
+ */
+int jpegReadFrame(const unsigned char *buf, size_t length, JpegCoefImage *image);
+
+/**
+ * Returns the bytes the coefficient grids of an image with the given
+ * size and components take, as jpegAllocCoefficients() would allocate
+ * them.  Only the size and each component's sampling factors are used.
+ */
+size_t jpegCoefficientBytes(const JpegCoefImage *frame);
+
+/**
+ * Releases the coefficient grids and copied markers of an image.
+ */
+void jpegFreeCoefficients(JpegCoefImage *image);
+
+/**
+ * A whole input file in memory: mapped, for regular files, or read into
+ * a malloc'd buffer for anything that can't be mapped (pipes, devices).
+ */
+typedef struct {
+  const unsigned char *data;
+  size_t length;
+  int mapped;
+} JpegFileData;
+
+/**
+ * Maps a whole file read-only into memory.  The kernel is told it will
+ * be read sequentially, so it reads ahead, and the pages come straight
+ * from the page cache without a copy, shared by every process reading
+ * the same file.  A path of "-" reads all of standard input instead.
+ *
+ * @return 1 on success, 0 if the file can't be opened or read.
+ */
+int jpegMapFile(const char *filePath, JpegFileData *file);
+
+/**
+ * Releases a file from jpegMapFile().
+ */
+void jpegUnmapFile(JpegFileData *file);
+
+/**
+ * Returns a short description of why the last call on this thread failed.
+ */
+const char *jpegFailureReason(void);
+
+/**
+ * Records the failure reason for the other JPEG modules.
+ *
+ * @return 0, so callers can write "return jpegFail(...)".
+ */
+int jpegFail(const char *reason);
+
+#endif
@@ -0,0 +1,546 @@
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "jpeg_decoder.h"
+#include "jpeg_coefficients.h"
+#include "thread_pool.h"
+#include "buffer_pool.h"
+
+static int read16(const unsigned char *p) {
+  return (p[0] << 8) | p[1];
+}
+
+/**
+ * Walks the segments before the first scan to see whether the file is
+ * one this decoder handles, before any entropy decoding is done.  Decoding
+ * in bands needs neither restart markers nor a large image.
+ */
+static int canDecode(const unsigned char *buf, size_t length, int channels, int banded) {
+  int restartInterval = 0;
+  int jfif = 0;
+  int adobeTransform = -1;
+  int components = 0;
+  int ids[4], h[4], v[4];
+  size_t pixels = 0;
+
+  if (length < 4 || buf[0] != 0xFF || buf[1] != 0xD8) {
+    return jpegFail("not a JPEG file");
+  }
+  size_t pos = 2;
+  while (1) {
+    while (pos + 1 < length && buf[pos] == 0xFF && buf[pos + 1] == 0xFF) {
+      pos++;
+    }
+    if (pos + 4 > length || buf[pos] != 0xFF) {
+      return jpegFail("corrupt JPEG: expected a marker");
+    }
+    int marker = buf[pos + 1];
+    int segLength = read16(buf + pos + 2);
+    const unsigned char *seg = buf + pos + 4;
+    if (segLength < 2 || pos + 2 + segLength > length) {
+      return jpegFail("corrupt JPEG: truncated segment");
+    }
+    segLength -= 2;
+
+    if (marker == 0xDA) {
+      break;
+    } else if (marker == 0xDD && segLength >= 2) {
+      restartInterval = read16(seg);
+    } else if (marker == 0xE0 && segLength >= 5 && memcmp(seg, "JFIF", 5) == 0) {
+      jfif = 1;
+    } else if (marker == 0xEE && segLength >= 12 && memcmp(seg, "Adobe", 6) == 0) {
+      adobeTransform = seg[11];
+    } else if ((marker == 0xC0 || marker == 0xC1) && segLength >= 6) {
+      pixels = (size_t) read16(seg + 1) * read16(seg + 3);
+      components = seg[5];
+      if (components != 1 && components != 3) {
+        return jpegFail("unsupported number of components");
+      }
+      if (segLength < 6 + 3 * components) {
+        return jpegFail("unsupported frame header");
+      }
+      for (int c = 0; c<components; c++) {
+        ids[c] = seg[6 + 3 * c];
+        h[c] = seg[7 + 3 * c] >> 4;
+        v[c] = seg[7 + 3 * c] & 15;
+      }
+    } else if (marker >= 0xC2 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+      return jpegFail("unsupported JPEG process (progressive, lossless or arithmetic coded)");
+    }
+    pos += 4 + segLength;
+  }
+
+  if (components == 0) {
+    return jpegFail("JPEG has no frame header");
+  }
+  if (restartInterval == 0 && !banded) {
+    return jpegFail("no restart markers");
+  }
+  // stb's SIMD kernels are faster on a single thread, but stb can't return more than INT_MAX bytes
+  if (!banded && !parallelWouldSplit(pixels * components) && pixels <= INT_MAX / channels) {
+    return jpegFail("image too small to split across threads");
+  }
+  if (components == 3) {
+    // stb reads these as RGB rather than YCbCr
+    if ((ids[0] == 'R' && ids[1] == 'G' && ids[2] == 'B') || (adobeTransform == 0 && !jfif)) {
+      return jpegFail("unsupported color space");
+    }
+    int maxH = 1, maxV = 1;
+    for (int c = 0; c<3; c++) {
+      if (h[c] > maxH) maxH = h[c];
+      if (v[c] > maxV) maxV = v[c];
+    }
+    for (int c = 0; c<3; c++) {
+      if (h[c] < 1 || v[c] < 1 || maxH % h[c] != 0 || maxV % v[c] != 0 || maxH / h[c] > 2 || maxV / v[c] > 2) {
+        return jpegFail("unsupported sampling factors");
+      }
+    }
+  }
+  return 1;
+}
+
+/*
+ * stb_image's integer IDCT (derived from jidctint), upsampling filters and
+ * fixed point YCbCr conversion, kept operation for operation so the
+ * output matches stbi_load()
+ */
+
+#define F2F(x) ((int) (((x) * 4096 + 0.5)))
+#define FSH(x) ((x) * 4096)
+
+#define IDCT_1D(s0, s1, s2, s3, s4, s5, s6, s7) \
+  int t0, t1, t2, t3, p1, p2, p3, p4, p5, x0, x1, x2, x3; \
+  p2 = s2; \
+  p3 = s6; \
+  p1 = (p2 + p3) * F2F(0.5411961f); \
+  t2 = p1 + p3 * F2F(-1.847759065f); \
+  t3 = p1 + p2 * F2F(0.765366865f); \
+  p2 = s0; \
+  p3 = s4; \
+  t0 = FSH(p2 + p3); \
+  t1 = FSH(p2 - p3); \
+  x0 = t0 + t3; \
+  x3 = t0 - t3; \
+  x1 = t1 + t2; \
+  x2 = t1 - t2; \
+  t0 = s7; \
+  t1 = s5; \
+  t2 = s3; \
+  t3 = s1; \
+  p3 = t0 + t2; \
+  p4 = t1 + t3; \
+  p1 = t0 + t3; \
+  p2 = t1 + t2; \
+  p5 = (p3 + p4) * F2F(1.175875602f); \
+  t0 = t0 * F2F(0.298631336f); \
+  t1 = t1 * F2F(2.053119869f); \
+  t2 = t2 * F2F(3.072711026f); \
+  t3 = t3 * F2F(1.501321110f); \
+  p1 = p5 + p1 * F2F(-0.899976223f); \
+  p2 = p5 + p2 * F2F(-2.562915447f); \
+  p3 = p3 * F2F(-1.961570560f); \
+  p4 = p4 * F2F(-0.390180644f); \
+  t3 += p1 + p4; \
+  t2 += p2 + p3; \
+  t1 += p2 + p4; \
+  t0 += p1 + p3;
+
+static unsigned char clampSample(int x) {
+  if ((unsigned int) x > 255) {
+    return x < 0 ? 0 : 255;
+  }
+  return (unsigned char) x;
+}
+
+/**
+ * Inverse transforms one dequantized block into 8 rows of out.
+ */
+static void idctBlock(unsigned char *out, int stride, const short *d) {
+  int val[64];
+  int *v = val;
+
+  // columns
+  for (int i = 0; i<8; i++, d++, v++) {
+    // all zero AC terms: the column is flat
+    if (d[8] == 0 && d[16] == 0 && d[24] == 0 && d[32] == 0 && d[40] == 0 && d[48] == 0 && d[56] == 0) {
+      int dcterm = d[0] * 4;
+      v[0] = v[8] = v[16] = v[24] = v[32] = v[40] = v[48] = v[56] = dcterm;
+    } else {
+      IDCT_1D(d[0], d[8], d[16], d[24], d[32], d[40], d[48], d[56])
+      // scaled up by 1 << 12; keep 2 extra bits of precision
+      x0 += 512; x1 += 512; x2 += 512; x3 += 512;
+      v[0] = (x0 + t3) >> 10;
+      v[56] = (x0 - t3) >> 10;
+      v[8] = (x1 + t2) >> 10;
+      v[48] = (x1 - t2) >> 10;
+      v[16] = (x2 + t1) >> 10;
+      v[40] = (x2 - t1) >> 10;
+      v[24] = (x3 + t0) >> 10;
+      v[32] = (x3 - t0) >> 10;
+    }
+  }
+
+  // rows, removing the remaining 1 << 17 of scale with rounding and the 128 level shift
+  v = val;
+  for (int i = 0; i<8; i++, v += 8, out += stride) {
+    IDCT_1D(v[0], v[1], v[2], v[3], v[4], v[5], v[6], v[7])
+    x0 += 65536 + (128 << 17);
+    x1 += 65536 + (128 << 17);
+    x2 += 65536 + (128 << 17);
+    x3 += 65536 + (128 << 17);
+    out[0] = clampSample((x0 + t3) >> 17);
+    out[7] = clampSample((x0 - t3) >> 17);
+    out[1] = clampSample((x1 + t2) >> 17);
+    out[6] = clampSample((x1 - t2) >> 17);
+    out[2] = clampSample((x2 + t1) >> 17);
+    out[5] = clampSample((x2 - t1) >> 17);
+    out[3] = clampSample((x3 + t0) >> 17);
+    out[4] = clampSample((x3 - t0) >> 17);
+  }
+}
+
+#define DIV4(x) ((unsigned char) ((x) >> 2))
+#define DIV16(x) ((unsigned char) ((x) >> 4))
+
+static const unsigned char *upsampleVertical(unsigned char *out, const unsigned char *near, const unsigned char *far, int w) {
+  for (int i = 0; i<w; i++) {
+    out[i] = DIV4(3 * near[i] + far[i] + 2);
+  }
+  return out;
+}
+
+static const unsigned char *upsampleHorizontal(unsigned char *out, const unsigned char *in, int w) {
+  if (w == 1) {
+    out[0] = out[1] = in[0];
+    return out;
+  }
+  out[0] = in[0];
+  out[1] = DIV4(in[0] * 3 + in[1] + 2);
+  int i;
+  for (i = 1; i<w - 1; i++) {
+    int n = 3 * in[i] + 2;
+    out[i * 2 + 0] = DIV4(n + in[i - 1]);
+    out[i * 2 + 1] = DIV4(n + in[i + 1]);
+  }
+  out[i * 2 + 0] = DIV4(in[w - 2] * 3 + in[w - 1] + 2);
+  out[i * 2 + 1] = in[w - 1];
+  return out;
+}
+
+static const unsigned char *upsampleBoth(unsigned char *out, const unsigned char *near, const unsigned char *far, int w) {
+  if (w == 1) {
+    out[0] = out[1] = DIV4(3 * near[0] + far[0] + 2);
+    return out;
+  }
+  int t0;
+  int t1 = 3 * near[0] + far[0];
+  out[0] = DIV4(t1 + 2);
+  for (int i = 1; i<w; i++) {
+    t0 = t1;
+    t1 = 3 * near[i] + far[i];
+    out[i * 2 - 1] = DIV16(3 * t0 + t1 + 8);
+    out[i * 2] = DIV16(3 * t1 + t0 + 8);
+  }
+  out[w * 2 - 1] = DIV4(t1 + 2);
+  return out;
+}
+
+#define FLOAT2FIXED(x) (((int) ((x) * 4096.0f + 0.5f)) << 8)
+
+static void ycbcrToRgb(unsigned char *out, const unsigned char *y, const unsigned char *pcb,
+                       const unsigned char *pcr, int count, int step) {
+  for (int i = 0; i<count; i++) {
+    int yFixed = (y[i] << 20) + (1 << 19); // rounding
+    int cr = pcr[i] - 128;
+    int cb = pcb[i] - 128;
+    int r = yFixed + cr * FLOAT2FIXED(1.40200f);
+    int g = yFixed + (cr * -FLOAT2FIXED(0.71414f)) + ((cb * -FLOAT2FIXED(0.34414f)) & 0xffff0000);
+    int b = yFixed + cb * FLOAT2FIXED(1.77200f);
+    out[0] = clampSample(r >> 20);
+    out[1] = clampSample(g >> 20);
+    out[2] = clampSample(b >> 20);
+    if (step == 4) {
+      out[3] = 255;
+    }
+    out += step;
+  }
+}
+
+/**
+ * A decoded component: its samples at its own resolution, one byte each,
+ * in rows of stride bytes.
+ */
+typedef struct {
+  unsigned char *samples;
+  int stride;
+  int rows;         // rows that hold image data
+  int hs;           // upsampling factor in each direction
+  int vs;
+  int base;         // plane row held in the first row of samples
+  int top;          // row of samples the IDCT writes the grids' first block row to
+} Plane;
+
+typedef struct {
+  const JpegCoefImage *image;
+  Plane planes[3];
+  int decoded;      // components needed for the output
+  unsigned char *out;
+  int outBase;      // output row held in the first row of out
+  int channels;
+  int failed;        // set by any worker, so accessed atomically; the join orders it for the caller
+} DecodeJob;
+
+/**
+ * Dequantizes and inverse transforms the MCU rows [begin, end) into the
+ * planes.
+ */
+static void idctRows(void *context, int begin, int end) {
+  DecodeJob *job = (DecodeJob *) context;
+  const JpegCoefImage *image = job->image;
+  short block[64];
+  for (int c = 0; c<job->decoded; c++) {
+    const JpegComponent *comp = &image->comp[c];
+    const unsigned short *quant = image->quant[comp->quantTable];
+    const Plane *plane = &job->planes[c];
+    for (int by = begin * comp->v; by<end * comp->v; by++) {
+      for (int bx = 0; bx<comp->blocksWide; bx++) {
+        const short *coefs = comp->coefs + 64 * ((size_t) by * comp->blocksWide + bx);
+        for (int k = 0; k<64; k++) {
+          block[k] = (short) (coefs[k] * quant[k]);
+        }
+        idctBlock(plane->samples + (size_t) plane->stride * (plane->top + by * 8) + bx * 8, plane->stride, block);
+      }
+    }
+  }
+}
+
+/**
+ * Upsamples and color converts the output rows [begin, end).
+ */
+static void convertRows(void *context, int begin, int end) {
+  DecodeJob *job = (DecodeJob *) context;
+  int width = job->image->width;
+  int n = job->channels;
+  unsigned char *lines = (unsigned char *) malloc((size_t) 3 * (width + 3));
+  if (lines == NULL) {
+    __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  for (int j = begin; j<end; j++) {
+    const unsigned char *rows[3];
+    for (int c = 0; c<job->decoded; c++) {
+      const Plane *plane = &job->planes[c];
+      unsigned char *line = lines + (size_t) c * (width + 3);
+      // output row j lies between plane rows near and far, nearer the first
+      int near = j / plane->vs;
+      int far = near;
+      if (plane->vs == 2) {
+        far = j % 2 ? near + 1 : near - 1;
+        far = far < 0 ? 0 : far >= plane->rows ? plane->rows - 1 : far;
+      }
+      const unsigned char *nearRow = plane->samples + (size_t) plane->stride * (near - plane->base);
+      const unsigned char *farRow = plane->samples + (size_t) plane->stride * (far - plane->base);
+      int lores = (width + plane->hs - 1) / plane->hs;
+      if (plane->hs == 1 && plane->vs == 1) {
+        rows[c] = nearRow;
+      } else if (plane->hs == 1) {
+        rows[c] = upsampleVertical(line, nearRow, farRow, lores);
+      } else if (plane->vs == 1) {
+        rows[c] = upsampleHorizontal(line, nearRow, lores);
+      } else {
+        rows[c] = upsampleBoth(line, nearRow, farRow, lores);
+      }
+    }
+
+    unsigned char *out = job->out + (size_t) n * width * (j - job->outBase);
+    if (n >= 3 && job->decoded == 3) {
+      ycbcrToRgb(out, rows[0], rows[1], rows[2], width, n);
+    } else if (n >= 3) {
+      for (int i = 0; i<width; i++, out += n) {
+        out[0] = out[1] = out[2] = rows[0][i];
+        if (n == 4) out[3] = 255;
+      }
+    } else if (n == 1) {
+      memcpy(out, rows[0], width);
+    } else {
+      for (int i = 0; i<width; i++) {
+        *out++ = rows[0][i];
+        *out++ = 255;
+      }
+    }
+  }
+  free(lines);
+}
+
+unsigned char *jpegDecodePixels(const unsigned char *buf, size_t length, int *width, int *height, int channels) {
+  if (channels < 1 || channels > 4) {
+    jpegFail("bad channel count");
+    return NULL;
+  }
+  if (!canDecode(buf, length, channels, 0)) {
+    return NULL;
+  }
+  JpegCoefImage image;
+  if (!jpegReadCoefficients(buf, length, &image)) {
+    return NULL;
+  }
+
+  DecodeJob job;
+  memset(&job, 0, sizeof(job));
+  job.image = &image;
+  job.channels = channels;
+  // gray output of a color image only needs luma
+  job.decoded = channels < 3 ? 1 : image.numComponents;
+  int ok = 1;
+  for (int c = 0; c<job.decoded; c++) {
+    const JpegComponent *comp = &image.comp[c];
+    Plane *plane = &job.planes[c];
+    plane->stride = comp->blocksWide * 8;
+    plane->rows = (image.height * comp->v + image.maxV - 1) / image.maxV;
+    plane->hs = image.maxH / comp->h;
+    plane->vs = image.maxV / comp->v;
+    plane->samples = (unsigned char *) poolAlloc((size_t) plane->stride * comp->blocksHigh * 8);
+    if (plane->samples == NULL) {
+      ok = 0;
+    }
+  }
+  job.out = ok ? (unsigned char *) poolAlloc((size_t) channels * image.width * image.height) : NULL;
+
+  if (job.out != NULL) {
+    int mcuRowBytes = image.mcusWide * image.maxH * image.maxV * 64 * 3;
+    parallelFor(0, image.mcusHigh, mcuRowBytes, idctRows, &job);
+    parallelFor(0, image.height, (size_t) image.width * (channels + 3), convertRows, &job);
+  }
+  for (int c = 0; c<job.decoded; c++) {
+    poolFree(job.planes[c].samples);
+  }
+  jpegFreeCoefficients(&image);
+
+  if (job.out == NULL || job.failed) {
+    poolFree(job.out);
+    jpegFail("out of memory");
+    return NULL;
+  }
+  *width = image.width;
+  *height = image.height;
+  return job.out;
+}
+
+/**
+ * Decoding in bands: the planes hold a band's samples below one row kept
+ * from the band before, which vertical upsampling reaches back to.
+ */
+typedef struct {
+  DecodeJob job;
+  int bandRows;     // MCU rows per band
+  int lag;          // output rows left for the next band, whose first plane row they need
+  int converted;    // output rows passed on so far
+  JpegRowSink sink;
+  void *context;
+} BandJob;
+
+static int allocBandPlanes(BandJob *band, const JpegCoefImage *image) {
+  DecodeJob *job = &band->job;
+  for (int c = 0; c<job->decoded; c++) {
+    const JpegComponent *comp = &image->comp[c];
+    Plane *plane = &job->planes[c];
+    plane->stride = comp->blocksWide * 8;
+    plane->rows = (image->height * comp->v + image->maxV - 1) / image->maxV;
+    plane->hs = image->maxH / comp->h;
+    plane->vs = image->maxV / comp->v;
+    plane->top = 1;
+    plane->samples = (unsigned char *) poolAlloc((size_t) plane->stride * (1 + band->bandRows * comp->v * 8));
+    if (plane->samples == NULL) {
+      return 0;
+    }
+    if (plane->vs == 2) {
+      band->lag = 1;
+    }
+  }
+  job->out = (unsigned char *) poolAlloc((size_t) job->channels * image->width * (band->bandRows * image->maxV * 8 + 1));
+  return job->out != NULL;
+}
+
+static int decodeBand(void *context, const JpegCoefImage *image, int firstRow, int rows) {
+  BandJob *band = (BandJob *) context;
+  DecodeJob *job = &band->job;
+  if (job->image == NULL) {
+    job->image = image;
+    if (!allocBandPlanes(band, image)) {
+      return jpegFail("out of memory");
+    }
+  }
+  for (int c = 0; c<job->decoded; c++) {
+    const JpegComponent *comp = &image->comp[c];
+    Plane *plane = &job->planes[c];
+    // keep the last row of the band before; the first band has none
+    if (firstRow > 0) {
+      memcpy(plane->samples, plane->samples + (size_t) plane->stride * band->bandRows * comp->v * 8, plane->stride);
+    }
+    plane->base = firstRow * comp->v * 8 - 1;
+  }
+
+  int mcuRowBytes = image->mcusWide * image->maxH * image->maxV * 64 * 3;
+  parallelFor(0, rows, mcuRowBytes, idctRows, job);
+  int end = (firstRow + rows) * image->maxV * 8;
+  end = end < image->height ? end - band->lag : image->height;
+  if (end > band->converted) {
+    job->outBase = band->converted;
+    parallelFor(band->converted, end, (size_t) image->width * (job->channels + 3), convertRows, job);
+    if (job->failed) {
+      return jpegFail("out of memory");
+    }
+    for (int j = band->converted; j<end; j++) {
+      band->sink(band->context, j, job->out + (size_t) job->channels * image->width * (j - job->outBase));
+    }
+    band->converted = end;
+  }
+  return 1;
+}
+
+/**
+ * Returns the MCU rows in a band of at least bandRows rows.
+ */
+static int bandMcuRows(const JpegCoefImage *frame, int bandRows) {
+  return (bandRows + frame->maxV * 8 - 1) / (frame->maxV * 8);
+}
+
+size_t jpegDecodeRowsMemory(const JpegCoefImage *frame, int channels, int bandRows) {
+  JpegCoefImage band = *frame;
+  int height = bandMcuRows(frame, bandRows) * frame->maxV * 8;
+  band.height = height < frame->height ? height : frame->height;
+  size_t coefficients = jpegCoefficientBytes(&band);
+  // a byte per sample in the planes, each with a row kept from the band before, and the band's pixels
+  size_t planes = coefficients / sizeof(short) + (size_t) frame->numComponents * frame->mcusWide * frame->maxH * 8;
+  return coefficients + planes + (size_t) channels * frame->width * (height + 1);
+}
+
+int jpegDecodeRows(const unsigned char *buf, size_t length, int channels, int bandRows, JpegRowSink sink,
+                   void *context) {
+  if (channels < 1 || channels > 4) {
+    return jpegFail("bad channel count");
+  }
+  if (!canDecode(buf, length, channels, 1)) {
+    return 0;
+  }
+  JpegCoefImage frame;
+  if (!jpegReadFrame(buf, length, &frame)) {
+    return 0;
+  }
+
+  BandJob band;
+  memset(&band, 0, sizeof(band));
+  band.job.channels = channels;
+  band.job.decoded = channels < 3 ? 1 : frame.numComponents;
+  band.bandRows = bandMcuRows(&frame, bandRows);
+  band.sink = sink;
+  band.context = context;
+  int ok = jpegReadCoefficientBands(buf, length, band.bandRows, decodeBand, &band);
+  for (int c = 0; c<band.job.decoded; c++) {
+    poolFree(band.job.planes[c].samples);
+  }
+  poolFree(band.job.out);
+  return ok;
+}
@@ -0,0 +1,66 @@
+/**
+ * A baseline JPEG decoder for files with restart markers, which spreads
+ * the work over the shared thread pool.
+ *
+ * Restart intervals are entropy decoded in parallel (see
+ * jpegReadCoefficients()), then the IDCT runs over MCU rows and the
+ * upsampling and color conversion over output rows, each on the pool.
+ *
+ * The IDCT, upsampling and color conversion are stb_image's integer
+ * versions, so the pixels are exactly those stbi_load() would return.
+ * Files this decoder doesn't handle (no restart markers, progressive,
+ * CMYK, unusual sampling factors) are left to stb, as are images too
+ * small to be split across threads, where stb's SIMD kernels win.
+ * Images whose pixels would pass stb's 2 GB limit are decoded here
+ * whatever the thread count.
+ *
+ * jpegDecodeRows() decodes a band of rows at a time instead, for callers
+ * that pass the rows straight on (see tiled_image.h); it takes files with
+ * or without restart markers, of any size.
+ */
+#ifndef JPEG_DECODER_H
+#define JPEG_DECODER_H
+
+#include <stddef.h>
+
+#include "jpeg_coefficients.h"
+
+/**
+ * Decodes the JPEG file held in buf to 8-bit pixels with the given number
+ * of channels (1 to 4), converting as stbi_load() does: rows top to
+ * bottom, tightly packed.
+ *
+ * @return A buffer from poolAlloc() of (*height x *width x channels)
+ *         bytes, or NULL if the file can't be decoded this way (see
+ *         jpegFailureReason()); the caller should then fall back to stb.
+ */
+unsigned char *jpegDecodePixels(const unsigned char *buf, size_t length, int *width, int *height, int channels);
+
+/**
+ * Receives one row of pixels (width x channels bytes) from
+ * jpegDecodeRows().
+ */
+typedef void (*JpegRowSink)(void *context, int row, const unsigned char *pixels);
+
+/**
+ * Decodes the JPEG file held in buf as jpegDecodePixels() does, but a band
+ * of at least bandRows rows at a time, passing each row to sink in order
+ * from the top.  Only one band's coefficients, samples and pixels are held
+ * at once, so the memory needed doesn't grow with the image's height.  Any
+ * size of image is taken, with or without restart markers, as long as its
+ * one scan holds every component (see jpegReadCoefficientBands()).  The
+ * size is that jpegReadFrame() reads.
+ *
+ * @return 1 on success, 0 on failure (see jpegFailureReason()), in which
+ *         case some rows may already have been passed to sink.
+ */
+int jpegDecodeRows(const unsigned char *buf, size_t length, int channels, int bandRows, JpegRowSink sink,
+                   void *context);
+
+/**
+ * Returns the memory jpegDecodeRows() works in, for an image with the
+ * frame header read by jpegReadFrame().
+ */
+size_t jpegDecodeRowsMemory(const JpegCoefImage *frame, int channels, int bandRows);
+
+#endif
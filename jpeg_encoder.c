@@ -0,0 +1,302 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "jpeg_encoder.h"
+#include "jpeg_coefficients.h"
+#include "thread_pool.h"
+#include "buffer_pool.h"
+
+// strips encoded (and held) at once before being written out
+#define STRIPS_PER_WINDOW 64
+
+// the Annex K quantization tables in natural order, scaled by quality as stb does
+static const int lumaQuant[64] = {
+  16, 11, 10, 16, 24, 40, 51, 61, 12, 12, 14, 19, 26, 58, 60, 55,
+  14, 13, 16, 24, 40, 57, 69, 56, 14, 17, 22, 29, 51, 87, 80, 62,
+  18, 22, 37, 56, 68, 109, 103, 77, 24, 35, 55, 64, 81, 104, 113, 92,
+  49, 64, 78, 87, 103, 121, 120, 101, 72, 92, 95, 98, 112, 100, 103, 99
+};
+static const int chromaQuant[64] = {
+  17, 18, 24, 47, 99, 99, 99, 99, 18, 21, 26, 66, 99, 99, 99, 99,
+  24, 26, 56, 99, 99, 99, 99, 99, 47, 66, 99, 99, 99, 99, 99, 99,
+  99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99,
+  99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99
+};
+
+// the AAN output scale factors, folded into the quantization divisors
+static const float aanScale[8] = {
+  1.0f * 2.828427125f, 1.387039845f * 2.828427125f, 1.306562965f * 2.828427125f, 1.175875602f * 2.828427125f,
+  1.0f * 2.828427125f, 0.785694958f * 2.828427125f, 0.541196100f * 2.828427125f, 0.275899379f * 2.828427125f
+};
+
+/**
+ * One dimensional float AAN forward DCT of the 8 values d[0], d[step],
+ * ..., d[7 * step], in place.  The operations are stb's, in stb's order,
+ * so the results are bit for bit the same.
+ */
+static void fdct8(float *d, int step) {
+  float d0 = d[0], d1 = d[step], d2 = d[2 * step], d3 = d[3 * step];
+  float d4 = d[4 * step], d5 = d[5 * step], d6 = d[6 * step], d7 = d[7 * step];
+  float z1, z2, z3, z4, z5, z11, z13;
+
+  float tmp0 = d0 + d7;
+  float tmp7 = d0 - d7;
+  float tmp1 = d1 + d6;
+  float tmp6 = d1 - d6;
+  float tmp2 = d2 + d5;
+  float tmp5 = d2 - d5;
+  float tmp3 = d3 + d4;
+  float tmp4 = d3 - d4;
+
+  // even part
+  float tmp10 = tmp0 + tmp3;
+  float tmp13 = tmp0 - tmp3;
+  float tmp11 = tmp1 + tmp2;
+  float tmp12 = tmp1 - tmp2;
+
+  d0 = tmp10 + tmp11;
+  d4 = tmp10 - tmp11;
+
+  z1 = (tmp12 + tmp13) * 0.707106781f;
+  d2 = tmp13 + z1;
+  d6 = tmp13 - z1;
+
+  // odd part
+  tmp10 = tmp4 + tmp5;
+  tmp11 = tmp5 + tmp6;
+  tmp12 = tmp6 + tmp7;
+
+  z5 = (tmp10 - tmp12) * 0.382683433f;
+  z2 = tmp10 * 0.541196100f + z5;
+  z4 = tmp12 * 1.306562965f + z5;
+  z3 = tmp11 * 0.707106781f;
+
+  z11 = tmp7 + z3;
+  z13 = tmp7 - z3;
+
+  d[5 * step] = z13 + z2;
+  d[3 * step] = z13 - z2;
+  d[step] = z11 + z4;
+  d[7 * step] = z11 - z4;
+
+  d[0] = d0;
+  d[2 * step] = d2;
+  d[4 * step] = d4;
+  d[6 * step] = d6;
+}
+
+/**
+ * Transforms and quantizes one block of samples into natural order
+ * coefficients.
+ */
+static void quantizeBlock(float *samples, const float *divisors, short *block) {
+  for (int i = 0; i<64; i += 8) {
+    fdct8(samples + i, 1);
+  }
+  for (int i = 0; i<8; i++) {
+    fdct8(samples + i, 8);
+  }
+  for (int i = 0; i<64; i++) {
+    float v = samples[i] * divisors[i];
+    // as in stb, no clamp: 8-bit samples keep every AC value within baseline's +-1023, even at
+    // quality 100 where the divisors are smallest
+    block[i] = (short) (v < 0 ? v - 0.5f : v + 0.5f);
+  }
+}
+
+typedef struct {
+  int width;
+  int height;
+  int channels;
+  int mcuSize;                // 8, or 16 when chroma is subsampled 2x2
+  JpegRowSource source;
+  void *context;
+  float lumaDivisors[64];
+  float chromaDivisors[64];
+  JpegEntropyCoder *strips;   // the window of strips being encoded, from first on
+  int first;
+  int failed;                 // set by any worker, so accessed atomically; the join orders it for the caller
+} EncodeJob;
+
+/**
+ * Copies the 8x8 block at (bx, by) of a 16x16 array of samples.
+ */
+static void extractBlock(const float *mcu, int bx, int by, float *block) {
+  for (int r = 0; r<8; r++) {
+    memcpy(block + r * 8, mcu + (by * 8 + r) * 16 + bx * 8, sizeof(float) * 8);
+  }
+}
+
+/**
+ * Averages each 2x2 group of a 16x16 array of samples into an 8x8 block.
+ */
+static void downsampleBlock(const float *mcu, float *block) {
+  for (int r = 0, pos = 0; r<8; r++) {
+    for (int c = 0; c<8; c++, pos++) {
+      const float *p = mcu + r * 32 + c * 2;
+      block[pos] = (p[0] + p[1] + p[16] + p[17]) * 0.25f;
+    }
+  }
+}
+
+/**
+ * Encodes the strips [begin, end), each into its own coder.
+ */
+static void encodeStrips(void *context, int begin, int end) {
+  EncodeJob *job = (EncodeJob *) context;
+  int size = job->mcuSize;
+  size_t rowBytes = (size_t) job->width * job->channels;
+  unsigned char *buffer = (unsigned char *) malloc(rowBytes * size);
+  if (buffer == NULL) {
+    __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  // gray images use their one channel for red, green and blue
+  int greenOffset = job->channels > 2 ? 1 : 0;
+  int blueOffset = job->channels > 2 ? 2 : 0;
+
+  for (int strip = begin; strip<end && !__atomic_load_n(&job->failed, __ATOMIC_RELAXED); strip++) {
+    JpegEntropyCoder *coder = &job->strips[strip - job->first];
+    const unsigned char *rows[16];
+    for (int r = 0; r<size; r++) {
+      // rows past the bottom repeat the last one, as do columns past the right edge
+      int row = strip * size + r < job->height ? strip * size + r : job->height - 1;
+      rows[r] = job->source(job->context, row, buffer + rowBytes * r);
+    }
+
+    int ok = 1;
+    for (int x = 0; ok && x<job->width; x += size) {
+      float y[256], u[256], v[256], samples[64];
+      short block[64];
+      for (int r = 0, pos = 0; r<size; r++) {
+        for (int col = x; col<x + size; col++, pos++) {
+          const unsigned char *p = rows[r] + (size_t) (col < job->width ? col : job->width - 1) * job->channels;
+          float red = p[0];
+          float green = p[greenOffset];
+          float blue = p[blueOffset];
+          y[pos] = +0.29900f * red + 0.58700f * green + 0.11400f * blue - 128;
+          u[pos] = -0.16874f * red - 0.33126f * green + 0.50000f * blue;
+          v[pos] = +0.50000f * red - 0.41869f * green - 0.08131f * blue;
+        }
+      }
+      if (size == 8) {
+        quantizeBlock(y, job->lumaDivisors, block);
+        ok = jpegEntropyBlock(coder, block, 0);
+        quantizeBlock(u, job->chromaDivisors, block);
+        ok = ok && jpegEntropyBlock(coder, block, 1);
+        quantizeBlock(v, job->chromaDivisors, block);
+        ok = ok && jpegEntropyBlock(coder, block, 2);
+        continue;
+      }
+      // a 2x2 sampled MCU is four luma blocks in raster order, then one of each chroma
+      for (int b = 0; ok && b<4; b++) {
+        extractBlock(y, b % 2, b / 2, samples);
+        quantizeBlock(samples, job->lumaDivisors, block);
+        ok = jpegEntropyBlock(coder, block, 0);
+      }
+      downsampleBlock(u, samples);
+      quantizeBlock(samples, job->chromaDivisors, block);
+      ok = ok && jpegEntropyBlock(coder, block, 1);
+      downsampleBlock(v, samples);
+      quantizeBlock(samples, job->chromaDivisors, block);
+      ok = ok && jpegEntropyBlock(coder, block, 2);
+    }
+    jpegEntropyFlush(coder);
+    if (!ok || coder->out.failed) {
+      __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+    }
+  }
+  free(buffer);
+}
+
+int jpegEncode(JpegWriteFunction output, void *outputContext, int width, int height, int channels,
+               int quality, int subsample, JpegRowSource source, void *sourceContext) {
+  if (width < 1 || height < 1 || width > 65535 || height > 65535 || channels < 1 || channels > 4) {
+    return jpegFail("invalid image size");
+  }
+
+  quality = quality ? quality : 90;
+  quality = quality < 1 ? 1 : quality > 100 ? 100 : quality;
+  quality = quality < 50 ? 5000 / quality : 200 - quality * 2;
+
+  // the header is written from a coefficient image with no coefficients
+  JpegCoefImage header;
+  memset(&header, 0, sizeof(header));
+  header.width = width;
+  header.height = height;
+  header.numComponents = 3;
+  int mcuSize = subsample ? 16 : 8;
+  for (int c = 0; c<3; c++) {
+    header.comp[c].id = c + 1;
+    header.comp[c].h = c == 0 ? mcuSize / 8 : 1;
+    header.comp[c].v = c == 0 ? mcuSize / 8 : 1;
+    header.comp[c].quantTable = c == 0 ? 0 : 1;
+  }
+  header.quantUsed[0] = 1;
+  header.quantUsed[1] = 1;
+  int stripCount = (height + mcuSize - 1) / mcuSize;
+  header.restartInterval = stripCount > 1 ? (width + mcuSize - 1) / mcuSize : 0;
+
+  EncodeJob job;
+  job.width = width;
+  job.height = height;
+  job.channels = channels;
+  job.mcuSize = mcuSize;
+  job.source = source;
+  job.context = sourceContext;
+  job.failed = 0;
+  for (int i = 0; i<64; i++) {
+    int luma = (lumaQuant[i] * quality + 50) / 100;
+    int chroma = (chromaQuant[i] * quality + 50) / 100;
+    header.quant[0][i] = luma < 1 ? 1 : luma > 255 ? 255 : luma;
+    header.quant[1][i] = chroma < 1 ? 1 : chroma > 255 ? 255 : chroma;
+    int lumaTable = header.quant[0][i];
+    int chromaTable = header.quant[1][i];
+    job.lumaDivisors[i] = 1 / (lumaTable * aanScale[i / 8] * aanScale[i % 8]);
+    job.chromaDivisors[i] = 1 / (chromaTable * aanScale[i / 8] * aanScale[i % 8]);
+  }
+
+  JpegBuffer head = { NULL, 0, 0, 0 };
+  int ok = jpegWriteHeaders(&header, &head) && output(outputContext, head.data, head.length);
+  poolFree(head.data);
+
+  // strips are encoded a window at a time and written out in order, so only
+  // a window's worth of compressed data is ever held
+  int window = stripCount < STRIPS_PER_WINDOW ? stripCount : STRIPS_PER_WINDOW;
+  job.strips = (JpegEntropyCoder *) malloc(sizeof(JpegEntropyCoder) * window);
+  if (job.strips == NULL) {
+    return jpegFail("out of memory");
+  }
+  for (job.first = 0; ok && job.first<stripCount; job.first += window) {
+    int last = job.first + window < stripCount ? job.first + window : stripCount;
+    for (int i = job.first; i<last; i++) {
+      jpegEntropyInit(&job.strips[i - job.first]);
+    }
+
+    // converting and transforming a strip reads its rows but costs far more than copying them
+    parallelFor(job.first, last, (size_t) width * channels * mcuSize * 8, encodeStrips, &job);
+
+    ok = !job.failed;
+    for (int i = job.first; ok && i<last; i++) {
+      const JpegBuffer *strip = &job.strips[i - job.first].out;
+      ok = output(outputContext, strip->data, strip->length);
+      if (ok && i < stripCount - 1) {
+        unsigned char marker[2] = { 0xFF, (unsigned char) (0xD0 + (i & 7)) };
+        ok = output(outputContext, marker, 2);
+      }
+    }
+    for (int i = job.first; i<last; i++) {
+      poolFree(job.strips[i - job.first].out.data);
+    }
+  }
+  free(job.strips);
+  if (ok) {
+    static const unsigned char end[2] = { 0xFF, 0xD9 };
+    ok = output(outputContext, end, 2);
+  }
+
+  if (!ok && job.failed) {
+    jpegFail("unable to encode image");
+  }
+  return ok;
+}
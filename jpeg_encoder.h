@@ -0,0 +1,51 @@
+/**
+ * A baseline JPEG encoder that splits the image into horizontal strips,
+ * one MCU row (8 pixel rows, or 16 with subsampled chroma) each, and
+ * encodes the strips in parallel.
+ *
+ * Each strip is its own restart interval: it starts with fresh DC
+ * predictions and ends on a byte boundary, so the strips can be color
+ * converted, transformed and entropy coded independently and then joined
+ * with RSTn markers into one ordinary baseline file.  Strips are encoded
+ * and written out a window at a time, so only a window's worth of
+ * compressed data is held in memory however large the image is.
+ *
+ * The color conversion, quantization tables, FDCT and rounding are the
+ * same as stb_image_write's, so the coefficients (and the decoded pixels)
+ * are exactly those of stbi_write_jpg() at the same quality; only the
+ * restart markers differ.  Subsampled chroma, which this stb version
+ * lacks, averages each 2x2 group of pixels.
+ */
+#ifndef JPEG_ENCODER_H
+#define JPEG_ENCODER_H
+
+#include <stddef.h>
+
+/**
+ * Supplies row `row` of the image as width x channels bytes.  It may
+ * return a pointer into its own storage, or fill `buffer` (which has room
+ * for one row) and return that.  Rows of different strips are requested
+ * from several threads at once.
+ */
+typedef const unsigned char *(*JpegRowSource)(void *context, int row, unsigned char *buffer);
+
+/**
+ * Receives the encoded file in order, in pieces.
+ *
+ * @return 1 on success, 0 to abort the encode.
+ */
+typedef int (*JpegWriteFunction)(void *context, const void *data, size_t size);
+
+/**
+ * Encodes a (height x width) image with 1 to 4 channels at the given
+ * quality (1 to 100, 0 for stb's default of 90).  As with stb, 1 and 2
+ * channels are gray (plus alpha), 3 and 4 RGB (plus alpha); alpha is
+ * ignored.  If subsample is nonzero the chroma is stored at half the
+ * resolution in both directions (4:2:0), for a much smaller file.
+ *
+ * @return 1 on success, 0 on failure.
+ */
+int jpegEncode(JpegWriteFunction output, void *outputContext, int width, int height, int channels,
+               int quality, int subsample, JpegRowSource source, void *sourceContext);
+
+#endif
@@ -0,0 +1,256 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "jpeg_transform.h"
+#include "buffer_pool.h"
+#include "stb_image.h"
+
+/**
+ * Returns 1 if the transform reverses the source's columns (x axis).
+ */
+static int mirrorsSourceX(Transform transform) {
+  return transform == TRANSFORM_FLIP_HORIZONTAL || transform == TRANSFORM_ROTATE_180 ||
+         transform == TRANSFORM_ROTATE_270 || transform == TRANSFORM_TRANSVERSE;
+}
+
+/**
+ * Returns 1 if the transform reverses the source's rows (y axis).
+ */
+static int mirrorsSourceY(Transform transform) {
+  return transform == TRANSFORM_FLIP_VERTICAL || transform == TRANSFORM_ROTATE_180 ||
+         transform == TRANSFORM_ROTATE_90 || transform == TRANSFORM_TRANSVERSE;
+}
+
+/**
+ * Transforms the 64 coefficients of one block.  Mirroring the pixels of a
+ * block negates its odd frequencies along that axis, and transposing the
+ * pixels transposes the coefficients.
+ */
+static void transformBlock(short *out, const short *in, Transform transform) {
+  int transpose = transformSwapsAxes(transform);
+  // sign flips are applied along the output block's axes
+  int negateU = transform == TRANSFORM_FLIP_HORIZONTAL || transform == TRANSFORM_ROTATE_180 ||
+                transform == TRANSFORM_ROTATE_90 || transform == TRANSFORM_TRANSVERSE;
+  int negateV = transform == TRANSFORM_FLIP_VERTICAL || transform == TRANSFORM_ROTATE_180 ||
+                transform == TRANSFORM_ROTATE_270 || transform == TRANSFORM_TRANSVERSE;
+  for (int v = 0; v<8; v++) {
+    for (int u = 0; u<8; u++) {
+      int value = transpose ? in[8 * u + v] : in[8 * v + u];
+      if ((negateU && (u & 1)) ^ (negateV && (v & 1))) {
+        value = -value;
+      }
+      out[8 * v + u] = (short) value;
+    }
+  }
+}
+
+/**
+ * Reads a 16 or 32 bit value of a TIFF structure in its byte order.
+ */
+static unsigned tiff16(const unsigned char *p, int bigEndian) {
+  return bigEndian ? (unsigned) (p[0] << 8 | p[1]) : (unsigned) (p[1] << 8 | p[0]);
+}
+
+static unsigned tiff32(const unsigned char *p, int bigEndian) {
+  return bigEndian ? tiff16(p, 1) << 16 | tiff16(p + 2, 1) : tiff16(p + 2, 0) << 16 | tiff16(p, 0);
+}
+
+/**
+ * Sets the orientation tag of an EXIF APP1 segment among the copied
+ * markers to 1 (rows top to bottom, columns left to right).  The tag
+ * described how to display the source's pixels, so once those are
+ * rotated or flipped a viewer honouring it would turn the image again.
+ */
+static void resetExifOrientation(unsigned char *markers, size_t length) {
+  // the segments were copied whole by jpegReadCoefficients(), each marker followed by its length
+  for (size_t pos = 0, next; pos + 4 <= length; pos = next) {
+    int marker = markers[pos + 1];
+    size_t segLength = (size_t) (markers[pos + 2] << 8 | markers[pos + 3]);
+    unsigned char *seg = markers + pos + 4;
+    next = pos + 2 + segLength;
+    if (segLength < 2 || next > length) {
+      return;
+    }
+    segLength -= 2;
+    if (marker != 0xE1 || segLength < 14 || memcmp(seg, "Exif\0\0", 6) != 0) {
+      continue;
+    }
+    unsigned char *tiff = seg + 6;
+    size_t tiffLength = segLength - 6;
+    int bigEndian = tiff[0] == 'M';
+    if ((tiff[0] != 'I' && tiff[0] != 'M') || tiff[1] != tiff[0] || tiff16(tiff + 2, bigEndian) != 42) {
+      continue;
+    }
+    // IFD0 holds the orientation: a count, then 12 byte entries of tag, type, count and value
+    size_t ifd = tiff32(tiff + 4, bigEndian);
+    if (ifd > tiffLength - 2) {
+      continue;
+    }
+    unsigned entries = tiff16(tiff + ifd, bigEndian);
+    for (unsigned e = 0; e<entries && ifd + 2 + 12 * (e + 1) <= tiffLength; e++) {
+      unsigned char *entry = tiff + ifd + 2 + 12 * e;
+      if (tiff16(entry, bigEndian) == 0x0112 && tiff16(entry + 2, bigEndian) == 3) {
+        entry[8] = bigEndian ? 0 : 1;
+        entry[9] = bigEndian ? 1 : 0;
+      }
+    }
+  }
+}
+
+int jpegTransformCoefficients(const JpegCoefImage *src, JpegCoefImage *dst, Transform transform,
+                              JpegEdgeMode edges) {
+  // a reversed axis must hold a whole number of iMCUs, or the partial edge MCU would end up
+  // at the start of the row/column where JPEG can't represent it
+  int mcuWidth = 8 * src->maxH;
+  int mcuHeight = 8 * src->maxV;
+  int width = src->width;
+  int height = src->height;
+  if (mirrorsSourceX(transform) && width % mcuWidth) {
+    if (edges == JPEG_EDGE_STRICT || width < mcuWidth) {
+      return jpegFail("image width is not a whole number of MCUs");
+    }
+    width -= width % mcuWidth;
+  }
+  if (mirrorsSourceY(transform) && height % mcuHeight) {
+    if (edges == JPEG_EDGE_STRICT || height < mcuHeight) {
+      return jpegFail("image height is not a whole number of MCUs");
+    }
+    height -= height % mcuHeight;
+  }
+
+  int transpose = transformSwapsAxes(transform);
+  memset(dst, 0, sizeof(JpegCoefImage));
+  dst->width = transpose ? height : width;
+  dst->height = transpose ? width : height;
+  dst->numComponents = src->numComponents;
+  dst->restartInterval = src->restartInterval;
+  for (int c = 0; c<src->numComponents; c++) {
+    dst->comp[c].id = src->comp[c].id;
+    dst->comp[c].quantTable = src->comp[c].quantTable;
+    dst->comp[c].h = transpose ? src->comp[c].v : src->comp[c].h;
+    dst->comp[c].v = transpose ? src->comp[c].h : src->comp[c].v;
+  }
+  for (int t = 0; t<4; t++) {
+    dst->quantUsed[t] = src->quantUsed[t];
+    for (int v = 0; v<8; v++) {
+      for (int u = 0; u<8; u++) {
+        dst->quant[t][8 * v + u] = transpose ? src->quant[t][8 * u + v] : src->quant[t][8 * v + u];
+      }
+    }
+  }
+  if (!jpegAllocCoefficients(dst)) {
+    return 0;
+  }
+  if (src->markersLength) {
+    dst->markers = (unsigned char *) malloc(src->markersLength);
+    if (dst->markers == NULL) {
+      jpegFreeCoefficients(dst);
+      return jpegFail("out of memory");
+    }
+    memcpy(dst->markers, src->markers, src->markersLength);
+    dst->markersLength = src->markersLength;
+    if (transform != TRANSFORM_IDENTITY) {
+      resetExifOrientation(dst->markers, dst->markersLength);
+    }
+  }
+
+  for (int c = 0; c<src->numComponents; c++) {
+    const JpegComponent *in = &src->comp[c];
+    JpegComponent *out = &dst->comp[c];
+    // blocks of this component across the (trimmed) source; only used along mirrored axes,
+    // which are whole MCUs so the division is exact
+    int srcBlocksX = width * in->h / src->maxH / 8;
+    int srcBlocksY = height * in->v / src->maxV / 8;
+
+    for (int dy = 0; dy<out->blocksHigh; dy++) {
+      for (int dx = 0; dx<out->blocksWide; dx++) {
+        int sx, sy;
+        switch (transform) {
+          case TRANSFORM_FLIP_HORIZONTAL: sx = srcBlocksX - 1 - dx; sy = dy; break;
+          case TRANSFORM_FLIP_VERTICAL:   sx = dx; sy = srcBlocksY - 1 - dy; break;
+          case TRANSFORM_ROTATE_180:      sx = srcBlocksX - 1 - dx; sy = srcBlocksY - 1 - dy; break;
+          case TRANSFORM_TRANSPOSE:       sx = dy; sy = dx; break;
+          case TRANSFORM_ROTATE_90:       sx = dy; sy = srcBlocksY - 1 - dx; break;
+          case TRANSFORM_ROTATE_270:      sx = srcBlocksX - 1 - dy; sy = dx; break;
+          case TRANSFORM_TRANSVERSE:      sx = srcBlocksX - 1 - dy; sy = srcBlocksY - 1 - dx; break;
+          default:                             sx = dx; sy = dy; break;
+        }
+        // padding blocks outside the source stay zero
+        if (sx < 0 || sy < 0 || sx >= in->blocksWide || sy >= in->blocksHigh) {
+          continue;
+        }
+        transformBlock(out->coefs + 64 * ((size_t) dy * out->blocksWide + dx),
+                       in->coefs + 64 * ((size_t) sy * in->blocksWide + sx), transform);
+      }
+    }
+  }
+  return 1;
+}
+
+int jpegTransformFile(const char *inPath, const char *outPath, Transform transform, JpegEdgeMode edges) {
+  JpegFileData input;
+  if (!jpegMapFile(inPath, &input)) {
+    return 0;
+  }
+  int ok = jpegTransformMemory(input.data, input.length, outPath, transform, edges);
+  jpegUnmapFile(&input);
+  return ok;
+}
+
+int jpegTransformMemory(const unsigned char *input, size_t length, const char *outPath, Transform transform,
+                        JpegEdgeMode edges) {
+  ImageInfo info;
+  if (!imageProbeMemory(input, length, &info)) {
+    return jpegFail(stbi_failure_reason());
+  }
+  // the source and transformed coefficients are held at once; the transformed grid has the
+  // same components with the axes (and sampling factors) swapped
+  JpegCoefImage frame;
+  if (!jpegReadFrame(input, length, &frame)) {
+    return 0;
+  }
+  size_t bytes = jpegCoefficientBytes(&frame);
+  if (transformSwapsAxes(transform)) {
+    int width = frame.width;
+    frame.width = frame.height;
+    frame.height = width;
+    for (int c = 0; c<frame.numComponents; c++) {
+      int h = frame.comp[c].h;
+      frame.comp[c].h = frame.comp[c].v;
+      frame.comp[c].v = h;
+    }
+  }
+  bytes += jpegCoefficientBytes(&frame);
+  if (!imageWithinBudgetBytes(&info, bytes)) {
+    return jpegFail("image over the budget");
+  }
+
+  JpegCoefImage src, dst;
+  int ok = jpegReadCoefficients(input, length, &src);
+  if (!ok) {
+    return 0;
+  }
+  ok = jpegTransformCoefficients(&src, &dst, transform, edges);
+  jpegFreeCoefficients(&src);
+  if (!ok) {
+    return 0;
+  }
+
+  size_t outLength;
+  unsigned char *output = jpegWriteCoefficients(&dst, &outLength);
+  jpegFreeCoefficients(&dst);
+  if (output == NULL) {
+    return 0;
+  }
+  int toStdout = strcmp(outPath, "-") == 0;
+  FILE *file = toStdout ? stdout : fopen(outPath, "wb");
+  if (file == NULL || fwrite(output, 1, outLength, file) != outLength) {
+    if (file && !toStdout) fclose(file);
+    poolFree(output);
+    return jpegFail("unable to write output file");
+  }
+  poolFree(output);
+  ok = toStdout ? fflush(file) == 0 : fclose(file) == 0;
+  return ok ? 1 : jpegFail("unable to write output file");
+}
@@ -0,0 +1,55 @@
+/**
+ * Lossless rotation and flipping of JPEG files (in the manner of jpegtran).
+ *
+ * Instead of decoding to pixels and re-encoding, the quantized DCT blocks
+ * are moved to their new positions and their coefficients transposed and/or
+ * negated, so no IDCT/FDCT or requantization takes place and the output
+ * decodes to exactly the transformed image.
+ */
+#ifndef JPEG_TRANSFORM_H
+#define JPEG_TRANSFORM_H
+
+#include "image_utils.h"
+#include "jpeg_coefficients.h"
+
+/**
+ * What to do when a transform would move a partial MCU at the right or
+ * bottom edge of the image to the left or top, where JPEG can't store it.
+ *
+ * JPEG_EDGE_TRIM drops the partial MCU column/row (at most 15 pixels),
+ * as jpegtran -trim does.  JPEG_EDGE_STRICT fails instead, so the caller
+ * can fall back to the pixel path (jpegtran -perfect).
+ */
+typedef enum {
+  JPEG_EDGE_TRIM,
+  JPEG_EDGE_STRICT
+} JpegEdgeMode;
+
+/**
+ * Applies a transform to the coefficients of src, filling in dst.  The
+ * source's APPn and COM segments are copied; unless the transform is the
+ * identity, an EXIF orientation tag among them is reset to 1 (normal).
+ *
+ * @return 1 on success, 0 on failure (see jpegFailureReason()).  On
+ *         success dst must be released with jpegFreeCoefficients().
+ */
+int jpegTransformCoefficients(const JpegCoefImage *src, JpegCoefImage *dst, Transform transform,
+                              JpegEdgeMode edges);
+
+/**
+ * Losslessly transforms the JPEG file inPath and writes the result to
+ * outPath.  Either path may be "-" for standard input or output.
+ *
+ * @return 1 on success, 0 if the input is not a supported JPEG, the edge
+ *         mode forbids the transform, or the files can't be read/written.
+ */
+int jpegTransformFile(const char *inPath, const char *outPath, Transform transform, JpegEdgeMode edges);
+
+/**
+ * Losslessly transforms a JPEG file held in memory and writes the result
+ * to outPath, as jpegTransformFile().
+ */
+int jpegTransformMemory(const unsigned char *input, size_t length, const char *outPath, Transform transform,
+                        JpegEdgeMode edges);
+
+#endif
@@ -0,0 +1,201 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "thread_pool.h"
+
+// bands per thread, so a thread that finishes early can pick up more work
+#define BANDS_PER_THREAD 4
+
+struct ThreadPool {
+  int threads;
+  pthread_t *workers;   // threads - 1 of them; the caller is the last
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_cond_t done;
+  pthread_mutex_t busy; // held by whoever is running a loop
+  unsigned long generation;
+  int stopping;
+
+  // the loop being run; workers only join while it is open, and the caller
+  // closes it once none of them is still working on it
+  int open;
+  int active;
+  RangeFunction fn;
+  void *context;
+  int begin;
+  int end;
+  int bands;
+  int nextBand;
+};
+
+/**
+ * Takes bands of the current loop until none are left.
+ */
+static void runBands(ThreadPool *pool) {
+  int count = pool->end - pool->begin;
+  int band;
+  while ((band = __sync_fetch_and_add(&pool->nextBand, 1)) < pool->bands) {
+    int b0 = pool->begin + (int) ((long long) count * band / pool->bands);
+    int b1 = pool->begin + (int) ((long long) count * (band + 1) / pool->bands);
+    if (b1 > b0) {
+      pool->fn(pool->context, b0, b1);
+    }
+  }
+}
+
+static void *poolWorker(void *arg) {
+  ThreadPool *pool = (ThreadPool *) arg;
+  unsigned long seen = 0;
+  while (1) {
+    pthread_mutex_lock(&pool->lock);
+    while ((pool->generation == seen || !pool->open) && !pool->stopping) {
+      pthread_cond_wait(&pool->wake, &pool->lock);
+    }
+    if (pool->stopping) {
+      pthread_mutex_unlock(&pool->lock);
+      return NULL;
+    }
+    seen = pool->generation;
+    pool->active++;
+    pthread_mutex_unlock(&pool->lock);
+
+    runBands(pool);
+
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->active == 0) {
+      pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+  }
+}
+
+ThreadPool *threadPoolCreate(int threads) {
+  if (threads < 1) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = cpus > 0 ? (int) cpus : 1;
+  }
+  ThreadPool *pool = (ThreadPool *) calloc(1, sizeof(ThreadPool));
+  if (pool == NULL) {
+    return NULL;
+  }
+  pool->workers = (pthread_t *) malloc(sizeof(pthread_t) * threads);
+  if (pool->workers == NULL) {
+    free(pool);
+    return NULL;
+  }
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_mutex_init(&pool->busy, NULL);
+  pthread_cond_init(&pool->wake, NULL);
+  pthread_cond_init(&pool->done, NULL);
+
+  // a pool that can't start all its threads just runs with fewer
+  pool->threads = 1;
+  for (int i = 0; i<threads - 1; i++) {
+    if (pthread_create(&pool->workers[i], NULL, poolWorker, pool) != 0) {
+      break;
+    }
+    pool->threads++;
+  }
+  return pool;
+}
+
+void threadPoolDestroy(ThreadPool *pool) {
+  if (pool == NULL) return;
+  pthread_mutex_lock(&pool->lock);
+  pool->stopping = 1;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+  for (int i = 0; i<pool->threads - 1; i++) {
+    pthread_join(pool->workers[i], NULL);
+  }
+  pthread_mutex_destroy(&pool->lock);
+  pthread_mutex_destroy(&pool->busy);
+  pthread_cond_destroy(&pool->wake);
+  pthread_cond_destroy(&pool->done);
+  free(pool->workers);
+  free(pool);
+}
+
+int threadPoolThreads(const ThreadPool *pool) {
+  return pool->threads;
+}
+
+void threadPoolFor(ThreadPool *pool, int begin, int end, RangeFunction fn, void *context) {
+  if (end <= begin) {
+    return;
+  }
+  int count = end - begin;
+  if (pool->threads == 1 || count == 1 || pthread_mutex_trylock(&pool->busy) != 0) {
+    fn(context, begin, end);
+    return;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  pool->fn = fn;
+  pool->context = context;
+  pool->begin = begin;
+  pool->end = end;
+  pool->bands = count < pool->threads * BANDS_PER_THREAD ? count : pool->threads * BANDS_PER_THREAD;
+  pool->nextBand = 0;
+  pool->open = 1;
+  pool->generation++;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+
+  runBands(pool);
+
+  // every band has been claimed; wait for the workers still running theirs
+  pthread_mutex_lock(&pool->lock);
+  while (pool->active > 0) {
+    pthread_cond_wait(&pool->done, &pool->lock);
+  }
+  pool->open = 0;
+  pthread_mutex_unlock(&pool->lock);
+  pthread_mutex_unlock(&pool->busy);
+}
+
+/*
+ * The shared pool behind parallelFor()
+ */
+
+static int sharedThreads = 0;
+static size_t sharedThreshold = PARALLEL_DEFAULT_THRESHOLD;
+static ThreadPool *sharedPool = NULL;
+static pthread_once_t sharedOnce = PTHREAD_ONCE_INIT;
+
+static void createSharedPool(void) {
+  sharedPool = threadPoolCreate(sharedThreads);
+}
+
+void parallelSetThreads(int threads) {
+  sharedThreads = threads < 0 ? 0 : threads;
+}
+
+void parallelSetThreshold(size_t bytes) {
+  sharedThreshold = bytes;
+}
+
+void parallelFor(int begin, int end, size_t bytesPerItem, RangeFunction fn, void *context) {
+  if (end <= begin) {
+    return;
+  }
+  if (sharedThreads == 1 || (size_t) (end - begin) * bytesPerItem < sharedThreshold) {
+    fn(context, begin, end);
+    return;
+  }
+  pthread_once(&sharedOnce, createSharedPool);
+  if (sharedPool == NULL) {
+    fn(context, begin, end);
+    return;
+  }
+  threadPoolFor(sharedPool, begin, end, fn, context);
+}
+
+int parallelWouldSplit(size_t bytes) {
+  if (sharedThreads == 1 || bytes < sharedThreshold) {
+    return 0;
+  }
+  pthread_once(&sharedOnce, createSharedPool);
+  return sharedPool != NULL && threadPoolThreads(sharedPool) > 1;
+}
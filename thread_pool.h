@@ -0,0 +1,83 @@
+/**
+ * A small pthread pool for splitting loops over rows (or tiles) across
+ * cores.
+ *
+ * Most callers just use parallelFor(), which runs on a process-wide pool
+ * created the first time it is needed.  Its size and the amount of work
+ * below which loops stay on the calling thread are set with
+ * parallelSetThreads() and parallelSetThreshold().
+ */
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <stddef.h>
+
+/**
+ * Work below this many bytes (rows x bytes per row) runs serially by
+ * default; waking the pool costs more than it saves on small images.
+ */
+#define PARALLEL_DEFAULT_THRESHOLD (1 << 20)
+
+typedef struct ThreadPool ThreadPool;
+
+/**
+ * Processes the items [begin, end) of a loop.
+ */
+typedef void (*RangeFunction)(void *context, int begin, int end);
+
+/**
+ * Creates a pool that runs loops on the given number of threads,
+ * counting the thread that calls threadPoolFor().  0 means one per
+ * online CPU.
+ *
+ * @return The pool, or NULL if it couldn't be created.
+ */
+ThreadPool *threadPoolCreate(int threads);
+
+/**
+ * Stops the pool's threads and releases it.  Passing NULL is a no-op.
+ */
+void threadPoolDestroy(ThreadPool *pool);
+
+/**
+ * Returns the number of threads a pool runs loops on.
+ */
+int threadPoolThreads(const ThreadPool *pool);
+
+/**
+ * Splits [begin, end) into bands and runs fn on them across the pool,
+ * returning once every band is done.  If the pool is already running a
+ * loop for another thread, the whole range runs on the calling thread
+ * instead of waiting.
+ */
+void threadPoolFor(ThreadPool *pool, int begin, int end, RangeFunction fn, void *context);
+
+/**
+ * Sets the number of threads parallelFor() uses: 0 for one per online
+ * CPU (the default), 1 to keep everything serial.  Takes effect the next
+ * time the shared pool is created, so call it before any image work.
+ */
+void parallelSetThreads(int threads);
+
+/**
+ * Sets the amount of work, in bytes, below which parallelFor() runs the
+ * loop on the calling thread.
+ */
+void parallelSetThreshold(size_t bytes);
+
+/**
+ * Runs fn over [begin, end) on the shared pool, or directly on the
+ * calling thread when there is only one thread or the loop is smaller
+ * than the threshold.  bytesPerItem is a rough count of the bytes one
+ * item reads and writes, used only for that decision.
+ */
+void parallelFor(int begin, int end, size_t bytesPerItem, RangeFunction fn, void *context);
+
+/**
+ * Returns 1 if parallelFor() would spread a loop over this many bytes
+ * across more than one thread, for callers choosing between a parallel
+ * algorithm and a faster serial one.
+ */
+int parallelWouldSplit(size_t bytes);
+
+#endif
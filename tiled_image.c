@@ -0,0 +1,315 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "tiled_image.h"
+#include "jpeg_coefficients.h"
+#include "jpeg_decoder.h"
+
+#define TILE_SHIFT 8
+#define TILE_MASK (TILE_SIZE - 1)
+
+typedef char tileSizeCheck[((1 << TILE_SHIFT) == TILE_SIZE) ? 1 : -1];
+
+static const char *scratchDirectory = NULL;
+
+void tiledSetScratchDirectory(const char *directory) {
+  scratchDirectory = directory;
+}
+
+/**
+ * Creates a scratch file in the scratch directory and unlinks it, so it
+ * goes away with its last descriptor or mapping.
+ *
+ * @return The file's descriptor, or -1 on failure.
+ */
+static int openScratch(void) {
+  const char *directory = scratchDirectory;
+  if (directory == NULL) {
+    directory = getenv("TMPDIR");
+  }
+  if (directory == NULL || directory[0] == '\0') {
+    directory = "/var/tmp";
+  }
+  size_t size = strlen(directory) + sizeof("/tiledXXXXXX");
+  char *path = (char *) malloc(size);
+  if (path == NULL) {
+    return -1;
+  }
+  snprintf(path, size, "%s/tiledXXXXXX", directory);
+  int fd = mkstemp(path);
+  if (fd >= 0) {
+    unlink(path);
+  }
+  free(path);
+  return fd;
+}
+
+TiledImage *tiledCreate(int height, int width, int channels) {
+  if (height < 1 || width < 1 || channels < 1 || channels > 4) {
+    jpegFail("invalid image size");
+    return NULL;
+  }
+  int tilesWide = (width - 1) / TILE_SIZE + 1;
+  int tilesHigh = (height - 1) / TILE_SIZE + 1;
+  size_t tileBytes = (size_t) TILE_SIZE * TILE_SIZE * channels;
+  if ((size_t) tilesWide * tilesHigh > SIZE_MAX / tileBytes) {
+    jpegFail("image too large");
+    return NULL;
+  }
+
+  TiledImage *image = (TiledImage *) malloc(sizeof(TiledImage));
+  if (image == NULL) {
+    jpegFail("out of memory");
+    return NULL;
+  }
+  image->width = width;
+  image->height = height;
+  image->channels = channels;
+  image->transform = TRANSFORM_IDENTITY;
+  image->tilesWide = tilesWide;
+  image->tilesHigh = tilesHigh;
+  image->length = tileBytes * tilesWide * tilesHigh;
+  image->linesStreamed = (unsigned *) calloc(tilesWide > tilesHigh ? tilesWide : tilesHigh, sizeof(unsigned));
+  if (image->linesStreamed == NULL) {
+    free(image);
+    jpegFail("out of memory");
+    return NULL;
+  }
+
+  int fd = openScratch();
+  if (fd < 0) {
+    free(image->linesStreamed);
+    free(image);
+    jpegFail("unable to create scratch file");
+    return NULL;
+  }
+  // reserving the space now turns a full disk into an error here, rather than a SIGBUS on some later write
+  if (posix_fallocate(fd, 0, (off_t) image->length) != 0) {
+    close(fd);
+    free(image->linesStreamed);
+    free(image);
+    jpegFail("not enough space for scratch file");
+    return NULL;
+  }
+  void *tiles = mmap(NULL, image->length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (tiles == MAP_FAILED) {
+    free(image->linesStreamed);
+    free(image);
+    jpegFail("unable to map scratch file");
+    return NULL;
+  }
+  image->tiles = (unsigned char *) tiles;
+  return image;
+}
+
+void tiledFree(TiledImage *image) {
+  if (image == NULL) return;
+  munmap(image->tiles, image->length);
+  free(image->linesStreamed);
+  free(image);
+}
+
+/**
+ * Returns the transform that undoes the given one.
+ */
+static Transform inverseTransform(Transform transform) {
+  Transform inverse = TRANSFORM_IDENTITY;
+  while (composeTransforms(transform, inverse) != TRANSFORM_IDENTITY) {
+    inverse = (Transform) (inverse + 1);
+  }
+  return inverse;
+}
+
+/**
+ * Copies row `row` of the image as currently oriented between the tiles
+ * and pixels, into the tiles if store is nonzero.  Whatever the
+ * orientation, the row is a straight line through the stored image, along
+ * a stored row or column in either direction, so it is walked a tile at a
+ * time, copying the run of pixels that lies in each.
+ *
+ * @return The stored row (or, if the axes are swapped, column) of tiles
+ *         the row lies in.
+ */
+static int copyRow(TiledImage *image, int row, unsigned char *pixels, int store) {
+  Transform back = inverseTransform(image->transform);
+  int n = image->channels;
+  int i, j, di = 0, dj = 0;
+  transformPoint(back, image->height, image->width, row, 0, &i, &j);
+  int line = (transformSwapsAxes(image->transform) ? j : i) >> TILE_SHIFT;
+  if (image->width > 1) {
+    int nextI, nextJ;
+    transformPoint(back, image->height, image->width, row, 1, &nextI, &nextJ);
+    di = nextI - i;
+    dj = nextJ - j;
+  }
+  size_t tileBytes = (size_t) TILE_SIZE * TILE_SIZE * n;
+  ptrdiff_t step = ((ptrdiff_t) di * TILE_SIZE + dj) * n;
+
+  for (int done = 0; done<image->width; ) {
+    int ri = i & TILE_MASK;
+    int rj = j & TILE_MASK;
+    // pixels left in this tile in the direction of the walk
+    int run = dj > 0 ? TILE_SIZE - rj : dj < 0 ? rj + 1 : di > 0 ? TILE_SIZE - ri : ri + 1;
+    if (run > image->width - done) {
+      run = image->width - done;
+    }
+    unsigned char *tile = image->tiles + tileBytes * ((size_t) (i >> TILE_SHIFT) * image->tilesWide + (j >> TILE_SHIFT));
+    unsigned char *p = tile + ((size_t) ri * TILE_SIZE + rj) * n;
+    unsigned char *dst = store ? p : pixels;
+    const unsigned char *src = store ? pixels : p;
+    if (step == n) {
+      memcpy(dst, src, (size_t) run * n);
+    } else {
+      ptrdiff_t dstStep = store ? step : n;
+      ptrdiff_t srcStep = store ? n : step;
+      for (int k = 0; k<run; k++, dst += dstStep, src += srcStep) {
+        for (int c = 0; c<n; c++) {
+          dst[c] = src[c];
+        }
+      }
+    }
+    pixels += (size_t) run * n;
+    i += di * run;
+    j += dj * run;
+    done += run;
+  }
+  return line;
+}
+
+/**
+ * Counts a row read or written in the given stored row (or column) of
+ * tiles.  Once every row of it has been, that line of tiles is finished,
+ * so its resident pages are dropped: they stay in the page cache or go
+ * back to the file, and are just faulted in again if they are needed.
+ * Rows in other lines, which may still be in use, are left alone.
+ */
+static void noteRow(TiledImage *image, int line) {
+  // every current row is one stored row (or column), so the last line of tiles may hold fewer
+  int lines = image->height - line * TILE_SIZE < TILE_SIZE ? image->height - line * TILE_SIZE : TILE_SIZE;
+  if (__sync_add_and_fetch(&image->linesStreamed[line], 1) % lines != 0) {
+    return;
+  }
+  size_t tileBytes = (size_t) TILE_SIZE * TILE_SIZE * image->channels;
+  if (!transformSwapsAxes(image->transform)) {
+    madvise(image->tiles + tileBytes * line * image->tilesWide, tileBytes * image->tilesWide, MADV_DONTNEED);
+    return;
+  }
+  for (int t = 0; t<image->tilesHigh; t++) {
+    madvise(image->tiles + tileBytes * ((size_t) t * image->tilesWide + line), tileBytes, MADV_DONTNEED);
+  }
+}
+
+void tiledReadRow(TiledImage *image, int row, unsigned char *pixels) {
+  noteRow(image, copyRow(image, row, pixels, 0));
+}
+
+void tiledWriteRow(TiledImage *image, int row, const unsigned char *pixels) {
+  noteRow(image, copyRow(image, row, (unsigned char *) pixels, 1));
+}
+
+/**
+ * Moves a decoded image into a new tiled image, releasing it.
+ */
+static TiledImage *fromDecoded(Image *decoded) {
+  if (decoded == NULL) {
+    return NULL;
+  }
+  TiledImage *image = tiledCreate(decoded->height, decoded->width, decoded->channels);
+  if (image == NULL) {
+    fprintf(stderr, "Unable to create tiled image: %s\n", jpegFailureReason());
+  } else {
+    for (int i = 0; i<decoded->height; i++) {
+      tiledWriteRow(image, i, decoded->data + decoded->stride * i);
+    }
+  }
+  imageFree(decoded);
+  return image;
+}
+
+static void storeRow(void *context, int row, const unsigned char *pixels) {
+  tiledWriteRow((TiledImage *) context, row, pixels);
+}
+
+/**
+ * Decodes a JPEG into a new tiled image a band of tiles at a time, so only
+ * the band is ever in memory.
+ *
+ * @return The image, or NULL if the file can't be decoded in bands (or is
+ *         no taller than one band, which stb decodes faster whole).
+ */
+static TiledImage *streamJpeg(const unsigned char *buffer, size_t length, int channels) {
+  JpegCoefImage frame;
+  if (channels < 1 || channels > 4 || !jpegReadFrame(buffer, length, &frame) || frame.height <= TILE_SIZE) {
+    return NULL;
+  }
+  ImageInfo info = { frame.width, frame.height, frame.numComponents, 8 };
+  if (!imageWithinBudgetBytes(&info, jpegDecodeRowsMemory(&frame, channels, TILE_SIZE))) {
+    return NULL;
+  }
+  TiledImage *image = tiledCreate(frame.height, frame.width, channels);
+  if (image != NULL && !jpegDecodeRows(buffer, length, channels, TILE_SIZE, storeRow, image)) {
+    tiledFree(image);
+    image = NULL;
+  }
+  return image;
+}
+
+TiledImage *tiledLoad(const char *filePath, int channels) {
+  // the file is read once, since standard input can't be read again for the fallback
+  JpegFileData input;
+  if (!jpegMapFile(filePath, &input)) {
+    fprintf(stderr, "Unable to load %s: %s\n", filePath, jpegFailureReason());
+    return NULL;
+  }
+  TiledImage *image = tiledLoadFromMemory(input.data, input.length, channels);
+  jpegUnmapFile(&input);
+  return image;
+}
+
+TiledImage *tiledLoadFromMemory(const unsigned char *buffer, size_t length, int channels) {
+  TiledImage *image = streamJpeg(buffer, length, channels);
+  return image != NULL ? image : fromDecoded(imageLoadFromMemory(buffer, length, channels));
+}
+
+static const unsigned char *tiledRows(void *context, int row, unsigned char *buffer) {
+  tiledReadRow((TiledImage *) context, row, buffer);
+  return buffer;
+}
+
+int tiledSave(const char *filePath, TiledImage *image) {
+  return imageSaveRows(filePath, image->height, image->width, image->channels, tiledRows, image);
+}
+
+void tiledTransform(TiledImage *image, Transform transform) {
+  // the rows counted so far belong to lines of tiles of the old orientation
+  memset(image->linesStreamed, 0, sizeof(unsigned) * (image->tilesWide > image->tilesHigh ? image->tilesWide :
+                                                      image->tilesHigh));
+  image->transform = composeTransforms(image->transform, transform);
+  if (transformSwapsAxes(transform)) {
+    int t = image->width;
+    image->width = image->height;
+    image->height = t;
+  }
+}
+
+void tiledFlipHorizontal(TiledImage *image) {
+  tiledTransform(image, TRANSFORM_FLIP_HORIZONTAL);
+}
+
+void tiledFlipVertical(TiledImage *image) {
+  tiledTransform(image, TRANSFORM_ROTATE_180);
+}
+
+void tiledRotateClockwise(TiledImage *image) {
+  tiledTransform(image, TRANSFORM_ROTATE_90);
+}
+
+void tiledRotateCounterClockwise(TiledImage *image) {
+  tiledTransform(image, TRANSFORM_ROTATE_270);
+}
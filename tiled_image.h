@@ -0,0 +1,135 @@
+/**
+ * An out-of-core image store, for images too large to hold in memory.
+ *
+ * The pixels live in square tiles of TILE_SIZE x TILE_SIZE in a scratch
+ * file that is mapped into memory, so tiles are paged in as they are
+ * touched, and the kernel can write them back and drop them when memory
+ * runs short.  Rows are streamed in and out, and as each row (or column)
+ * of tiles is finished its resident pages are dropped, so only about one
+ * band of tiles stays resident however large the image is.
+ *
+ * JPEGs are decoded straight into the tiles a band at a time, so the bound
+ * holds from loading through saving.  Other files, and JPEGs the banded
+ * decoder doesn't take, are decoded whole in memory first (see tiledLoad()).
+ *
+ * Flips and rotations move no pixels.  The image keeps the transform from
+ * its stored tiles to its current orientation and each operation composes
+ * onto it; reading a row walks the tiles through the remapped coordinates,
+ * copying a run of pixels from each.
+ *
+ * The scratch file goes in the directory set with
+ * tiledSetScratchDirectory(), or else $TMPDIR or /var/tmp.  It is unlinked
+ * as soon as it is created, so nothing is left behind.  That directory
+ * should be on a disk: a tmpfs directory keeps the tiles in memory (or swap)
+ * after all.
+ */
+#ifndef TILED_IMAGE_H
+#define TILED_IMAGE_H
+
+#include <stddef.h>
+
+#include "image_utils.h"
+
+/**
+ * The side of a tile, in pixels.
+ */
+#define TILE_SIZE 256
+
+typedef struct {
+  int width;                // as currently oriented
+  int height;
+  int channels;             // 1 to 4 bytes per pixel
+  Transform transform;      // from the stored tiles to the current orientation
+  int tilesWide;            // tiles across the stored image
+  int tilesHigh;
+  unsigned char *tiles;     // the mapped scratch file, tile after tile in row order
+  size_t length;
+  unsigned *linesStreamed;  // rows read or written in each stored row (or column) of tiles,
+                            // for dropping the resident pages of finished ones
+} TiledImage;
+
+/**
+ * Sets the directory new images put their scratch files in, or NULL for
+ * the default ($TMPDIR, or /var/tmp).
+ */
+void tiledSetScratchDirectory(const char *directory);
+
+/**
+ * Creates a (height x width) image with the given number of channels
+ * (1 to 4), backed by a new scratch file with its space reserved up front.
+ * The pixels start out zero.
+ *
+ * @return The new image, or NULL on failure (see jpegFailureReason()).
+ */
+TiledImage *tiledCreate(int height, int width, int channels);
+
+/**
+ * Releases an image and its scratch file.  Passing NULL is a no-op.
+ */
+void tiledFree(TiledImage *image);
+
+/**
+ * Loads an image file into a new tiled image with the given number of
+ * channels.  Baseline JPEGs taller than a tile are decoded a band of tiles
+ * at a time (see jpegDecodeRows()), so only the band is held in memory.
+ * Anything else, including progressive JPEGs, is decoded whole first, in
+ * as much memory as imageLoad() takes, and released once the rows are in
+ * the tiles.
+ *
+ * @return The loaded image, or NULL on failure.
+ */
+TiledImage *tiledLoad(const char *filePath, int channels);
+
+/**
+ * Loads an image from an encoded file held in memory, as tiledLoad().
+ */
+TiledImage *tiledLoadFromMemory(const unsigned char *buffer, size_t length, int channels);
+
+/**
+ * Saves the image as currently oriented, with the options set by
+ * imageSetSaveOptions().  JPEGs are streamed out a strip at a time,
+ * straight from the tiles.
+ *
+ * @return 1 on success, 0 on failure.
+ */
+int tiledSave(const char *filePath, TiledImage *image);
+
+/**
+ * Copies row `row` of the image as currently oriented into pixels
+ * (width x channels bytes).  Rows may be read from several threads at once.
+ */
+void tiledReadRow(TiledImage *image, int row, unsigned char *pixels);
+
+/**
+ * Stores width x channels bytes of pixels as row `row` of the image as
+ * currently oriented.
+ */
+void tiledWriteRow(TiledImage *image, int row, const unsigned char *pixels);
+
+/**
+ * Applies a transform to the image.  Only the image's orientation and
+ * dimensions change; the tiles are left as they are.
+ */
+void tiledTransform(TiledImage *image, Transform transform);
+
+/**
+ * Flips the image horizontally.
+ */
+void tiledFlipHorizontal(TiledImage *image);
+
+/**
+ * Flips the image vertically, with the same result as flipVertical().
+ */
+void tiledFlipVertical(TiledImage *image);
+
+/**
+ * Rotates the image 90 degrees clockwise.
+ */
+void tiledRotateClockwise(TiledImage *image);
+
+/**
+ * Rotates the image 90 degrees counter-clockwise.
+ */
+void tiledRotateCounterClockwise(TiledImage *image);
+
+#endif